@@ -0,0 +1,176 @@
+/* Timing, hardware counters and output shared by fex_bench and
+ * fex_bench_io */
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64 */
+uint64_t bench_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* Write size pseudo-random bytes to path; the same size always gives the
+ * same bytes */
+int bench_write_random(const char *path, long long size) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  static uint64_t chunk[8192];
+  uint64_t state = 0x2545f4914f6cdd1dull ^ (uint64_t)size;
+  for (long long written = 0; written < size;) {
+    for (size_t i = 0; i < sizeof(chunk) / sizeof(chunk[0]); i++)
+      chunk[i] = bench_random(&state);
+    size_t n = size - written < (long long)sizeof(chunk)
+                   ? (size_t)(size - written)
+                   : sizeof(chunk);
+    if (fwrite(chunk, 1, n, fp) != n) {
+      fclose(fp);
+      return -1;
+    }
+    written += n;
+  }
+  return fclose(fp);
+}
+
+/* Evict a file's clean pages so the next read comes from the device */
+void bench_drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+/* User-space counts only, so the default perf_event_paranoid allows it;
+ * inherited only by threads started while counting, so callers count in
+ * a process whose render pool has not started yet */
+static int open_counter(uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_perf_start(bench_perf_t *perf) {
+  perf->cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+  perf->misses_fd = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+  if (perf->cycles_fd >= 0)
+    ioctl(perf->cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+  if (perf->misses_fd >= 0)
+    ioctl(perf->misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static long long read_counter(int fd) {
+  if (fd < 0)
+    return -1;
+  long long count;
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+    count = -1;
+  close(fd);
+  return count;
+}
+
+void bench_perf_stop(bench_perf_t *perf, bench_result_t *result) {
+  result->cycles = read_counter(perf->cycles_fd);
+  result->misses = read_counter(perf->misses_fd);
+}
+
+/* Split a comma-separated option value into list */
+int bench_parse_list(char *value, bench_list_t *list) {
+  list->count = 0;
+  for (char *item = strtok(value, ","); item; item = strtok(NULL, ",")) {
+    if (list->count == BENCH_LIST_MAX)
+      return -1;
+    list->items[list->count++] = item;
+  }
+  return list->count ? 0 : -1;
+}
+
+int bench_list_has(const bench_list_t *list, const char *name) {
+  for (int i = 0; i < list->count; i++) {
+    if (strcmp(list->items[i], name) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Parse a size with an optional K, M or G suffix; -1 if invalid */
+long long bench_parse_size(const char *text) {
+  char *end;
+  long long value = strtoll(text, &end, 10);
+  switch (*end) {
+  case 'K':
+  case 'k':
+    value <<= 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    value <<= 20;
+    end++;
+    break;
+  case 'G':
+  case 'g':
+    value <<= 30;
+    end++;
+    break;
+  }
+  return (*end == '\0' && value > 0) ? value : -1;
+}
+
+void bench_print_header(void) {
+  printf("mode\top\tformat\tsize\tblock\tcache\tbytes\tops\tseconds\t"
+         "GB/s\tns/op\tcycles/B\tmisses/B\n");
+  fflush(stdout);
+}
+
+static void format_value(char *buf, size_t size, int valid, const char *fmt,
+                         double value) {
+  if (valid)
+    snprintf(buf, size, fmt, value);
+  else
+    snprintf(buf, size, "-");
+}
+
+/* Values that do not apply (no output bytes, no counters) print as "-" */
+void bench_print_row(const bench_result_t *r) {
+  char block[32], gbps[32], ns[32], cycles[32], misses[32];
+  format_value(block, sizeof(block), r->block > 0, "%.0f", r->block);
+  format_value(gbps, sizeof(gbps), r->bytes > 0, "%.3f",
+               r->bytes / r->seconds / 1e9);
+  format_value(ns, sizeof(ns), r->ops > 0, "%.1f", r->seconds * 1e9 / r->ops);
+  format_value(cycles, sizeof(cycles), r->cycles >= 0 && r->bytes > 0, "%.3f",
+               (double)r->cycles / r->bytes);
+  format_value(misses, sizeof(misses), r->misses >= 0 && r->bytes > 0,
+               "%.5f", (double)r->misses / r->bytes);
+  printf("%s\t%s\t%s\t%lld\t%s\t%s\t%lld\t%lld\t%.6f\t%s\t%s\t%s\t%s\n",
+         r->mode, r->op, r->format, r->size, block, r->cache, r->bytes,
+         r->ops, r->seconds, gbps, ns, cycles, misses);
+  fflush(stdout);
+}
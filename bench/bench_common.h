@@ -0,0 +1,48 @@
+#ifndef FEX_BENCH_COMMON_H
+#define FEX_BENCH_COMMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BENCH_LIST_MAX 32 /* Values per list option */
+
+/* Values of a comma-separated option */
+typedef struct {
+  char *items[BENCH_LIST_MAX];
+  int count;
+} bench_list_t;
+
+/* One measured case, printed as a tab-separated row */
+typedef struct {
+  const char *mode;   /* "api" (in-process) or "preload" */
+  const char *op;     /* Workload, e.g. "read" or "lseek" */
+  const char *format; /* FEX_FORMAT name */
+  long long size;     /* Source bytes */
+  long block;         /* FEX_BLOCK_SIZE, or 0 where it does not apply */
+  const char *cache;  /* "warm" or "cold" page cache */
+  long long bytes;    /* Rendered bytes produced */
+  long long ops;      /* Calls made */
+  double seconds;
+  long long cycles; /* -1 when perf_event_open is not permitted */
+  long long misses;
+} bench_result_t;
+
+/* Hardware counters of this process and the threads it starts */
+typedef struct {
+  int cycles_fd;
+  int misses_fd;
+} bench_perf_t;
+
+double bench_now(void);
+uint64_t bench_random(uint64_t *state);
+int bench_write_random(const char *path, long long size);
+void bench_drop_cache(const char *path);
+void bench_perf_start(bench_perf_t *perf);
+void bench_perf_stop(bench_perf_t *perf, bench_result_t *result);
+int bench_parse_list(char *value, bench_list_t *list);
+int bench_list_has(const bench_list_t *list, const char *name);
+long long bench_parse_size(const char *text);
+void bench_print_header(void);
+void bench_print_row(const bench_result_t *result);
+
+#endif /* FEX_BENCH_COMMON_H */
@@ -0,0 +1,340 @@
+/* fex_bench - micro-benchmarks of the rendering engine
+ *
+ * Every case renders a generated source of random bytes and prints one
+ * tab-separated row: output GB/s, ns per call and, where perf_event_open
+ * is permitted, cycles and cache misses per output byte. Rows are stable
+ * in order and layout, so runs of two versions can be diffed.
+ *
+ * "api" rows drive the engine through fex_open() and fex_read_at(), each
+ * case in a forked process of its own. "preload" rows run fex_bench_io
+ * with libfex preloaded, once per block size, for read, fread, fgetc,
+ * getc, lseek and stat.
+ */
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include "fex.h"
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_CHUNK (64 * 1024) /* Bytes per fex_read_at() */
+#define BENCH_RANDOM_READ 4096  /* Bytes per random fex_read_at() */
+#define BENCH_BATCH 1024        /* Calls between clock checks */
+static const struct {
+  const char *name;
+  int format;
+} formats[] = {
+    {"c", FEX_FORMAT_C_ARRAY},
+    {"incbin", FEX_FORMAT_INCBIN},
+    {"embed", FEX_FORMAT_EMBED},
+    {"zlib", FEX_FORMAT_ZLIB},
+};
+
+static const char *api_ops[] = {"api_read", "api_random", "api_render"};
+static const char *preload_ops[] = {"read",  "fread", "fgetc",
+                                    "getc",  "lseek", "stat"};
+
+static double min_seconds = 0.2;
+static long long char_limit = 16LL * 1024 * 1024;
+static const char *library_path = FEX_BENCH_LIBRARY;
+static const char *io_path = FEX_BENCH_IO;
+
+static int format_id(const char *name) {
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (strcmp(formats[i].name, name) == 0)
+      return formats[i].format;
+  }
+  return -1;
+}
+
+/* Create dir/bench_<size>.fex of random bytes unless it already exists
+ * with that size */
+static int make_source(const char *dir, long long size, char *path,
+                       size_t path_size) {
+  snprintf(path, path_size, "%s/bench_%lld.fex", dir, size);
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size == size)
+    return 0;
+  return bench_write_random(path, size);
+}
+
+/* One in-process case: whole passes of sequential reads or full renders,
+ * or random reads on one handle */
+static int run_api_case(const char *op, const char *path, int format,
+                        bench_result_t *r) {
+  static unsigned char buf[BENCH_CHUNK];
+  fex_options_t opts = {format, NULL};
+  int cold = strcmp(r->cache, "cold") == 0;
+  int null_fd = -1;
+  if (strcmp(op, "api_render") == 0 &&
+      (null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+    return -1;
+
+  bench_perf_t perf;
+  int result = 0;
+  bench_perf_start(&perf);
+  if (strcmp(op, "api_random") == 0) {
+    if (cold)
+      bench_drop_cache(path);
+    double start = bench_now();
+    fex_handle_t *handle = fex_open(path, &opts);
+    off_t size = handle ? fex_size(handle) : 0;
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    result = handle ? 0 : -1;
+    while (result == 0 && bench_now() - start < min_seconds) {
+      for (int i = 0; i < BENCH_BATCH; i++) {
+        ssize_t n = fex_read_at(handle, bench_random(&state) % size, buf,
+                                BENCH_RANDOM_READ);
+        if (n <= 0) {
+          result = -1;
+          break;
+        }
+        r->bytes += n;
+        r->ops++;
+      }
+    }
+    fex_close(handle);
+    r->seconds = bench_now() - start;
+  } else {
+    do {
+      if (cold)
+        bench_drop_cache(path);
+      double start = bench_now();
+      fex_handle_t *handle = fex_open(path, &opts);
+      if (!handle) {
+        result = -1;
+        break;
+      }
+      off_t size = fex_size(handle);
+      if (null_fd >= 0) {
+        result = fex_render_all(handle, null_fd);
+        r->bytes += size;
+        r->ops++;
+      } else {
+        for (off_t offset = 0; offset < size && result == 0;) {
+          ssize_t n = fex_read_at(handle, offset, buf, sizeof(buf));
+          if (n <= 0) {
+            result = -1;
+            break;
+          }
+          offset += n;
+          r->bytes += n;
+          r->ops++;
+        }
+      }
+      fex_close(handle);
+      r->seconds += bench_now() - start;
+    } while (result == 0 && r->seconds < min_seconds);
+  }
+  bench_perf_stop(&perf, r);
+  if (null_fd >= 0)
+    close(null_fd);
+  return result;
+}
+
+/* Run and print one in-process case in a forked child. The render pool
+ * starts on first use, so a fresh process starts it while the counters
+ * run and their inherit flag covers its threads; a pool left over from an
+ * earlier case would render uncounted. */
+static int run_api_child(const char *op, const char *path, int format,
+                         bench_result_t *r) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    if (run_api_case(op, path, format, r) != 0)
+      _exit(1);
+    bench_print_row(r);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return -1;
+  return 0;
+}
+
+/* One preload case, run and printed by fex_bench_io */
+static int run_preload_case(const char *op, const char *path,
+                            const char *format, long long size,
+                            const char *block, const char *cache) {
+  char size_text[32], seconds_text[32], limit_text[32];
+  snprintf(size_text, sizeof(size_text), "%lld", size);
+  snprintf(seconds_text, sizeof(seconds_text), "%g", min_seconds);
+  snprintf(limit_text, sizeof(limit_text), "%lld", char_limit);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    setenv("LD_PRELOAD", library_path, 1);
+    setenv("FEX_BLOCK_SIZE", block, 1);
+    setenv("FEX_FORMAT", format, 1);
+    execl(io_path, "fex_bench_io", op, path, format, size_text, block, cache,
+          seconds_text, limit_text, (char *)NULL);
+    fprintf(stderr, "fex_bench: cannot run %s: %s\n", io_path,
+            strerror(errno));
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return -1;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fex_bench [options]\n"
+          "  --sizes LIST     source sizes, K/M/G suffixes (default "
+          "1K,64K,1M,16M)\n"
+          "  --blocks LIST    FEX_BLOCK_SIZE values (default 4096,65536)\n"
+          "  --formats LIST   c, incbin, embed, zlib (default c)\n"
+          "  --ops LIST       api_read, api_random, api_render, read, fread,\n"
+          "                   fgetc, getc, lseek, stat (default all)\n"
+          "  --cache LIST     warm, cold (default warm,cold)\n"
+          "  --min-time SEC   time per case (default 0.2)\n"
+          "  --char-limit N   bytes per fgetc/getc pass (default 16M)\n"
+          "  --dir DIR        where sources are generated (default a "
+          "temporary directory)\n"
+          "  --library PATH   libfex.so to preload\n"
+          "  --io PATH        fex_bench_io to run under it\n");
+}
+
+int main(int argc, char **argv) {
+  char sizes_default[] = "1K,64K,1M,16M";
+  char blocks_default[] = "4096,65536";
+  char formats_default[] = "c";
+  char cache_default[] = "warm,cold";
+  char ops_default[] =
+      "api_read,api_random,api_render,read,fread,fgetc,getc,lseek,stat";
+  bench_list_t sizes, blocks, format_list, cache, ops;
+  bench_parse_list(sizes_default, &sizes);
+  bench_parse_list(blocks_default, &blocks);
+  bench_parse_list(formats_default, &format_list);
+  bench_parse_list(cache_default, &cache);
+  bench_parse_list(ops_default, &ops);
+  const char *dir = NULL;
+
+  static const struct option options[] = {
+      {"sizes", required_argument, NULL, 's'},
+      {"blocks", required_argument, NULL, 'b'},
+      {"formats", required_argument, NULL, 'f'},
+      {"ops", required_argument, NULL, 'o'},
+      {"cache", required_argument, NULL, 'c'},
+      {"min-time", required_argument, NULL, 't'},
+      {"char-limit", required_argument, NULL, 'n'},
+      {"dir", required_argument, NULL, 'd'},
+      {"library", required_argument, NULL, 'l'},
+      {"io", required_argument, NULL, 'i'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt, bad = 0;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      bad |= bench_parse_list(optarg, &sizes);
+      break;
+    case 'b':
+      bad |= bench_parse_list(optarg, &blocks);
+      break;
+    case 'f':
+      bad |= bench_parse_list(optarg, &format_list);
+      break;
+    case 'o':
+      bad |= bench_parse_list(optarg, &ops);
+      break;
+    case 'c':
+      bad |= bench_parse_list(optarg, &cache);
+      break;
+    case 't':
+      min_seconds = atof(optarg);
+      break;
+    case 'n':
+      char_limit = bench_parse_size(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      library_path = optarg;
+      break;
+    case 'i':
+      io_path = optarg;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  for (int i = 0; i < sizes.count; i++)
+    bad |= bench_parse_size(sizes.items[i]) < 0;
+  for (int i = 0; i < format_list.count; i++)
+    bad |= format_id(format_list.items[i]) < 0;
+  if (bad || optind != argc || min_seconds <= 0 || char_limit <= 0) {
+    usage();
+    return 2;
+  }
+
+  char temp_dir[] = "/tmp/fex_bench_XXXXXX";
+  if (!dir && !(dir = mkdtemp(temp_dir))) {
+    perror("fex_bench: mkdtemp");
+    return 1;
+  }
+
+  bench_print_header();
+  int failures = 0;
+  for (int s = 0; s < sizes.count; s++) {
+    long long size = bench_parse_size(sizes.items[s]);
+    char path[PATH_MAX];
+    if (make_source(dir, size, path, sizeof(path)) != 0) {
+      fprintf(stderr, "fex_bench: cannot create %s\n", path);
+      return 1;
+    }
+
+    for (int f = 0; f < format_list.count; f++) {
+      const char *format = format_list.items[f];
+      for (size_t o = 0; o < sizeof(api_ops) / sizeof(api_ops[0]); o++) {
+        if (!bench_list_has(&ops, api_ops[o]))
+          continue;
+        for (int c = 0; c < cache.count; c++) {
+          bench_result_t r = {"api", api_ops[o], format, size, 0,
+                              cache.items[c], 0, 0, 0, -1, -1};
+          if (run_api_child(api_ops[o], path, format_id(format), &r) != 0) {
+            fprintf(stderr, "fex_bench: %s failed on %s\n", api_ops[o], path);
+            failures++;
+          }
+        }
+      }
+      for (int b = 0; b < blocks.count; b++) {
+        for (size_t o = 0; o < sizeof(preload_ops) / sizeof(preload_ops[0]);
+             o++) {
+          if (!bench_list_has(&ops, preload_ops[o]))
+            continue;
+          for (int c = 0; c < cache.count; c++) {
+            if (run_preload_case(preload_ops[o], path, format, size,
+                                 blocks.items[b], cache.items[c]) != 0)
+              failures++;
+          }
+        }
+      }
+    }
+    if (dir == temp_dir)
+      unlink(path);
+  }
+  if (dir == temp_dir)
+    rmdir(temp_dir);
+  return failures ? 1 : 0;
+}
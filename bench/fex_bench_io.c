@@ -0,0 +1,173 @@
+/* fex_bench_io - the libc side of fex_bench
+ *
+ * Run by fex_bench with libfex preloaded and FEX_BLOCK_SIZE and
+ * FEX_FORMAT set; drives one workload against a .fex path through the
+ * interposed calls and prints one result row. It links nothing of libfex
+ * itself, so every call goes through the preload as in a compiler.
+ *
+ * usage: fex_bench_io op path format size block cache min_seconds
+ *        char_limit
+ */
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BENCH_READ_SIZE (64 * 1024) /* Bytes per read() and fread() */
+#define BENCH_SEEK_READ 4096        /* Bytes read after each lseek() */
+#define BENCH_BATCH 1024            /* Calls between clock checks */
+
+static char buf[BENCH_READ_SIZE];
+static volatile unsigned char_sink; /* Keeps the character loops live */
+
+/* One sequential pass with read() */
+static int pass_read(const char *path, bench_result_t *r) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    r->bytes += n;
+    r->ops++;
+  }
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+/* One sequential pass with fread() */
+static int pass_fread(const char *path, bench_result_t *r) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    r->bytes += n;
+    r->ops++;
+  }
+  int result = ferror(fp) ? -1 : 0;
+  fclose(fp);
+  return result;
+}
+
+/* One pass a character at a time, up to limit bytes */
+static int pass_chars(const char *path, int use_getc, long long limit,
+                      bench_result_t *r) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+  long long count = 0;
+  unsigned sum = 0;
+  int c;
+  if (use_getc) {
+    while (count < limit && (c = getc(fp)) != EOF) {
+      sum += c;
+      count++;
+    }
+  } else {
+    while (count < limit && (c = fgetc(fp)) != EOF) {
+      sum += c;
+      count++;
+    }
+  }
+  fclose(fp);
+  char_sink = sum;
+  r->bytes += count;
+  r->ops += count;
+  return 0;
+}
+
+/* Random 4 KB reads, each after an lseek() */
+static int run_lseek(const char *path, double min_seconds, bench_result_t *r) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  off_t size = lseek(fd, 0, SEEK_END);
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  double start = bench_now();
+  int result = 0;
+  while (result == 0 && size > 0 && bench_now() - start < min_seconds) {
+    for (int i = 0; i < BENCH_BATCH; i++) {
+      off_t offset = bench_random(&state) % size;
+      ssize_t n;
+      if (lseek(fd, offset, SEEK_SET) != offset ||
+          (n = read(fd, buf, BENCH_SEEK_READ)) <= 0) {
+        result = -1;
+        break;
+      }
+      r->bytes += n;
+      r->ops += 2;
+    }
+  }
+  close(fd);
+  return result;
+}
+
+/* Repeated stat() of the path */
+static int run_stat(const char *path, double min_seconds, bench_result_t *r) {
+  struct stat st;
+  double start = bench_now();
+  while (bench_now() - start < min_seconds) {
+    for (int i = 0; i < BENCH_BATCH; i++) {
+      if (stat(path, &st) != 0)
+        return -1;
+    }
+    r->ops += BENCH_BATCH;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 9) {
+    fprintf(stderr, "usage: fex_bench_io op path format size block cache "
+                    "min_seconds char_limit\n");
+    return 2;
+  }
+  const char *op = argv[1];
+  const char *path = argv[2];
+  double min_seconds = atof(argv[7]);
+  long long char_limit = atoll(argv[8]);
+  bench_result_t r = {"preload", op, argv[3], atoll(argv[4]), atol(argv[5]),
+                      argv[6], 0, 0, 0, -1, -1};
+  int cold = strcmp(r.cache, "cold") == 0;
+
+  /* Sequential workloads repeat whole passes, each from a fresh open; the
+   * cache drop before a cold pass is not timed */
+  bench_perf_t perf;
+  int result = 0;
+  bench_perf_start(&perf);
+  if (strcmp(op, "stat") == 0 || strcmp(op, "lseek") == 0) {
+    if (cold)
+      bench_drop_cache(path);
+    double start = bench_now();
+    result = op[0] == 's' ? run_stat(path, min_seconds, &r)
+                          : run_lseek(path, min_seconds, &r);
+    r.seconds = bench_now() - start;
+  } else {
+    do {
+      if (cold)
+        bench_drop_cache(path);
+      double start = bench_now();
+      if (strcmp(op, "read") == 0)
+        result = pass_read(path, &r);
+      else if (strcmp(op, "fread") == 0)
+        result = pass_fread(path, &r);
+      else if (strcmp(op, "fgetc") == 0 || strcmp(op, "getc") == 0)
+        result = pass_chars(path, op[0] == 'g', char_limit, &r);
+      else
+        result = -1;
+      r.seconds += bench_now() - start;
+    } while (result == 0 && r.seconds < min_seconds);
+  }
+  bench_perf_stop(&perf, &r);
+
+  if (result < 0) {
+    fprintf(stderr, "fex_bench_io: %s on %s failed\n", op, path);
+    return 1;
+  }
+  bench_print_row(&r);
+  return 0;
+}
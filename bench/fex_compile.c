@@ -0,0 +1,379 @@
+/* fex_compile - end-to-end compile cost of embedding an asset
+ *
+ * Generates assets of random bytes and compiles a translation unit
+ * embedding each one with the system compiler, in several ways:
+ *
+ *   fex_c, fex_incbin,   #include of the .fex with libfex preloaded,
+ *   fex_embed, fex_zlib  rendered in that FEX_FORMAT
+ *   rendered_c,          the same C text rendered ahead of time through
+ *   rendered_zlib        fex_render_all(), compiled without the preload
+ *   xxd                  the output of xxd -i, compiled without the preload
+ *
+ * Each row gives the fastest compile wall time and CPU time of --repeat
+ * runs and the peak RSS of the compiler's processes (cc1 dominates it).
+ * For fex_c and fex_zlib the preload's CPU share is the extra CPU over
+ * compiling the identical pre-rendered text.
+ */
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include "fex.h"
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define COMPILE_ARGS_MAX 64 /* Words of --cflags */
+
+enum { MODE_PRELOAD, MODE_RENDERED, MODE_XXD };
+
+static const struct {
+  const char *name;
+  int mode;
+  const char *format; /* FEX_FORMAT name */
+  const char *base;   /* Case whose CPU the preload's share is taken over */
+} cases[] = {
+    {"fex_c", MODE_PRELOAD, "c", "rendered_c"},
+    {"rendered_c", MODE_RENDERED, "c", NULL},
+    {"xxd", MODE_XXD, NULL, NULL},
+    {"fex_incbin", MODE_PRELOAD, "incbin", NULL},
+    {"fex_embed", MODE_PRELOAD, "embed", NULL},
+    {"fex_zlib", MODE_PRELOAD, "zlib", "rendered_zlib"},
+    {"rendered_zlib", MODE_RENDERED, "zlib", NULL},
+};
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+/* Best of the runs of one case */
+typedef struct {
+  double wall;
+  double cpu;
+  long rss_kb;
+} compile_result_t;
+
+static const char *compiler = "cc";
+static char *compile_flags[COMPILE_ARGS_MAX];
+static int compile_flag_count = 0;
+static const char *library_path = FEX_BENCH_LIBRARY;
+
+/* Run argv with stdout to out_path (or inherited) and stderr discarded
+ * when quiet, preloading library when set; 0 and the child's usage on
+ * success */
+static int run_command(char *const argv[], const char *library,
+                       const char *format, const char *out_path, int quiet,
+                       compile_result_t *result) {
+  double start = bench_now();
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    if (library) {
+      setenv("LD_PRELOAD", library, 1);
+      setenv("FEX_FORMAT", format, 1);
+    } else {
+      unsetenv("LD_PRELOAD");
+    }
+    if (out_path) {
+      int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        _exit(127);
+      close(fd);
+    }
+    if (quiet) {
+      int fd = open("/dev/null", O_WRONLY);
+      if (fd >= 0)
+        dup2(fd, STDERR_FILENO);
+    }
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  /* The usage of a waited child covers its own waited children, so the
+   * RSS is the largest of the driver, cc1 and as */
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return -1;
+  if (result) {
+    result->wall = bench_now() - start;
+    result->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                  usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->rss_kb = usage.ru_maxrss;
+  }
+  return 0;
+}
+
+/* Compile source to an object in dir */
+static int compile(const char *dir, const char *source, const char *library,
+                   const char *format, int quiet, compile_result_t *result) {
+  char object[PATH_MAX];
+  snprintf(object, sizeof(object), "%s/out.o", dir);
+  char *argv[COMPILE_ARGS_MAX + 8];
+  int argc = 0;
+  argv[argc++] = (char *)compiler;
+  for (int i = 0; i < compile_flag_count; i++)
+    argv[argc++] = compile_flags[i];
+  argv[argc++] = "-c";
+  argv[argc++] = (char *)source;
+  argv[argc++] = "-o";
+  argv[argc++] = object;
+  argv[argc] = NULL;
+  int status = run_command(argv, library, format, NULL, quiet, result);
+  unlink(object);
+  return status;
+}
+
+static int write_text(const char *path, const char *text) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+  fputs(text, fp);
+  return fclose(fp);
+}
+
+/* Render asset in format into path ahead of time */
+static int render_file(const char *asset, const char *format,
+                       const char *path) {
+  fex_options_t opts = {strcmp(format, "zlib") == 0 ? FEX_FORMAT_ZLIB
+                                                    : FEX_FORMAT_C_ARRAY,
+                        NULL};
+  fex_handle_t *handle = fex_open(asset, &opts);
+  if (!handle)
+    return -1;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int result = fd >= 0 ? fex_render_all(handle, fd) : -1;
+  if (fd >= 0 && close(fd) != 0)
+    result = -1;
+  fex_close(handle);
+  return result;
+}
+
+/* Prepare the translation unit of one case in unit. Every case includes
+ * its array, so all compile the same way: the .fex itself, or a file
+ * rendered ahead of time into included. */
+static int prepare_case(size_t c, const char *dir, const char *asset,
+                        char *unit, size_t unit_size, char *included,
+                        size_t included_size) {
+  snprintf(unit, unit_size, "%s/%s.c", dir, cases[c].name);
+  snprintf(included, included_size, "%s/%s.inc", dir, cases[c].name);
+  const char *target = asset;
+  if (cases[c].mode != MODE_PRELOAD) {
+    char *argv[] = {"xxd", "-i", (char *)asset, NULL};
+    int result = cases[c].mode == MODE_RENDERED
+                     ? render_file(asset, cases[c].format, included)
+                     : run_command(argv, NULL, NULL, included, 0, NULL);
+    if (result != 0)
+      return -1;
+    target = included;
+  }
+  char text[PATH_MAX + 32];
+  snprintf(text, sizeof(text), "#include \"%s\"\n", target);
+  return write_text(unit, text);
+}
+
+/* Whether the compiler takes C23 #embed */
+static int compiler_has_embed(const char *dir) {
+  char unit[PATH_MAX];
+  snprintf(unit, sizeof(unit), "%s/probe.c", dir);
+  int ok = write_text(unit, "const char probe[] = {\n#embed __FILE__\n};\n") ==
+               0 &&
+           compile(dir, unit, NULL, NULL, 1, NULL) == 0;
+  unlink(unit);
+  return ok;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fex_compile [options]\n"
+          "  --sizes LIST     asset sizes, K/M/G suffixes (default "
+          "64K,1M,16M;\n"
+          "                   up to 512M)\n"
+          "  --cases LIST     fex_c, rendered_c, xxd, fex_incbin, "
+          "fex_embed,\n"
+          "                   fex_zlib, rendered_zlib (default all)\n"
+          "  --cc PATH        compiler (default $CC or cc)\n"
+          "  --cflags FLAGS   compiler flags (default -O2)\n"
+          "  --repeat N       compiles per case; the fastest counts "
+          "(default 3)\n"
+          "  --dir DIR        where assets are generated (default a "
+          "temporary directory)\n"
+          "  --library PATH   libfex.so to preload\n");
+}
+
+int main(int argc, char **argv) {
+  char sizes_default[] = "64K,1M,16M";
+  char cases_default[] =
+      "fex_c,rendered_c,xxd,fex_incbin,fex_embed,fex_zlib,rendered_zlib";
+  char flags_default[] = "-O2";
+  char *flags = flags_default;
+  bench_list_t sizes, selected;
+  bench_parse_list(sizes_default, &sizes);
+  bench_parse_list(cases_default, &selected);
+  int repeat = 3;
+  const char *dir = NULL;
+  if (getenv("CC") && *getenv("CC"))
+    compiler = getenv("CC");
+
+  static const struct option options[] = {
+      {"sizes", required_argument, NULL, 's'},
+      {"cases", required_argument, NULL, 'c'},
+      {"cc", required_argument, NULL, 'C'},
+      {"cflags", required_argument, NULL, 'f'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"dir", required_argument, NULL, 'd'},
+      {"library", required_argument, NULL, 'l'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt, bad = 0;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      bad |= bench_parse_list(optarg, &sizes);
+      break;
+    case 'c':
+      bad |= bench_parse_list(optarg, &selected);
+      break;
+    case 'C':
+      compiler = optarg;
+      break;
+    case 'f':
+      flags = optarg;
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      library_path = optarg;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  for (int i = 0; i < sizes.count; i++)
+    bad |= bench_parse_size(sizes.items[i]) < 0;
+  for (int i = 0; i < selected.count; i++) {
+    size_t c = 0;
+    while (c < CASE_COUNT && strcmp(cases[c].name, selected.items[i]) != 0)
+      c++;
+    bad |= c == CASE_COUNT;
+  }
+  for (char *word = strtok(flags, " "); word && !bad;
+       word = strtok(NULL, " ")) {
+    if (compile_flag_count == COMPILE_ARGS_MAX)
+      bad = 1;
+    else
+      compile_flags[compile_flag_count++] = word;
+  }
+  if (bad || optind != argc || repeat < 1) {
+    usage();
+    return 2;
+  }
+
+  char temp_dir[] = "/tmp/fex_compile_XXXXXX";
+  if (!dir && !(dir = mkdtemp(temp_dir))) {
+    perror("fex_compile: mkdtemp");
+    return 1;
+  }
+  int has_embed = compiler_has_embed(dir);
+  if (!has_embed && bench_list_has(&selected, "fex_embed"))
+    fprintf(stderr, "fex_compile: %s has no #embed; fex_embed skipped\n",
+            compiler);
+
+  printf("case\tsize\twall_s\tcpu_s\tpeak_rss_kb\tpreload_cpu_%%\n");
+  fflush(stdout);
+  int failures = 0;
+  for (int s = 0; s < sizes.count; s++) {
+    long long size = bench_parse_size(sizes.items[s]);
+    char asset[PATH_MAX];
+    snprintf(asset, sizeof(asset), "%s/asset_%lld.fex", dir, size);
+    struct stat st;
+    if ((stat(asset, &st) != 0 || st.st_size != size) &&
+        bench_write_random(asset, size) != 0) {
+      fprintf(stderr, "fex_compile: cannot create %s\n", asset);
+      return 1;
+    }
+
+    /* Bases are measured even when only the case built on them is asked
+     * for */
+    compile_result_t results[CASE_COUNT];
+    int measured[CASE_COUNT] = {0};
+    for (size_t c = 0; c < CASE_COUNT; c++) {
+      int wanted = bench_list_has(&selected, cases[c].name);
+      for (size_t u = 0; u < CASE_COUNT && !wanted; u++) {
+        wanted = cases[u].base &&
+                 strcmp(cases[u].base, cases[c].name) == 0 &&
+                 bench_list_has(&selected, cases[u].name);
+      }
+      if (!wanted || (strcmp(cases[c].name, "fex_embed") == 0 && !has_embed))
+        continue;
+
+      char unit[PATH_MAX], included[PATH_MAX];
+      if (prepare_case(c, dir, asset, unit, sizeof(unit), included,
+                       sizeof(included)) != 0) {
+        unlink(included);
+        fprintf(stderr, "fex_compile: cannot prepare %s\n", cases[c].name);
+        failures++;
+        continue;
+      }
+      const char *library =
+          cases[c].mode == MODE_PRELOAD ? library_path : NULL;
+      compile_result_t best = {0, 0, 0};
+      int failed = 0;
+      for (int r = 0; r < repeat && !failed; r++) {
+        compile_result_t run;
+        if (compile(dir, unit, library, cases[c].format, 0, &run) != 0) {
+          failed = 1;
+          break;
+        }
+        if (r == 0 || run.wall < best.wall)
+          best.wall = run.wall;
+        if (r == 0 || run.cpu < best.cpu)
+          best.cpu = run.cpu;
+        if (run.rss_kb > best.rss_kb)
+          best.rss_kb = run.rss_kb;
+      }
+      unlink(unit);
+      unlink(included);
+      if (failed) {
+        fprintf(stderr, "fex_compile: %s of %s failed\n", cases[c].name,
+                asset);
+        failures++;
+        continue;
+      }
+      results[c] = best;
+      measured[c] = 1;
+    }
+
+    for (size_t c = 0; c < CASE_COUNT; c++) {
+      if (!measured[c] || !bench_list_has(&selected, cases[c].name))
+        continue;
+      char share[32] = "-";
+      for (size_t b = 0; b < CASE_COUNT && cases[c].base; b++) {
+        if (measured[b] && strcmp(cases[b].name, cases[c].base) == 0 &&
+            results[c].cpu > 0)
+          snprintf(share, sizeof(share), "%.1f",
+                   (results[c].cpu - results[b].cpu) / results[c].cpu * 100);
+      }
+      printf("%s\t%lld\t%.3f\t%.3f\t%ld\t%s\n", cases[c].name, size,
+             results[c].wall, results[c].cpu, results[c].rss_kb, share);
+      fflush(stdout);
+    }
+    if (dir == temp_dir)
+      unlink(asset);
+  }
+  if (dir == temp_dir)
+    rmdir(temp_dir);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+/* fex_passthrough - what the preload costs calls that are not on .fex files
+ *
+ * Runs a fixed workload of opens, reads, seeks, stats and stdio calls on
+ * ordinary files, single-threaded and with several threads, once plain and
+ * once with libfex preloaded, and reports the overhead per call type. The
+ * workload runs in a child re-executed from this binary, which links
+ * nothing of libfex, so both runs execute the same code.
+ */
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PASS_FILES 64                /* Ordinary files in the fixture */
+#define PASS_FILE_SIZE (64 * 1024)   /* Bytes per fixture file */
+#define PASS_READ_SIZE 4096          /* Bytes per read() and fread() */
+#define PASS_MAX_THREADS 64
+
+enum {
+  CALL_OPEN,
+  CALL_OPENAT,
+  CALL_OPEN_MISSING,
+  CALL_READ,
+  CALL_LSEEK,
+  CALL_STAT,
+  CALL_STAT_MISSING,
+  CALL_FSTAT,
+  CALL_FOPEN,
+  CALL_FREAD,
+  CALL_FGETC,
+  CALL_COUNT
+};
+
+/* Calls per thread are the base iteration count times scale */
+static const struct {
+  const char *name;
+  int scale;
+} calls[CALL_COUNT] = {
+    [CALL_OPEN] = {"open+close", 1},
+    [CALL_OPENAT] = {"openat+close", 1},
+    [CALL_OPEN_MISSING] = {"open_enoent", 1},
+    [CALL_READ] = {"read", 2},
+    [CALL_LSEEK] = {"lseek", 4},
+    [CALL_STAT] = {"stat", 1},
+    [CALL_STAT_MISSING] = {"stat_enoent", 1},
+    [CALL_FSTAT] = {"fstat", 4},
+    [CALL_FOPEN] = {"fopen+fclose", 1},
+    [CALL_FREAD] = {"fread", 2},
+    [CALL_FGETC] = {"fgetc", 32},
+};
+
+typedef struct {
+  int call;
+  int index;
+  long iterations;
+  const char *dir;
+  int failed;
+} pass_worker_t;
+
+static pthread_barrier_t start_barrier;
+static volatile long sink;
+
+static void *call_worker(void *arg) {
+  pass_worker_t *w = arg;
+  char path[PATH_MAX], name[64], missing[PATH_MAX];
+  snprintf(name, sizeof(name), "f%d.dat", w->index % PASS_FILES);
+  snprintf(path, sizeof(path), "%s/%s", w->dir, name);
+  snprintf(missing, sizeof(missing), "%s/missing%d.dat", w->dir, w->index);
+  int dir_fd = open(w->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  FILE *fp = fopen(path, "rb");
+  char buf[PASS_READ_SIZE];
+  struct stat st;
+  long total = 0;
+  if (dir_fd < 0 || fd < 0 || !fp)
+    w->failed = 1;
+
+  pthread_barrier_wait(&start_barrier);
+  for (long i = 0; i < w->iterations && !w->failed; i++) {
+    switch (w->call) {
+    case CALL_OPEN: {
+      int f = open(path, O_RDONLY | O_CLOEXEC);
+      w->failed = f < 0 || close(f) != 0;
+      break;
+    }
+    case CALL_OPENAT: {
+      int f = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+      w->failed = f < 0 || close(f) != 0;
+      break;
+    }
+    case CALL_OPEN_MISSING:
+      w->failed = open(missing, O_RDONLY | O_CLOEXEC) >= 0 || errno != ENOENT;
+      break;
+    case CALL_READ: {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n == 0) {
+        lseek(fd, 0, SEEK_SET);
+        n = read(fd, buf, sizeof(buf));
+      }
+      w->failed = n <= 0;
+      total += n;
+      break;
+    }
+    case CALL_LSEEK:
+      total += lseek(fd, i % PASS_FILE_SIZE, SEEK_SET);
+      break;
+    case CALL_STAT:
+      w->failed = stat(path, &st) != 0;
+      total += st.st_size;
+      break;
+    case CALL_STAT_MISSING:
+      w->failed = stat(missing, &st) == 0 || errno != ENOENT;
+      break;
+    case CALL_FSTAT:
+      w->failed = fstat(fd, &st) != 0;
+      total += st.st_size;
+      break;
+    case CALL_FOPEN: {
+      FILE *f = fopen(path, "rb");
+      w->failed = !f || fclose(f) != 0;
+      break;
+    }
+    case CALL_FREAD: {
+      size_t n = fread(buf, 1, sizeof(buf), fp);
+      if (n == 0) {
+        rewind(fp);
+        n = fread(buf, 1, sizeof(buf), fp);
+      }
+      w->failed = n == 0;
+      total += n;
+      break;
+    }
+    case CALL_FGETC: {
+      int c = fgetc(fp);
+      if (c == EOF) {
+        rewind(fp);
+        c = fgetc(fp);
+      }
+      total += c;
+      break;
+    }
+    }
+  }
+  sink = total;
+
+  if (fp)
+    fclose(fp);
+  if (fd >= 0)
+    close(fd);
+  if (dir_fd >= 0)
+    close(dir_fd);
+  return NULL;
+}
+
+/* Time one call type on threads threads; ns per call per thread, or -1 */
+static double time_call(int call, int threads, long iterations,
+                        const char *dir) {
+  pass_worker_t workers[PASS_MAX_THREADS];
+  pthread_t ids[PASS_MAX_THREADS];
+  pthread_barrier_init(&start_barrier, NULL, threads + 1);
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (pass_worker_t){call, i, iterations * calls[call].scale, dir,
+                                 0};
+    pthread_create(&ids[i], NULL, call_worker, &workers[i]);
+  }
+  pthread_barrier_wait(&start_barrier);
+  double start = bench_now();
+  int failed = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    failed |= workers[i].failed;
+  }
+  double seconds = bench_now() - start;
+  pthread_barrier_destroy(&start_barrier);
+  return failed ? -1 : seconds * 1e9 / (iterations * calls[call].scale);
+}
+
+/* The workload: one "call threads ns" line per case */
+static int run_child(const char *dir, long iterations, int threads) {
+  printf("preload\t%d\n", dlsym(RTLD_DEFAULT, "fex_init") != NULL);
+  int counts[2] = {1, threads};
+  for (int t = 0; t < (threads > 1 ? 2 : 1); t++) {
+    for (int call = 0; call < CALL_COUNT; call++) {
+      double ns = time_call(call, counts[t], iterations, dir);
+      if (ns < 0) {
+        fprintf(stderr, "fex_passthrough: %s failed\n", calls[call].name);
+        return 1;
+      }
+      printf("%d\t%d\t%.3f\n", call, counts[t], ns);
+    }
+  }
+  return 0;
+}
+
+/* Run the workload in a child, preloaded or not, and keep the fastest
+ * time of each case in ns[call][thread set] */
+static int run_workload(const char *library, const char *dir,
+                        long iterations, int threads, double ns[][2]) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0)
+    return -1;
+  char iterations_text[32], threads_text[32];
+  snprintf(iterations_text, sizeof(iterations_text), "%ld", iterations);
+  snprintf(threads_text, sizeof(threads_text), "%d", threads);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (library)
+      setenv("LD_PRELOAD", library, 1);
+    else
+      unsetenv("LD_PRELOAD");
+    execl("/proc/self/exe", "fex_passthrough", "--child", dir,
+          iterations_text, threads_text, (char *)NULL);
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+
+  FILE *out = fdopen(pipe_fds[0], "r");
+  int preloaded = -1, call, count;
+  double value;
+  if (out && fscanf(out, "preload\t%d\n", &preloaded) == 1) {
+    while (fscanf(out, "%d\t%d\t%lf\n", &call, &count, &value) == 3) {
+      if (call < 0 || call >= CALL_COUNT)
+        continue;
+      int t = count > 1;
+      if (ns[call][t] < 0 || value < ns[call][t])
+        ns[call][t] = value;
+    }
+  }
+  if (out)
+    fclose(out);
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return -1;
+  if (preloaded != (library != NULL)) {
+    fprintf(stderr, "fex_passthrough: %s was not preloaded\n", library);
+    return -1;
+  }
+  return 0;
+}
+
+/* Fixture of ordinary files, none matching the .fex patterns */
+static int make_fixture(const char *dir) {
+  static char data[PASS_FILE_SIZE];
+  uint64_t state = 0x853c49e6748fea9bull;
+  for (size_t i = 0; i < sizeof(data) / sizeof(uint64_t); i++) {
+    uint64_t value = bench_random(&state);
+    memcpy(data + i * sizeof(value), &value, sizeof(value));
+  }
+  for (int i = 0; i < PASS_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%d.dat", dir, i);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(data, 1, sizeof(data), fp) != sizeof(data)) {
+      if (fp)
+        fclose(fp);
+      return -1;
+    }
+    fclose(fp);
+  }
+  return 0;
+}
+
+static void remove_fixture(const char *dir) {
+  for (int i = 0; i < PASS_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/f%d.dat", dir, i);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fex_passthrough [options]\n"
+          "  --iterations N   base calls per thread and case (default "
+          "100000)\n"
+          "  --threads N      threads of the multi-threaded run (default: "
+          "online CPUs, at least 4)\n"
+          "  --repeat N       runs per mode; the fastest counts (default 3)\n"
+          "  --library PATH   libfex.so to preload\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc == 5 && strcmp(argv[1], "--child") == 0)
+    return run_child(argv[2], atol(argv[3]), atoi(argv[4]));
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long iterations = 100000;
+  int threads = cpus > 4 ? (int)cpus : 4;
+  int repeat = 3;
+  const char *library = FEX_BENCH_LIBRARY;
+
+  static const struct option options[] = {
+      {"iterations", required_argument, NULL, 'n'},
+      {"threads", required_argument, NULL, 't'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"library", required_argument, NULL, 'l'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'l':
+      library = optarg;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  if (optind != argc || iterations < 1 || repeat < 1 || threads < 1 ||
+      threads > PASS_MAX_THREADS) {
+    usage();
+    return 2;
+  }
+
+  char dir[] = "/tmp/fex_passthrough_XXXXXX";
+  if (!mkdtemp(dir) || make_fixture(dir) != 0) {
+    perror("fex_passthrough: fixture");
+    return 1;
+  }
+
+  /* Alternate the modes so drift affects both alike */
+  double base[CALL_COUNT][2], preload[CALL_COUNT][2];
+  for (int call = 0; call < CALL_COUNT; call++) {
+    base[call][0] = base[call][1] = -1;
+    preload[call][0] = preload[call][1] = -1;
+  }
+  int result = 0;
+  for (int r = 0; r < repeat && result == 0; r++) {
+    if (run_workload(NULL, dir, iterations, threads, base) != 0 ||
+        run_workload(library, dir, iterations, threads, preload) != 0)
+      result = 1;
+  }
+  remove_fixture(dir);
+  if (result != 0) {
+    fprintf(stderr, "fex_passthrough: workload failed\n");
+    return 1;
+  }
+
+  printf("call\tthreads\tbase_ns\tpreload_ns\toverhead_%%\n");
+  for (int t = 0; t < (threads > 1 ? 2 : 1); t++) {
+    for (int call = 0; call < CALL_COUNT; call++) {
+      double b = base[call][t], p = preload[call][t];
+      printf("%s\t%d\t%.1f\t%.1f\t%.1f\n", calls[call].name,
+             t ? threads : 1, b, p, (p - b) / b * 100);
+    }
+  }
+  return 0;
+}
@@ -6,10 +6,69 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* How an entry is served, chosen from the source size at open */
+enum {
+  FEX_TIER_SMALL,  /* Rendered whole into one buffer at first read */
+  FEX_TIER_MEDIUM, /* Source blocks rendered on demand */
+  FEX_TIER_LARGE   /* Source rendered as it streams, without a block cache */
+};
+
+/* Output formats a source can be rendered in */
+enum {
+  FEX_FORMAT_C_ARRAY,    /* "unsigned char NAME[] = { 0xNN, ... };" */
+  FEX_FORMAT_RAW,        /* The source bytes themselves */
+  FEX_FORMAT_INCBIN,     /* Top-level asm .incbin of the raw view */
+  FEX_FORMAT_EMBED,      /* C23 #embed of the raw view */
+  FEX_FORMAT_ELF_OBJECT, /* Relocatable object with the bytes in .rodata */
+  FEX_FORMAT_HEADER,     /* extern declarations of NAME and NAME_SIZE */
+  FEX_FORMAT_ZLIB,       /* C array of the zlib stream, with NAME_ZSIZE */
+  FEX_FORMAT_COUNT
+};
+
+/* Request sent to fexd, with the source descriptor attached as SCM_RIGHTS.
+ * The client resolves pointer manifests: the descriptor is the file holding
+ * the bytes and offset/length their range in it. The reply is an int32_t
+ * status, and on 0 the sealed memfd. */
+#define FEX_DAEMON_MAGIC 0x66657864u /* "fexd" */
+typedef struct {
+  uint32_t magic;
+  uint32_t format;     /* FEX_FORMAT_* */
+  int64_t offset;      /* Range of the descriptor to render */
+  int64_t length;
+  char name[PATH_MAX]; /* Path the variable name is derived from */
+} fex_daemon_request_t;
+
+/* Access pattern seen on block misses of an entry */
+enum {
+  FEX_ACCESS_UNKNOWN,
+  FEX_ACCESS_SEQUENTIAL, /* Each miss lands in the block after the last */
+  FEX_ACCESS_STRIDED,    /* Misses a constant distance apart */
+  FEX_ACCESS_RANDOM
+};
+
+/* A run of the source that is either a hole (reads as zeros) or data */
+typedef struct {
+  off_t start;
+  off_t end;
+  int hole;
+} source_extent_t;
+
+/* The bytes a .fex embeds: the file itself, or a pointer target's range */
+typedef struct {
+  int fd;
+  off_t offset;
+  off_t length;
+  struct stat st; /* Of the file holding the bytes */
+} fex_source_t;
+
 /* File tracking structure for .fex files */
 typedef struct fex_file_entry {
   int fd;                   /* File descriptor */
@@ -26,8 +85,33 @@ typedef struct fex_file_entry {
   unsigned char *buffer;             /* Pre-loaded buffer for efficient reading */
   size_t block_size;        /* Block size for buffer operations */
   off_t current_block;      /* Current block number being accessed */
-  FILE *original_fp; /* File pointer to original file for buffer operations */
+  pthread_mutex_t block_mutex; /* Held while a block is loaded, resized or
+                                  rendered from */
+  int source_fd;            /* Descriptor source bytes are pread() from */
+  int owns_source;          /* source_fd is a pointer target we opened */
+  off_t source_offset;      /* Start of the embedded bytes in source_fd */
+  dev_t st_dev;             /* Identity of the source file */
+  ino_t st_ino;
+  struct timespec st_mtim;  /* Source modification time at open */
+  int format;               /* FEX_FORMAT_* the file is rendered in */
+  _Atomic(int) materialized; /* Read state built (buffer allocated) */
+  int rendered_fd;          /* Fully rendered copy backing mmap(), or -1 */
+  int tier;                 /* FEX_TIER_* chosen from original_size */
+  int direct_fd;            /* O_DIRECT descriptor on the source, or -1 */
+  int access_pattern;       /* FEX_ACCESS_* of recent block misses */
+  int pattern_streak;       /* Consecutive misses with that pattern */
+  off_t last_miss;          /* Source offset of the previous block miss */
+  off_t stride;             /* Distance between the last two misses */
+  off_t next_expected;      /* Source offset just past the loaded block */
+  source_extent_t extent;   /* Last hole/data extent found in the source */
+  int probe_fd;             /* Private reopen of the source for hole probes,
+                               -1 until needed, -2 if it failed */
+  off_t touched_start;      /* Source range read, for the prefetch manifest */
+  off_t touched_end;
+  struct fex_bundle *bundle; /* Members of a .fexbundle, or NULL */
   struct fex_file_entry *next; /* Next entry in linked list */
+  int slab_class;     /* Slab size class of this entry, -1 if malloc()ed */
+  char strings[];     /* Filename, header and footer stored inline */
 } fex_file_entry_t;
 
 /* Function pointer types for original functions */
@@ -35,6 +119,7 @@ typedef int (*orig_open_t)(const char *pathname, int flags, ...);
 typedef int (*orig_openat_t)(int dirfd, const char *pathname, int flags, ...);
 typedef int (*orig_close_t)(int fd);
 typedef ssize_t (*orig_read_t)(int fd, void *buf, size_t count);
+typedef ssize_t (*orig_write_t)(int fd, const void *buf, size_t count);
 typedef FILE *(*orig_fopen_t)(const char *pathname, const char *mode);
 typedef int (*orig_fclose_t)(FILE *stream);
 typedef size_t (*orig_fread_t)(void *ptr, size_t size, size_t nmemb,
@@ -57,14 +142,19 @@ typedef int (*orig_stat_t)(const char *pathname, struct stat *statbuf);
 typedef int (*orig_fstat_t)(int fd, struct stat *statbuf);
 typedef int (*orig_fstatat_t)(int dirfd, const char *pathname,
                               struct stat *statbuf, int flags);
+typedef void *(*orig_mmap_t)(void *addr, size_t length, int prot, int flags,
+                             int fd, off_t offset);
+typedef int (*orig_chdir_t)(const char *path);
+typedef int (*orig_fchdir_t)(int fd);
 
 /* Utility functions */
 void fex_init(void);
 void fex_log(const char *format, ...);
 
 /* File tracking functions */
-int is_fex_file(const char *pathname);
-char *resolve_pathname_at(int dirfd, const char *pathname);
+int should_process_as_fex(const char *pathname);
+int resolve_openat_path(int dirfd, const char *pathname, char *resolved,
+                        size_t size);
 char *generate_c_variable_name(const char *filename);
 int generate_fex_code_data(const char *filename, off_t original_size,
                            char **header_string, char **footer_string,
@@ -72,12 +162,41 @@ int generate_fex_code_data(const char *filename, off_t original_size,
                            off_t *data_len, off_t *footer_start);
 off_t get_real_file_position(fex_file_entry_t *entry, off_t simulated_position);
 int get_simulated_character(fex_file_entry_t *entry, off_t position);
+size_t get_fex_block_size(void);
 size_t load_block_into_buffer(fex_file_entry_t *entry, off_t block_number);
 void initialize_fex_buffer(fex_file_entry_t *entry);
+int fex_render_range(fex_file_entry_t *entry, int src_fd, off_t offset,
+                     unsigned char *dst, size_t len);
+int create_fex_temp_file(const char *fex_path);
+int fex_render_source_fd(int src_fd, const char *name, int format);
+int fex_render_source_range(int src_fd, off_t offset, off_t length,
+                            const char *name, int format);
+socklen_t fex_daemon_address(struct sockaddr_un *addr);
 void free_fex_buffer(fex_file_entry_t *entry);
+unsigned char *fex_buffer_alloc(size_t size);
+void fex_buffer_free(unsigned char *buf, size_t size);
 void track_fex_file_fd(int fd, const char *pathname, int flags);
 void track_fex_file_fp(FILE *fp, const char *pathname, const char *mode);
 void untrack_fex_file_fd(int fd);
 void untrack_fex_file_fp(FILE *fp);
+void track_fex_writer_fd(int fd, const char *pathname);
+int untrack_fex_writer_fd(int fd);
 void print_fex_files_status(void);
+
+/* In-process rendering, for tools linking libfex.a instead of preloading.
+ * Reads are positional and may be issued from several threads at once. */
+typedef struct fex_handle fex_handle_t;
+typedef struct {
+  int format;       /* FEX_FORMAT_* */
+  const char *name; /* Path the variable name is derived from, or NULL */
+} fex_options_t;
+
+/* NULL opts renders in the FEX_FORMAT format under the path's own name */
+fex_handle_t *fex_open(const char *path, const fex_options_t *opts);
+off_t fex_size(const fex_handle_t *handle);
+int fex_source_stat(const char *path, struct stat *st);
+ssize_t fex_read_at(fex_handle_t *handle, off_t offset, void *buf,
+                    size_t len);
+int fex_render_all(fex_handle_t *handle, int fd);
+void fex_close(fex_handle_t *handle);
 #endif // FEX_H
\ No newline at end of file
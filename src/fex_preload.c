@@ -1,9 +1,12 @@
 #define _GNU_SOURCE
 #include "fex.h"
 #include <ctype.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <limits.h>
 #include <pthread.h>
@@ -14,14 +17,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define FEX_DEFAULT_BLOCK_SIZE 4096
+#define FEX_HEX_WIDTH 6 /* Rendered bytes per source byte: "0xNN, " */
+#define FEX_DEFAULT_PARALLEL_THRESHOLD (8 * 1024 * 1024)
+#define FEX_DEFAULT_PARALLEL_CHUNK (1024 * 1024)
+#define FEX_RENDER_SCRATCH_SIZE (64 * 1024) /* Source bytes per pread() */
+#define FEX_MAX_RENDER_THREADS 256
+#define FEX_DECODE_BUFFER_SIZE (64 * 1024)
+#define FEX_DEFAULT_PATH_CACHE_SIZE 4096
+#define FEX_DEFAULT_SMALL_FILE (64 * 1024)          /* Source bytes */
+#define FEX_DEFAULT_LARGE_FILE (256 * 1024 * 1024) /* Source bytes */
+#define FEX_DEFAULT_MAX_BLOCK_SIZE (4 * 1024 * 1024)
+#define FEX_DEFAULT_DIRECT_IO (4ULL * 1024 * 1024 * 1024) /* Source bytes */
+#define FEX_DIRECT_IO_ALIGN 4096
+#define FEX_DEFAULT_RENDER_CHUNK (16 * 1024) /* Source bytes per chunk */
+#define FEX_API_RENDER_CHUNK (16 * 1024 * 1024)  /* Output bytes per write() */
+#define FEX_DEFAULT_BUFFER_POOL (32 * 1024 * 1024) /* Idle pooled bytes */
+#define FEX_VAR_NAME_MAX (NAME_MAX + 2)
+#define FEX_HEADER_MAX (4 * FEX_VAR_NAME_MAX + PATH_MAX + 256)
+#define FEX_FOOTER_MAX (2 * FEX_VAR_NAME_MAX + 1024)
+
+/* Machine of the ELF objects served for "<path>.fex.o" */
+#ifndef FEX_ELF_MACHINE
+#if defined(__aarch64__)
+#define FEX_ELF_MACHINE EM_AARCH64
+#else
+#define FEX_ELF_MACHINE EM_X86_64
+#endif
+#endif
 
 static const char hex_table[256][7] = {
     "0x00, ", "0x01, ", "0x02, ", "0x03, ", "0x04, ", "0x05, ", "0x06, ",
@@ -106,6 +144,7 @@ static orig_open_t orig_open = NULL;
 static orig_openat_t orig_openat = NULL;
 static orig_close_t orig_close = NULL;
 static orig_read_t orig_read = NULL;
+static orig_write_t orig_write = NULL;
 static orig_fopen_t orig_fopen = NULL;
 static orig_fclose_t orig_fclose = NULL;
 static orig_fread_t orig_fread = NULL;
@@ -126,6 +165,9 @@ static orig_fileno_t orig_fileno = NULL;
 static orig_stat_t orig_stat = NULL;
 static orig_fstat_t orig_fstat = NULL;
 static orig_fstatat_t orig_fstatat = NULL;
+static orig_mmap_t orig_mmap = NULL;
+static orig_chdir_t orig_chdir = NULL;
+static orig_fchdir_t orig_fchdir = NULL;
 
 /* Debug logging flag */
 static int debug_enabled = 0;
@@ -133,89 +175,305 @@ static int debug_enabled = 0;
 /* Simple override flag - return '!' for every character */
 static int simple_override = 0;
 
+/* Parallel rendering configuration */
+static int render_threads = 1;
+static size_t parallel_threshold = FEX_DEFAULT_PARALLEL_THRESHOLD;
+static size_t parallel_chunk_size = FEX_DEFAULT_PARALLEL_CHUNK;
+
+/* Size tiers: sources below small_file_threshold are rendered whole at
+ * first read, sources at or above large_file_threshold are streamed */
+static size_t small_file_threshold = FEX_DEFAULT_SMALL_FILE;
+static size_t large_file_threshold = FEX_DEFAULT_LARGE_FILE;
+
+/* Block sizes: every entry starts at block_size_base, sequential streams
+ * double it up to block_size_max, random access drops back to the base */
+static size_t block_size_base = FEX_DEFAULT_BLOCK_SIZE;
+static size_t block_size_max = FEX_DEFAULT_MAX_BLOCK_SIZE;
+
+/* Sources this large are read with O_DIRECT (0 disables) */
+static size_t direct_io_threshold = FEX_DEFAULT_DIRECT_IO;
+
+/* Rendered chunk cache budget in bytes (0 disables) and chunk size in
+ * source bytes */
+static size_t render_cache_budget = 0;
+static size_t render_chunk_size = FEX_DEFAULT_RENDER_CHUNK;
+
+/* Ask fexd for shared rendered copies */
+static int daemon_enabled = 0;
+
+/* Format .fex paths are rendered in */
+static int default_format = FEX_FORMAT_C_ARRAY;
+
+/* Compression level of the zlib format */
+static int zlib_level = Z_BEST_COMPRESSION;
+
+/* Directory of compressed lengths shared between processes, or "";
+ * resolved on first use of the zlib format */
+static char packed_cache_dir[PATH_MAX] = "";
+/* Set for ~/.cache/fex, whose parent may be missing too */
+static int packed_cache_in_home = 0;
+static pthread_once_t packed_cache_once = PTHREAD_ONCE_INIT;
+
+/* Suffixes that, appended to a .fex path, serve it in another format */
+typedef struct {
+  const char *suffix;
+  int format;
+} fex_derived_suffix_t;
+
+static fex_derived_suffix_t fex_derived_suffixes[] = {
+    {".raw", FEX_FORMAT_RAW},
+    {".o", FEX_FORMAT_ELF_OBJECT}, /* FEX_OBJECT_SUFFIX */
+    {".h", FEX_FORMAT_HEADER},     /* FEX_HEADER_SUFFIX */
+};
+
+/* Prefetch manifest recorded and replayed across runs (NULL disables) */
+static const char *manifest_path = NULL;
+
+/* Path resolution cache capacity in entries */
+static size_t path_cache_capacity = FEX_DEFAULT_PATH_CACHE_SIZE;
+
+/* Back large pooled buffers with huge pages */
+static int use_huge_pages = 0;
+
+/* Bytes of idle buffers kept for reuse across all classes */
+static size_t buffer_pool_budget = FEX_DEFAULT_BUFFER_POOL;
+
+/* Decode C initializer text written to .fex files into binary */
+static int write_decode = 0;
+
 /* .fex file tracking */
 static fex_file_entry_t *fex_files_head = NULL;
 static pthread_mutex_t fex_files_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Directory file descriptor tracking for openat() */
-typedef struct directory_fd_mapping {
-  int fd;
+/* Serializes first-use setup of entries */
+static pthread_mutex_t fex_materialize_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(uint64_t) fex_entries_tracked = 0;
+static _Atomic(uint64_t) fex_entries_materialized = 0;
+static _Atomic(uint64_t) fex_tier_entries[3];
+
+/* Directory file descriptor tracking for openat(): an fd-indexed table of
+ * directory paths split into lazily allocated pages. Each slot carries a
+ * generation bumped whenever the fd stops naming the directory, so cached
+ * resolutions keyed on it die with the binding. Pages are never freed,
+ * which lets generations be read without the lock.
+ *
+ * Paths read from /proc/self/fd also record the directory's identity:
+ * closedir(), fclose(), dup2() and close_range() close descriptors without
+ * passing through close(), so the fd may name another directory by the
+ * next use and the identity is checked with fstat() before trusting it. */
+#define FEX_DIR_PAGE_SIZE 1024
+#define FEX_DIR_PAGES 1024 /* Tracks descriptors below 1M */
+
+typedef struct directory_fd_slot {
   char *dirpath;
-  struct directory_fd_mapping *next;
-} directory_fd_mapping_t;
+  _Atomic(uint64_t) generation;
+  int from_proc; /* dirpath came from /proc/self/fd, not an open() seen */
+  dev_t st_dev;  /* Identity of the directory when from_proc */
+  ino_t st_ino;
+} directory_fd_slot_t;
+
+static _Atomic(directory_fd_slot_t *) directory_fd_pages[FEX_DIR_PAGES];
+static pthread_mutex_t directory_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(int) directory_fd_count = 0;
+
+static directory_fd_slot_t *get_directory_fd_slot(int fd) {
+  if (fd < 0 || fd >= FEX_DIR_PAGE_SIZE * FEX_DIR_PAGES)
+    return NULL;
+  directory_fd_slot_t *page = atomic_load_explicit(
+      &directory_fd_pages[fd / FEX_DIR_PAGE_SIZE], memory_order_acquire);
+  return page ? &page[fd % FEX_DIR_PAGE_SIZE] : NULL;
+}
 
-static directory_fd_mapping_t *directory_fd_mappings_head = NULL;
+/* Current generation of an fd's directory binding */
+static uint64_t get_directory_fd_generation(int fd) {
+  directory_fd_slot_t *slot = get_directory_fd_slot(fd);
+  return slot ? atomic_load_explicit(&slot->generation, memory_order_acquire)
+              : 0;
+}
 
-/* Directory tracking functions */
-static int add_directory_fd_mapping(int fd, const char *dirpath) {
-  if (fd < 0 || !dirpath) {
+/* Directory tracking functions; st is the directory's identity when the
+ * path was not taken from an open() of it */
+static int add_directory_fd_mapping(int fd, const char *dirpath,
+                                    const struct stat *st) {
+  if (fd < 0 || fd >= FEX_DIR_PAGE_SIZE * FEX_DIR_PAGES || !dirpath) {
     return -1;
   }
 
-  directory_fd_mapping_t *new_mapping = malloc(sizeof(directory_fd_mapping_t));
-  if (!new_mapping) {
+  char *copy = strdup(dirpath);
+  if (!copy) {
     return -1;
   }
 
-  new_mapping->fd = fd;
-  new_mapping->dirpath = strdup(dirpath);
-  if (!new_mapping->dirpath) {
-    free(new_mapping);
-    return -1;
+  pthread_mutex_lock(&directory_fd_mutex);
+  directory_fd_slot_t *slot = get_directory_fd_slot(fd);
+  if (!slot) {
+    directory_fd_slot_t *page =
+        calloc(FEX_DIR_PAGE_SIZE, sizeof(directory_fd_slot_t));
+    if (!page) {
+      pthread_mutex_unlock(&directory_fd_mutex);
+      free(copy);
+      return -1;
+    }
+    atomic_store_explicit(&directory_fd_pages[fd / FEX_DIR_PAGE_SIZE], page,
+                          memory_order_release);
+    slot = &page[fd % FEX_DIR_PAGE_SIZE];
   }
 
-  new_mapping->next = directory_fd_mappings_head;
-  directory_fd_mappings_head = new_mapping;
+  if (slot->dirpath) {
+    /* The fd was reused without passing through close() */
+    free(slot->dirpath);
+    atomic_fetch_add(&slot->generation, 1);
+  } else {
+    atomic_fetch_add(&directory_fd_count, 1);
+  }
+  slot->dirpath = copy;
+  slot->from_proc = st != NULL;
+  if (st) {
+    slot->st_dev = st->st_dev;
+    slot->st_ino = st->st_ino;
+  }
+  pthread_mutex_unlock(&directory_fd_mutex);
 
   fex_log("Added directory mapping: fd %d -> %s\n", fd, dirpath);
   return 0;
 }
 
-static directory_fd_mapping_t *find_directory_fd_mapping(int fd) {
-  if (fd < 0) {
-    return NULL;
+/* Copy the tracked path of a directory fd into dirpath; returns its length
+ * or -1 if the fd is not tracked */
+static ssize_t copy_directory_fd_mapping(int fd, char *dirpath, size_t size) {
+  if (atomic_load_explicit(&directory_fd_count, memory_order_relaxed) == 0) {
+    return -1;
   }
 
-  directory_fd_mapping_t *current = directory_fd_mappings_head;
-  while (current) {
-    if (current->fd == fd) {
-      return current;
+  ssize_t len = -1;
+  pthread_mutex_lock(&directory_fd_mutex);
+  directory_fd_slot_t *slot = get_directory_fd_slot(fd);
+  if (slot && slot->dirpath) {
+    size_t path_len = strlen(slot->dirpath);
+    if (path_len < size) {
+      memcpy(dirpath, slot->dirpath, path_len + 1);
+      len = path_len;
     }
-    current = current->next;
   }
-  return NULL;
+  pthread_mutex_unlock(&directory_fd_mutex);
+  return len;
 }
 
 static void remove_directory_fd_mapping(int fd) {
-  if (fd < 0) {
+  if (atomic_load_explicit(&directory_fd_count, memory_order_relaxed) == 0) {
     return;
   }
 
-  directory_fd_mapping_t *current = directory_fd_mappings_head;
-  directory_fd_mapping_t *prev = NULL;
+  char *dirpath = NULL;
+  pthread_mutex_lock(&directory_fd_mutex);
+  directory_fd_slot_t *slot = get_directory_fd_slot(fd);
+  if (slot && slot->dirpath) {
+    dirpath = slot->dirpath;
+    slot->dirpath = NULL;
+    atomic_fetch_add(&slot->generation, 1);
+    atomic_fetch_sub(&directory_fd_count, 1);
+  }
+  pthread_mutex_unlock(&directory_fd_mutex);
 
-  while (current) {
-    if (current->fd == fd) {
-      fex_log("Removing directory mapping: fd %d -> %s\n", fd,
-              current->dirpath);
+  if (dirpath) {
+    fex_log("Removing directory mapping: fd %d -> %s\n", fd, dirpath);
+    free(dirpath);
+  }
+}
 
-      /* Remove from linked list */
-      if (prev) {
-        prev->next = current->next;
-      } else {
-        directory_fd_mappings_head = current->next;
-      }
+/* Drop a mapping read from /proc/self/fd once the fd names another file;
+ * called before the fd's generation keys a path cache lookup */
+static void validate_directory_fd_mapping(int fd) {
+  if (atomic_load_explicit(&directory_fd_count, memory_order_relaxed) == 0) {
+    return;
+  }
 
-      /* Free the mapping data */
-      free(current->dirpath);
-      free(current);
-      return;
-    }
-    prev = current;
-    current = current->next;
+  int from_proc = 0;
+  dev_t dev = 0;
+  ino_t ino = 0;
+  pthread_mutex_lock(&directory_fd_mutex);
+  directory_fd_slot_t *slot = get_directory_fd_slot(fd);
+  if (slot && slot->dirpath && slot->from_proc) {
+    from_proc = 1;
+    dev = slot->st_dev;
+    ino = slot->st_ino;
+  }
+  pthread_mutex_unlock(&directory_fd_mutex);
+
+  struct stat st;
+  if (from_proc &&
+      (orig_fstat(fd, &st) != 0 || st.st_dev != dev || st.st_ino != ino)) {
+    fex_log("Directory fd %d was reused, dropping its mapping\n", fd);
+    remove_directory_fd_mapping(fd);
+  }
+}
+
+/* Find the path of a directory fd. Descriptors not opened through an
+ * O_DIRECTORY open() with an absolute path are resolved via /proc/self/fd
+ * on first use and remembered, with the directory's identity, until
+ * close() or until validate_directory_fd_mapping() sees the fd reused. */
+static ssize_t lookup_directory_fd_path(int fd, char *dirpath, size_t size) {
+  ssize_t len = copy_directory_fd_mapping(fd, dirpath, size);
+  if (len >= 0) {
+    return len;
+  }
+
+  struct stat st;
+  if (orig_fstat(fd, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return -1;
+  }
+  char fdpath[64];
+  snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+  len = readlink(fdpath, dirpath, size - 1);
+  if (len <= 0 || dirpath[0] != '/') {
+    return -1; /* Not a filesystem path (pipe, socket, anon inode) */
+  }
+  dirpath[len] = '\0';
+
+  add_directory_fd_mapping(fd, dirpath, &st);
+  return len;
+}
+
+/* Read a size-valued environment variable, falling back to 'def' when it is
+ * unset or outside [min, max] */
+static size_t get_env_size(const char *name, size_t def, size_t min,
+                           size_t max) {
+  const char *value = getenv(name);
+  if (!value)
+    return def;
+
+  char *endptr;
+  unsigned long long size = strtoull(value, &endptr, 10);
+  if (endptr == value || *endptr != '\0' || size < min || size > max) {
+    fex_log("Invalid %s value '%s', using default %zu\n", name, value, def);
+    return def;
   }
+  return (size_t)size;
 }
 
+static void init_hex_digit_values(void);
+static void load_fex_patterns(void);
+static void load_prefetch_manifest(void);
+static int get_fex_format(void);
+static int write_all(int fd, const unsigned char *buf, size_t count);
+static int read_source_at(int src_fd, unsigned char *buf, size_t count,
+                          off_t offset);
+static int render_source_to_anonymous_file(const char *name,
+                                           const fex_source_t *source,
+                                           int format);
+#ifndef FEX_NO_INTERPOSE
+static off_t fex_simulated_size(const char *filename, off_t original_size,
+                                off_t plain_size, int format);
+#endif /* FEX_NO_INTERPOSE */
+static int render_bundle_range(struct fex_bundle *bundle, off_t offset,
+                               unsigned char *dst, size_t len);
+static void release_fex_bundle(struct fex_bundle *bundle);
+static int format_fex_code_data(const char *filename, off_t original_size,
+                                off_t plain_size, int format, char *header,
+                                char *footer, off_t *simulated_size,
+                                off_t *header_len, off_t *data_len,
+                                off_t *footer_start);
+
 /* Initialization function */
 void fex_init(void) {
   static int initialized = 0;
@@ -231,6 +489,65 @@ void fex_init(void) {
     fex_log("Simple override mode enabled\n");
   }
 
+  /* Parallel rendering: thread count, size threshold and chunk size */
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  render_threads = (int)get_env_size(
+      "FEX_THREADS", cpus > 0 ? MIN(cpus, FEX_MAX_RENDER_THREADS) : 1, 1,
+      FEX_MAX_RENDER_THREADS);
+  parallel_threshold = get_env_size("FEX_PARALLEL_THRESHOLD",
+                                    FEX_DEFAULT_PARALLEL_THRESHOLD, 0, SIZE_MAX);
+  parallel_chunk_size =
+      get_env_size("FEX_PARALLEL_CHUNK", FEX_DEFAULT_PARALLEL_CHUNK,
+                   FEX_HEX_WIDTH * 1024, 256 * 1024 * 1024);
+
+  /* Size tier thresholds (source bytes) */
+  small_file_threshold = get_env_size("FEX_SMALL_FILE", FEX_DEFAULT_SMALL_FILE,
+                                      0, SIZE_MAX);
+  large_file_threshold = get_env_size("FEX_LARGE_FILE", FEX_DEFAULT_LARGE_FILE,
+                                      small_file_threshold, SIZE_MAX);
+
+  /* Block sizing and direct I/O for huge sources */
+  block_size_base = get_fex_block_size();
+  block_size_max = get_env_size("FEX_MAX_BLOCK_SIZE", FEX_DEFAULT_MAX_BLOCK_SIZE,
+                                block_size_base, 256 * 1024 * 1024);
+  direct_io_threshold =
+      get_env_size("FEX_DIRECT_IO", FEX_DEFAULT_DIRECT_IO, 0, SIZE_MAX);
+
+  /* Rendered chunk cache */
+  render_cache_budget = get_env_size("FEX_RENDER_CACHE", 0, 0, SIZE_MAX);
+  render_chunk_size =
+      get_env_size("FEX_RENDER_CACHE_CHUNK", FEX_DEFAULT_RENDER_CHUNK, 1024,
+                   16 * 1024 * 1024);
+
+  /* Check if opens should go through the fexd render daemon */
+  daemon_enabled = getenv("FEX_DAEMON") != NULL;
+
+  /* Output format: the C array, or a small file the toolchain completes */
+  default_format = get_fex_format();
+  zlib_level = (int)get_env_size("FEX_ZLIB_LEVEL", Z_BEST_COMPRESSION, 0, 9);
+  const char *object_suffix = getenv("FEX_OBJECT_SUFFIX");
+  if (object_suffix && object_suffix[0]) {
+    fex_derived_suffixes[1].suffix = object_suffix;
+  }
+  const char *header_suffix = getenv("FEX_HEADER_SUFFIX");
+  if (header_suffix && header_suffix[0]) {
+    fex_derived_suffixes[2].suffix = header_suffix;
+  }
+
+  /* Path resolution cache capacity (entries) */
+  path_cache_capacity = get_env_size("FEX_PATH_CACHE_SIZE",
+                                     FEX_DEFAULT_PATH_CACHE_SIZE, 16, 1 << 24);
+
+  /* Check if large buffers should use huge pages, and how much idle
+   * buffer memory may be kept */
+  use_huge_pages = getenv("FEX_HUGE_PAGES") != NULL;
+  buffer_pool_budget = get_env_size("FEX_BUFFER_POOL", FEX_DEFAULT_BUFFER_POOL,
+                                    0, SIZE_MAX);
+
+  /* Check if writes of C text to .fex files should be decoded */
+  write_decode = getenv("FEX_WRITE_DECODE") != NULL;
+  init_hex_digit_values();
+
   /* Check if status should be printed on exit */
   if (getenv("FEX_SHOW_STATUS")) {
     atexit(print_fex_files_status);
@@ -241,6 +558,7 @@ void fex_init(void) {
   orig_openat = (orig_openat_t)dlsym(RTLD_NEXT, "openat");
   orig_close = (orig_close_t)dlsym(RTLD_NEXT, "close");
   orig_read = (orig_read_t)dlsym(RTLD_NEXT, "read");
+  orig_write = (orig_write_t)dlsym(RTLD_NEXT, "write");
   orig_fopen = (orig_fopen_t)dlsym(RTLD_NEXT, "fopen");
   orig_fclose = (orig_fclose_t)dlsym(RTLD_NEXT, "fclose");
   orig_fread = (orig_fread_t)dlsym(RTLD_NEXT, "fread");
@@ -261,6 +579,20 @@ void fex_init(void) {
   orig_stat = (orig_stat_t)dlsym(RTLD_NEXT, "stat");
   orig_fstat = (orig_fstat_t)dlsym(RTLD_NEXT, "fstat");
   orig_fstatat = (orig_fstatat_t)dlsym(RTLD_NEXT, "fstatat");
+  orig_mmap = (orig_mmap_t)dlsym(RTLD_NEXT, "mmap");
+  orig_chdir = (orig_chdir_t)dlsym(RTLD_NEXT, "chdir");
+  orig_fchdir = (orig_fchdir_t)dlsym(RTLD_NEXT, "fchdir");
+
+  /* Load the rules selecting which paths are served as .fex */
+  load_fex_patterns();
+
+  /* Warm the sources a previous run touched, and record this run's */
+  manifest_path = getenv("FEX_MANIFEST");
+  if (manifest_path && *manifest_path) {
+    load_prefetch_manifest();
+  } else {
+    manifest_path = NULL;
+  }
 
   initialized = 1;
   fex_log("FEX library initialized\n");
@@ -278,6 +610,22 @@ void fex_log(const char *format, ...) {
   va_end(args);
 }
 
+/* Get the output format from FEX_FORMAT: "c" (default), "incbin",
+ * "embed" or "zlib" */
+static int get_fex_format(void) {
+  const char *name = getenv("FEX_FORMAT");
+  if (!name || strcmp(name, "c") == 0)
+    return FEX_FORMAT_C_ARRAY;
+  if (strcmp(name, "incbin") == 0)
+    return FEX_FORMAT_INCBIN;
+  if (strcmp(name, "embed") == 0)
+    return FEX_FORMAT_EMBED;
+  if (strcmp(name, "zlib") == 0)
+    return FEX_FORMAT_ZLIB;
+  fex_log("Invalid FEX_FORMAT value '%s', using c\n", name);
+  return FEX_FORMAT_C_ARRAY;
+}
+
 /* Get configurable block size from environment variable */
 size_t get_fex_block_size(void) {
   const char *block_size_str = getenv("FEX_BLOCK_SIZE");
@@ -298,910 +646,5441 @@ size_t get_fex_block_size(void) {
 
   return FEX_DEFAULT_BLOCK_SIZE;
 }
-/* Lock-free path caching for performance optimization */
-typedef struct path_cache_entry {
-  char *path;
-  char *resolved_path;
-  _Atomic(int) ref_count;
-  _Atomic(struct path_cache_entry *) next;
-  _Atomic(uint64_t) generation; /* ABA prevention counter */
-} path_cache_entry_t;
-
-#define PATH_CACHE_SIZE 128
-static _Atomic(path_cache_entry_t *) path_cache_atomic[PATH_CACHE_SIZE];
-static _Atomic(uint64_t) global_generation;
-
-/* ========== .FEX FILE TRACKING FUNCTIONS ========== */
-/* Lock-free path caching implementation for performance optimization */
-static void init_path_cache(void) {
-  /* Initialize atomic generation counter */
-  atomic_store(&global_generation, 1);
-
-  /* Initialize all atomic pointers to NULL */
-  for (int i = 0; i < PATH_CACHE_SIZE; i++) {
-    atomic_store(&path_cache_atomic[i], NULL);
+/* ========== PATH RESOLUTION CACHE ========== */
+
+/* The working directory is cached in-process; chdir()/fchdir() drop it and
+ * bump cwd_generation so resolutions keyed on the old cwd stop matching */
+static char cwd_cache[PATH_MAX];
+static size_t cwd_cache_len = 0;
+static int cwd_cache_valid = 0;
+static _Atomic(uint64_t) cwd_generation = 1;
+static pthread_mutex_t cwd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Copy the working directory into buf; returns its length or -1 */
+static ssize_t get_cached_cwd(char *buf, size_t size) {
+  ssize_t len = -1;
+  pthread_mutex_lock(&cwd_mutex);
+  if (!cwd_cache_valid && getcwd(cwd_cache, sizeof(cwd_cache))) {
+    cwd_cache_len = strlen(cwd_cache);
+    cwd_cache_valid = 1;
+  }
+  if (cwd_cache_valid && cwd_cache_len < size) {
+    memcpy(buf, cwd_cache, cwd_cache_len + 1);
+    len = cwd_cache_len;
   }
+  pthread_mutex_unlock(&cwd_mutex);
+  return len;
 }
 
-static void cleanup_path_cache(void) {
-  /* Lock-free cleanup - we don't need synchronization during shutdown */
-  for (int i = 0; i < PATH_CACHE_SIZE; i++) {
-    path_cache_entry_t *entry = atomic_load(&path_cache_atomic[i]);
-    while (entry) {
-      path_cache_entry_t *next = atomic_load(&entry->next);
-      free(entry->path);
-      free(entry->resolved_path);
-      free(entry);
-      entry = next;
-    }
-    atomic_store(&path_cache_atomic[i], NULL);
-  }
+#ifndef FEX_NO_INTERPOSE
+static void invalidate_cached_cwd(void) {
+  pthread_mutex_lock(&cwd_mutex);
+  cwd_cache_valid = 0;
+  atomic_fetch_add(&cwd_generation, 1);
+  pthread_mutex_unlock(&cwd_mutex);
 }
+#endif /* FEX_NO_INTERPOSE */
+
+/* Bounded (dirfd, generation, path) -> resolved path cache with CLOCK
+ * eviction. Entries live in a fixed pool chained from hash buckets; both
+ * strings share one allocation made on insert, and hits copy the result
+ * into caller storage. */
+typedef struct path_cache_entry {
+  char *path;                /* Key; the resolved path follows its NUL */
+  const char *resolved_path;
+  uint64_t generation;       /* cwd or dirfd generation at resolve time */
+  int dirfd;
+  unsigned int hash;
+  int next;                  /* Next entry in the bucket chain, or -1 */
+  int referenced;            /* CLOCK reference bit */
+} path_cache_entry_t;
 
-static unsigned int hash_path(const char *path) {
+static path_cache_entry_t *path_cache_entries = NULL;
+static int *path_cache_buckets = NULL;
+static size_t path_cache_bucket_mask = 0;
+static size_t path_cache_used = 0;
+static size_t path_cache_hand = 0;
+static uint64_t path_cache_hits = 0;
+static uint64_t path_cache_misses = 0;
+static uint64_t path_cache_evictions = 0;
+static pthread_mutex_t path_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_path(int dirfd, uint64_t generation,
+                              const char *path) {
   unsigned int hash = 5381;
   int c;
 
   while ((c = *path++)) {
     hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
   }
-
-  return hash % PATH_CACHE_SIZE;
+  hash ^= (unsigned int)dirfd * 0x9e3779b1u;
+  hash ^= (unsigned int)(generation * 0x85ebca6bu);
+  return hash;
 }
 
-static char *get_cached_path(const char *path) {
-  if (!path)
-    return NULL;
+/* Allocate the pool on first use; called with path_cache_mutex held */
+static int init_path_cache(void) {
+  if (path_cache_entries)
+    return 0;
 
-  unsigned int hash = hash_path(path);
+  size_t buckets = 1;
+  while (buckets < path_cache_capacity)
+    buckets <<= 1;
+
+  path_cache_entries = calloc(path_cache_capacity, sizeof(path_cache_entry_t));
+  path_cache_buckets = malloc(buckets * sizeof(int));
+  if (!path_cache_entries || !path_cache_buckets) {
+    free(path_cache_entries);
+    free(path_cache_buckets);
+    path_cache_entries = NULL;
+    path_cache_buckets = NULL;
+    return -1;
+  }
+  for (size_t i = 0; i < buckets; i++)
+    path_cache_buckets[i] = -1;
+  path_cache_bucket_mask = buckets - 1;
+  return 0;
+}
 
-  /* Lock-free traversal of the linked list */
-  path_cache_entry_t *entry =
-      atomic_load_explicit(&path_cache_atomic[hash], memory_order_acquire);
+/* Look up a resolution; on a hit copy it into resolved and return 1 */
+static int get_cached_path(int dirfd, uint64_t generation, const char *path,
+                           unsigned int hash, char *resolved, size_t size) {
+  int hit = 0;
+  pthread_mutex_lock(&path_cache_mutex);
+  if (path_cache_entries) {
+    int index = path_cache_buckets[hash & path_cache_bucket_mask];
+    while (index >= 0) {
+      path_cache_entry_t *entry = &path_cache_entries[index];
+      if (entry->hash == hash && entry->dirfd == dirfd &&
+          entry->generation == generation && strcmp(entry->path, path) == 0) {
+        size_t len = strlen(entry->resolved_path);
+        if (len < size) {
+          memcpy(resolved, entry->resolved_path, len + 1);
+          entry->referenced = 1;
+          hit = 1;
+        }
+        break;
+      }
+      index = entry->next;
+    }
+  }
+  if (hit) {
+    path_cache_hits++;
+  } else {
+    path_cache_misses++;
+  }
+  pthread_mutex_unlock(&path_cache_mutex);
+  return hit;
+}
 
-  while (entry) {
-    /* Check if this entry matches our path */
-    if (strcmp(entry->path, path) == 0) {
-      /* Atomically increment reference count */
-      atomic_fetch_add_explicit(&entry->ref_count, 1, memory_order_relaxed);
+/* Unlink a pool entry from its bucket chain and free its strings */
+static void evict_path_cache_entry(int index) {
+  path_cache_entry_t *entry = &path_cache_entries[index];
+  int *link = &path_cache_buckets[entry->hash & path_cache_bucket_mask];
+  while (*link != index) {
+    link = &path_cache_entries[*link].next;
+  }
+  *link = entry->next;
+  free(entry->path);
+  entry->path = NULL;
+  path_cache_evictions++;
+}
 
-      /* Return a copy of the resolved path */
-      char *result = strdup(entry->resolved_path);
+static void cache_path(int dirfd, uint64_t generation, const char *path,
+                       unsigned int hash, const char *resolved_path) {
+  size_t path_len = strlen(path);
+  size_t resolved_len = strlen(resolved_path);
+  char *strings = malloc(path_len + resolved_len + 2);
+  if (!strings) {
+    return;
+  }
+  memcpy(strings, path, path_len + 1);
+  memcpy(strings + path_len + 1, resolved_path, resolved_len + 1);
 
-      fex_log("Cache hit for path: %s\n", path);
+  pthread_mutex_lock(&path_cache_mutex);
+  if (init_path_cache() != 0) {
+    pthread_mutex_unlock(&path_cache_mutex);
+    free(strings);
+    return;
+  }
 
-      return result;
+  /* Take a free slot, or sweep the CLOCK hand to a cold one */
+  int index;
+  if (path_cache_used < path_cache_capacity) {
+    index = path_cache_used++;
+  } else {
+    for (;;) {
+      path_cache_entry_t *candidate = &path_cache_entries[path_cache_hand];
+      index = path_cache_hand;
+      path_cache_hand = (path_cache_hand + 1) % path_cache_capacity;
+      if (!candidate->referenced)
+        break;
+      candidate->referenced = 0;
     }
-
-    /* Move to next entry atomically */
-    entry = atomic_load_explicit(&entry->next, memory_order_acquire);
+    evict_path_cache_entry(index);
   }
 
-  fex_log("Cache miss for path: %s\n", path);
-
-  return NULL;
+  path_cache_entry_t *entry = &path_cache_entries[index];
+  entry->path = strings;
+  entry->resolved_path = strings + path_len + 1;
+  entry->generation = generation;
+  entry->dirfd = dirfd;
+  entry->hash = hash;
+  entry->referenced = 0;
+  entry->next = path_cache_buckets[hash & path_cache_bucket_mask];
+  path_cache_buckets[hash & path_cache_bucket_mask] = index;
+  pthread_mutex_unlock(&path_cache_mutex);
+
+  fex_log("Cached path: %d:%s -> %s\n", dirfd, path, resolved_path);
 }
 
-static void cache_path(const char *path, const char *resolved_path) {
-  if (!path || !resolved_path)
+/* ========== PATH MATCHING ========== */
+
+/* A rule selecting which paths are served as .fex. Every rule is indexed by
+ * the literal tail its matches must end with ("*.fex" -> ".fex"), so paths
+ * are rejected by their last byte and a few memcmp()s without resolving or
+ * allocating anything. */
+typedef struct fex_pattern {
+  char *glob;       /* fnmatch() pattern */
+  const char *tail; /* Literal suffix of every match, inside glob */
+  size_t tail_len;
+  int suffix_only;  /* "*<tail>": the tail test is the whole match */
+  int components;   /* Trailing path components matched, 0 = whole path */
+} fex_pattern_t;
+
+static fex_pattern_t *fex_patterns = NULL;
+static size_t fex_pattern_count = 0;
+static uint8_t fex_tail_last_bytes[256 / 8]; /* Bitmap of tails' last bytes */
+static int fex_match_any_tail = 0; /* Some rule ends in a wildcard */
+
+static void add_fex_pattern(const char *text, size_t len) {
+  /* Trim surrounding whitespace */
+  while (len && isspace((unsigned char)text[0])) {
+    text++;
+    len--;
+  }
+  while (len && isspace((unsigned char)text[len - 1])) {
+    len--;
+  }
+  if (len == 0 || text[0] == '#')
     return;
 
-  unsigned int hash = hash_path(path);
+  fex_pattern_t *patterns =
+      realloc(fex_patterns, (fex_pattern_count + 1) * sizeof(fex_pattern_t));
+  if (!patterns)
+    return;
+  fex_patterns = patterns;
 
-  /* First, check if the entry already exists (lock-free read) */
-  path_cache_entry_t *current_head =
-      atomic_load_explicit(&path_cache_atomic[hash], memory_order_acquire);
-  path_cache_entry_t *entry = current_head;
+  fex_pattern_t *pattern = &fex_patterns[fex_pattern_count];
+  pattern->glob = strndup(text, len);
+  if (!pattern->glob)
+    return;
 
-  while (entry) {
-    if (strcmp(entry->path, path) == 0) {
-      /* Entry already exists, no need to add */
-      fex_log("Path already cached: %s\n", path);
-      return;
+  /* The literal tail starts after the last wildcard */
+  size_t tail_start = len;
+  while (tail_start > 0 && !strchr("*?]", pattern->glob[tail_start - 1])) {
+    tail_start--;
+  }
+  pattern->tail = pattern->glob + tail_start;
+  pattern->tail_len = len - tail_start;
+  pattern->suffix_only = tail_start == 1 && pattern->glob[0] == '*' &&
+                         !strchr(pattern->tail, '/');
+
+  /* Absolute rules see the whole path; relative ones its last components */
+  pattern->components = 0;
+  if (pattern->glob[0] != '/') {
+    pattern->components = 1;
+    for (const char *c = pattern->glob; *c; c++) {
+      if (*c == '/')
+        pattern->components++;
     }
-    entry = atomic_load_explicit(&entry->next, memory_order_acquire);
   }
 
-  /* Create new entry */
-  path_cache_entry_t *new_entry = malloc(sizeof(path_cache_entry_t));
-  if (!new_entry) {
-    fex_log("Failed to allocate memory for cache entry\n");
-    return;
+  if (pattern->tail_len == 0) {
+    fex_match_any_tail = 1;
+  } else {
+    unsigned char last = pattern->tail[pattern->tail_len - 1];
+    fex_tail_last_bytes[last / 8] |= 1 << (last % 8);
   }
+  fex_pattern_count++;
 
-  /* Initialize the new entry */
-  new_entry->path = strdup(path);
-  new_entry->resolved_path = strdup(resolved_path);
-  if (!new_entry->path || !new_entry->resolved_path) {
-    free(new_entry->path);
-    free(new_entry->resolved_path);
-    free(new_entry);
-    return;
-  }
+  fex_log("Added .fex pattern '%s' (tail '%s', components %d)\n",
+          pattern->glob, pattern->tail, pattern->components);
+}
 
-  atomic_store(&new_entry->ref_count, 1);
-  atomic_store(&new_entry->generation, atomic_fetch_add(&global_generation, 1));
+/* Add every separator-delimited pattern in a list */
+static void add_fex_pattern_list(const char *list, const char *separators) {
+  while (*list) {
+    size_t len = strcspn(list, separators);
+    add_fex_pattern(list, len);
+    list += len;
+    if (*list)
+      list++;
+  }
+}
 
-  /* Lock-free insertion using Compare-And-Swap (CAS) */
-  do {
-    current_head =
-        atomic_load_explicit(&path_cache_atomic[hash], memory_order_acquire);
-    atomic_store_explicit(&new_entry->next, current_head, memory_order_relaxed);
+/* Compile the rules from FEX_PATTERNS (colon-separated globs) and
+ * FEX_PATTERNS_FILE (one glob per line, '#' comments); "*.fex" otherwise */
+static void load_fex_patterns(void) {
+  const char *list = getenv("FEX_PATTERNS");
+  if (list) {
+    add_fex_pattern_list(list, ":");
+  }
 
-    /* Try to insert at head of list */
-  } while (!atomic_compare_exchange_weak_explicit(
-      &path_cache_atomic[hash], &current_head, new_entry,
-      memory_order_release, /* Success ordering */
-      memory_order_acquire  /* Failure ordering */
-      ));
+  const char *file = getenv("FEX_PATTERNS_FILE");
+  if (file) {
+    FILE *fp = orig_fopen(file, "r");
+    if (fp) {
+      char line[PATH_MAX];
+      while (orig_fgets(line, sizeof(line), fp)) {
+        add_fex_pattern(line, strcspn(line, "\n"));
+      }
+      orig_fclose(fp);
+    } else {
+      fex_log("Failed to open FEX_PATTERNS_FILE %s\n", file);
+    }
+  }
 
-  fex_log("Successfully cached path: %s -> %s\n", path, resolved_path);
+  if (fex_pattern_count == 0) {
+    add_fex_pattern("*.fex", 5);
+  }
 }
 
-/* Check if a file has .fex extension */
-int should_process_as_fex(const char *pathname) {
-  if (!pathname)
+/* Cheap pre-filter on a raw, unresolved path: 0 means it can never match */
+static int fex_path_may_match(const char *pathname) {
+  if (!pathname || !pathname[0])
     return 0;
+  if (fex_match_any_tail)
+    return 1;
 
-  const char *ext = strrchr(pathname, '.');
-  return (ext && strcmp(ext, ".fex") == 0);
+  size_t len = strlen(pathname);
+  unsigned char last = pathname[len - 1];
+  if (!(fex_tail_last_bytes[last / 8] & (1 << (last % 8))))
+    return 0;
+
+  for (size_t i = 0; i < fex_pattern_count; i++) {
+    const fex_pattern_t *pattern = &fex_patterns[i];
+    if (pattern->tail_len <= len &&
+        memcmp(pathname + len - pattern->tail_len, pattern->tail,
+               pattern->tail_len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
-/* Create a temporary file containing the generated C code for a FEX file */
-int create_fex_temp_file(const char *fex_path) {
-  if (!fex_path) {
-    return -1;
+/* Point at the last 'components' components of path, or NULL if it has
+ * fewer */
+static const char *last_path_components(const char *path, size_t len,
+                                        int components) {
+  const char *p = path + len;
+  while (p > path) {
+    if (p[-1] == '/' && --components == 0)
+      return p;
+    p--;
   }
+  return components == 1 ? path : NULL;
+}
 
-  /* Read the FEX file content */
-  FILE *fex_file = orig_fopen(fex_path, "rb");
-  if (!fex_file) {
-    fex_log("Failed to open FEX file: %s\n", fex_path);
-    return -1;
+/* Check if a path is served as .fex under the configured rules */
+int should_process_as_fex(const char *pathname) {
+  if (!fex_path_may_match(pathname))
+    return 0;
+
+  size_t len = strlen(pathname);
+  char absolute[PATH_MAX];
+  const char *full = NULL; /* pathname made absolute, on demand */
+
+  for (size_t i = 0; i < fex_pattern_count; i++) {
+    const fex_pattern_t *pattern = &fex_patterns[i];
+    if (pattern->tail_len > len ||
+        memcmp(pathname + len - pattern->tail_len, pattern->tail,
+               pattern->tail_len) != 0) {
+      continue;
+    }
+    if (pattern->suffix_only)
+      return 1;
+
+    const char *subject =
+        pattern->components
+            ? last_path_components(pathname, len, pattern->components)
+            : (pathname[0] == '/' ? pathname : NULL);
+    if (!subject && pathname[0] != '/') {
+      /* Relative path too short for the rule: match it against the cwd */
+      if (!full) {
+        ssize_t cwd_len = get_cached_cwd(absolute, sizeof(absolute));
+        if (cwd_len < 0 || cwd_len + 1 + len >= sizeof(absolute))
+          continue;
+        absolute[cwd_len] = '/';
+        memcpy(absolute + cwd_len + 1, pathname, len + 1);
+        full = absolute;
+      }
+      subject = pattern->components
+                    ? last_path_components(full, strlen(full),
+                                           pattern->components)
+                    : full;
+    }
+    if (subject && fnmatch(pattern->glob, subject, FNM_PATHNAME) == 0)
+      return 1;
   }
+  return 0;
+}
 
-  /* Get file size */
-  if (orig_fseek(fex_file, 0, SEEK_END) != 0) {
-    orig_fclose(fex_file);
-    return -1;
+/* ========== MEMORY POOLS ========== */
+
+/* Slab allocator for tracking entries. Objects come in a few size classes
+ * carved out of FEX_SLAB_SIZE slabs and recycled through per-class free
+ * lists; larger requests fall back to malloc(). */
+#define FEX_SLAB_SIZE (64 * 1024)
+#define FEX_SLAB_CLASSES 5
+
+typedef struct fex_slab_object {
+  struct fex_slab_object *next;
+} fex_slab_object_t;
+
+static const size_t fex_slab_class_sizes[FEX_SLAB_CLASSES] = {512, 1024, 2048,
+                                                              4096, 8192};
+static fex_slab_object_t *fex_slab_free_lists[FEX_SLAB_CLASSES];
+static size_t fex_slab_bytes = 0;
+static pthread_mutex_t fex_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *fex_slab_alloc(size_t size, int *slab_class) {
+  int cls = 0;
+  while (cls < FEX_SLAB_CLASSES && fex_slab_class_sizes[cls] < size) {
+    cls++;
   }
-  long file_size = orig_ftell(fex_file);
-  if (file_size < 0) {
-    orig_fclose(fex_file);
-    return -1;
+  if (cls == FEX_SLAB_CLASSES) {
+    *slab_class = -1;
+    return malloc(size);
   }
-  orig_rewind(fex_file);
 
-  /* Allocate buffer for file content */
-  unsigned char *buffer = malloc(file_size);
-  if (!buffer) {
-    orig_fclose(fex_file);
-    return -1;
+  pthread_mutex_lock(&fex_slab_mutex);
+  if (!fex_slab_free_lists[cls]) {
+    unsigned char *slab = mmap(NULL, FEX_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+      pthread_mutex_unlock(&fex_slab_mutex);
+      return NULL;
+    }
+    fex_slab_bytes += FEX_SLAB_SIZE;
+    size_t object_size = fex_slab_class_sizes[cls];
+    for (size_t offset = 0; offset + object_size <= FEX_SLAB_SIZE;
+         offset += object_size) {
+      fex_slab_object_t *object = (fex_slab_object_t *)(slab + offset);
+      object->next = fex_slab_free_lists[cls];
+      fex_slab_free_lists[cls] = object;
+    }
   }
 
-  /* Read file content */
-  size_t bytes_read = orig_fread(buffer, 1, file_size, fex_file);
-  orig_fclose(fex_file);
+  fex_slab_object_t *object = fex_slab_free_lists[cls];
+  fex_slab_free_lists[cls] = object->next;
+  pthread_mutex_unlock(&fex_slab_mutex);
 
-  if (bytes_read != (size_t)file_size) {
-    free(buffer);
-    return -1;
-  }
+  *slab_class = cls;
+  return object;
+}
 
-  /* Generate C code content */
-  char *var_name = generate_c_variable_name(fex_path);
-  if (!var_name) {
-    free(buffer);
-    return -1;
+static void fex_slab_free(void *ptr, int slab_class) {
+  if (!ptr)
+    return;
+  if (slab_class < 0) {
+    free(ptr);
+    return;
   }
 
-  /* Create temporary file */
-  char temp_template[] = "/tmp/fex_XXXXXX";
-  int temp_fd = mkstemp(temp_template);
-  if (temp_fd == -1) {
-    free(buffer);
-    free(var_name);
-    return -1;
+  fex_slab_object_t *object = ptr;
+  pthread_mutex_lock(&fex_slab_mutex);
+  object->next = fex_slab_free_lists[slab_class];
+  fex_slab_free_lists[slab_class] = object;
+  pthread_mutex_unlock(&fex_slab_mutex);
+}
+
+/* Page-aligned block and scratch buffers in power-of-two classes from 4 KB,
+ * recycled through per-class free lists bounded in depth and, across all
+ * classes, by buffer_pool_budget bytes. Buffers of a huge page or more are
+ * mapped directly and, with FEX_HUGE_PAGES, backed by huge pages. */
+#define FEX_BUFFER_MIN_SHIFT 12
+#define FEX_BUFFER_CLASSES 19 /* 4 KB .. 1 GB */
+#define FEX_BUFFER_POOL_DEPTH 16
+#define FEX_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct fex_pooled_buffer {
+  struct fex_pooled_buffer *next;
+} fex_pooled_buffer_t;
+
+static fex_pooled_buffer_t *fex_buffer_free_lists[FEX_BUFFER_CLASSES];
+static int fex_buffer_free_counts[FEX_BUFFER_CLASSES];
+static size_t fex_buffer_pooled_bytes = 0;
+static uint64_t fex_buffer_allocations = 0;
+static uint64_t fex_buffer_reuses = 0;
+static pthread_mutex_t fex_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int fex_buffer_class(size_t size) {
+  int cls = 0;
+  while (cls < FEX_BUFFER_CLASSES &&
+         ((size_t)1 << (FEX_BUFFER_MIN_SHIFT + cls)) < size) {
+    cls++;
   }
+  return cls;
+}
 
-  /* Generate and write C code */
-  FILE *temp_file = fdopen(temp_fd, "w");
-  if (!temp_file) {
-    close(temp_fd);
-    unlink(temp_template);
-    free(buffer);
-    free(var_name);
-    return -1;
+/* Bytes a buffer of this size really occupies: its class size */
+static size_t fex_buffer_bytes(size_t size) {
+  return (size_t)1 << (FEX_BUFFER_MIN_SHIFT + fex_buffer_class(size));
+}
+
+static void release_fex_buffer(void *buf, size_t bytes) {
+  if (bytes >= FEX_HUGE_PAGE_SIZE) {
+    munmap(buf, bytes);
+  } else {
+    free(buf);
   }
+}
 
-  /* Write header */
-  fprintf(temp_file, "unsigned char %s[] = {", var_name);
+unsigned char *fex_buffer_alloc(size_t size) {
+  int cls = fex_buffer_class(size);
+  if (cls == FEX_BUFFER_CLASSES)
+    return NULL;
 
-  /* Write hex data */
-  if (simple_override) {
-    /* Simple mode: replace all bytes with '!' character */
-    for (size_t i = 0; i < bytes_read; i++) {
-      if (i > 0)
-        fprintf(temp_file, " ");
-      fprintf(temp_file, "'!',");
-    }
+  pthread_mutex_lock(&fex_buffer_mutex);
+  fex_pooled_buffer_t *pooled = fex_buffer_free_lists[cls];
+  if (pooled) {
+    fex_buffer_free_lists[cls] = pooled->next;
+    fex_buffer_free_counts[cls]--;
+    fex_buffer_pooled_bytes -= (size_t)1 << (FEX_BUFFER_MIN_SHIFT + cls);
+    fex_buffer_reuses++;
   } else {
-    /* Normal mode: convert bytes to hex */
-    for (size_t i = 0; i < bytes_read; i++) {
-      if (i > 0)
-        fprintf(temp_file, " ");
-      fprintf(temp_file, "%s", hex_table[buffer[i] & 255]);
+    fex_buffer_allocations++;
+  }
+  pthread_mutex_unlock(&fex_buffer_mutex);
+  if (pooled)
+    return (unsigned char *)pooled;
+
+  size_t bytes = (size_t)1 << (FEX_BUFFER_MIN_SHIFT + cls);
+  if (bytes < FEX_HUGE_PAGE_SIZE) {
+    void *buf = NULL;
+    return posix_memalign(&buf, 4096, bytes) == 0 ? buf : NULL;
+  }
+
+  void *buf = MAP_FAILED;
+  if (use_huge_pages) {
+    buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (buf == MAP_FAILED) {
+    buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+      return NULL;
+    if (use_huge_pages) {
+      madvise(buf, bytes, MADV_HUGEPAGE);
     }
   }
+  return buf;
+}
 
-  /* Write footer */
-  fprintf(temp_file, "};\nunsigned long %s_SIZE = %zu;\n", var_name,
-          bytes_read);
+void fex_buffer_free(unsigned char *buf, size_t size) {
+  if (!buf)
+    return;
 
-  fflush(temp_file);
-  fclose(temp_file);
+  int cls = fex_buffer_class(size);
+  size_t bytes = (size_t)1 << (FEX_BUFFER_MIN_SHIFT + cls);
+  pthread_mutex_lock(&fex_buffer_mutex);
+  if (fex_buffer_free_counts[cls] < FEX_BUFFER_POOL_DEPTH &&
+      fex_buffer_pooled_bytes + bytes <= buffer_pool_budget) {
+    fex_pooled_buffer_t *pooled = (fex_pooled_buffer_t *)buf;
+    pooled->next = fex_buffer_free_lists[cls];
+    fex_buffer_free_lists[cls] = pooled;
+    fex_buffer_free_counts[cls]++;
+    fex_buffer_pooled_bytes += bytes;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&fex_buffer_mutex);
 
-  /* Reopen as read-only file descriptor */
-  close(temp_fd);
-  temp_fd = orig_open(temp_template, O_RDONLY);
+  if (buf) {
+    release_fex_buffer(buf, bytes);
+  }
+}
 
-  /* Remove the temporary file (it stays accessible via fd until closed) */
-  unlink(temp_template);
+/* ========== ARCHIVE MEMBERS ========== */
+
+/* Members of zip and tar archives are embedded without extracting them,
+ * either as "<archive>/<member>" where <archive> is served as .fex (say
+ * "bundle.zip.fex/img/logo.png") or through a pointer manifest with a
+ * "member" line. Each archive's member index is read once and cached by
+ * identity. Stored members are read in place at their offset; deflated
+ * zip members are inflated once and the copy kept with the index. Copies
+ * live in memfds up to FEX_ARCHIVE_INFLATED_MAX bytes in all; a member
+ * larger than that goes to an unlinked file under $TMPDIR instead, so it
+ * is neither held in memory nor inflated again on the next open. stat()
+ * takes the size from the index and never inflates. */
+
+#define FEX_ARCHIVE_CACHE 64 /* Archives whose index is kept */
+#define FEX_ARCHIVE_INFLATED_MAX (256L * 1024 * 1024) /* Inflated bytes kept */
+
+typedef struct {
+  char *name;
+  off_t header;      /* Zip local header, or tar data offset */
+  off_t data;        /* Offset of the member bytes, -1 until known */
+  off_t size;        /* Uncompressed size */
+  off_t packed_size; /* Stored size in the archive */
+  int method;        /* 0 stored, 8 deflate */
+  int inflated_fd;   /* Inflated copy of the member, or -1 */
+} archive_member_t;
+
+typedef struct archive_index {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  archive_member_t *members; /* Sorted by name */
+  size_t count;
+  struct archive_index *next;
+} archive_index_t;
+
+static archive_index_t *archive_indexes = NULL;
+static size_t archive_index_count = 0;
+static off_t archive_inflated_bytes = 0; /* Held by inflated_fd memfds */
+
+/* Copies above the memory budget are kept on disk and not counted */
+static int archive_member_on_disk(const archive_member_t *member) {
+  return member->size > FEX_ARCHIVE_INFLATED_MAX;
+}
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  free(buffer);
-  free(var_name);
+static uint16_t get_le16(const unsigned char *p) { return p[0] | p[1] << 8; }
 
-  return temp_fd;
+static uint32_t get_le32(const unsigned char *p) {
+  return (uint32_t)get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
 }
 
-/* Resolve full pathname for openat/fstatat operations */
-char *resolve_openat_path(int dirfd, const char *pathname) {
-  if (!pathname)
-    return NULL;
+static uint64_t get_le64(const unsigned char *p) {
+  return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
 
-  fex_log("resolve_openat_path: dirfd=%d, pathname=\"%s\"\n", dirfd, pathname);
+static int compare_archive_members(const void *a, const void *b) {
+  return strcmp(((const archive_member_t *)a)->name,
+                ((const archive_member_t *)b)->name);
+}
+
+static int add_archive_member(archive_index_t *index, size_t *capacity,
+                              const char *name, size_t name_len,
+                              archive_member_t member) {
+  if (index->count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    archive_member_t *members =
+        realloc(index->members, grown * sizeof(archive_member_t));
+    if (!members)
+      return -1;
+    index->members = members;
+    *capacity = grown;
+  }
+  member.name = strndup(name, name_len);
+  if (!member.name)
+    return -1;
+  member.inflated_fd = -1;
+  index->members[index->count++] = member;
+  return 0;
+}
 
-  /* Create cache key for this combination */
-  char cache_key[512];
-  snprintf(cache_key, sizeof(cache_key), "%d:%s", dirfd, pathname);
+/* Read the zip central directory; returns 0 if fd is a zip */
+static int index_zip_archive(int fd, off_t size, archive_index_t *index) {
+  /* The end of central directory record is in the last 64 KB + 22 bytes */
+  unsigned char tail[65536 + 22];
+  off_t tail_len = MIN(size, (off_t)sizeof(tail));
+  if (tail_len < 22 ||
+      read_source_at(fd, tail, tail_len, size - tail_len) != 0)
+    return -1;
+  off_t eocd = tail_len - 22;
+  while (eocd >= 0 && get_le32(tail + eocd) != 0x06054b50)
+    eocd--;
+  if (eocd < 0)
+    return -1;
 
-  /* Check path cache first */
-  char *cached_result = get_cached_path(cache_key);
-  if (cached_result) {
-    return cached_result;
+  uint64_t entries = get_le16(tail + eocd + 10);
+  uint64_t cd_size = get_le32(tail + eocd + 12);
+  uint64_t cd_offset = get_le32(tail + eocd + 16);
+
+  /* Zip64: the locator just before the record points at the real one */
+  if ((cd_offset == 0xffffffff || entries == 0xffff) && eocd >= 20 &&
+      get_le32(tail + eocd - 20) == 0x07064b50) {
+    unsigned char record[56];
+    if (read_source_at(fd, record, sizeof(record),
+                       get_le64(tail + eocd - 20 + 8)) != 0 ||
+        get_le32(record) != 0x06064b50)
+      return -1;
+    entries = get_le64(record + 32);
+    cd_size = get_le64(record + 40);
+    cd_offset = get_le64(record + 48);
   }
+  if (cd_offset > (uint64_t)size || cd_size > (uint64_t)size - cd_offset)
+    return -1;
 
-  /* If pathname is absolute, use as-is */
-  if (pathname[0] == '/') {
-    fex_log("Absolute path detected, ignoring dirfd\n");
-    char *result = strdup(pathname);
-    if (result) {
-      cache_path(cache_key, result);
-    }
-    return result;
+  unsigned char *cd = malloc(cd_size ? cd_size : 1);
+  if (!cd || read_source_at(fd, cd, cd_size, cd_offset) != 0) {
+    free(cd);
+    return -1;
   }
 
-  /* If dirfd is AT_FDCWD, use current working directory */
-  if (dirfd == AT_FDCWD) {
-    fex_log("Using AT_FDCWD\n");
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd))) {
-      size_t full_len = strlen(cwd) + 1 + strlen(pathname) + 1;
-      char *full_pathname = malloc(full_len);
-      if (full_pathname) {
-        snprintf(full_pathname, full_len, "%s/%s", cwd, pathname);
-        cache_path(cache_key, full_pathname);
-        return full_pathname;
+  size_t capacity = 0;
+  size_t pos = 0;
+  for (uint64_t i = 0; i < entries && pos + 46 <= cd_size; i++) {
+    const unsigned char *h = cd + pos;
+    if (get_le32(h) != 0x02014b50)
+      break;
+    size_t name_len = get_le16(h + 28);
+    size_t extra_len = get_le16(h + 30);
+    size_t comment_len = get_le16(h + 32);
+    if (pos + 46 + name_len + extra_len > cd_size)
+      break;
+    const char *name = (const char *)h + 46;
+    archive_member_t member = {.method = get_le16(h + 10),
+                               .packed_size = get_le32(h + 20),
+                               .size = get_le32(h + 24),
+                               .header = get_le32(h + 42),
+                               .data = -1};
+
+    /* Zip64 extra field: the 64-bit values of the saturated ones, in order */
+    const unsigned char *extra = h + 46 + name_len;
+    for (size_t e = 0; e + 4 <= extra_len;) {
+      size_t id = get_le16(extra + e), len = get_le16(extra + e + 2);
+      if (id == 0x0001) {
+        const unsigned char *v = extra + e + 4;
+        const unsigned char *end = v + MIN(len, extra_len - e - 4);
+        if (member.size == 0xffffffff && v + 8 <= end) {
+          member.size = get_le64(v);
+          v += 8;
+        }
+        if (member.packed_size == 0xffffffff && v + 8 <= end) {
+          member.packed_size = get_le64(v);
+          v += 8;
+        }
+        if (member.header == 0xffffffff && v + 8 <= end)
+          member.header = get_le64(v);
       }
+      e += 4 + len;
     }
-    /* Fallback to relative path if getcwd fails */
-    char *fallback = strdup(pathname);
-    if (fallback) {
-      cache_path(cache_key, fallback);
+
+    /* Skip directories, encrypted members and unknown methods */
+    int encrypted = get_le16(h + 8) & 1;
+    if (name_len && name[name_len - 1] != '/' && !encrypted &&
+        (member.method == 0 || member.method == 8)) {
+      if (add_archive_member(index, &capacity, name, name_len, member) != 0)
+        break;
     }
-    return fallback; /* Fallback */
+    pos += 46 + name_len + extra_len + comment_len;
   }
+  free(cd);
+  return 0;
+}
 
-  /* Look up the directory path for this fd using directory tracking */
-  directory_fd_mapping_t *dir_mapping = find_directory_fd_mapping(dirfd);
-  if (dir_mapping && dir_mapping->dirpath) {
-    fex_log("Found directory mapping: fd %d -> \"%s\"\n", dirfd,
-            dir_mapping->dirpath);
+/* Parse a tar numeric field: octal text, or base-256 with the high bit */
+static off_t parse_tar_number(const unsigned char *field, size_t len) {
+  off_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x3f;
+    for (size_t i = 1; i < len; i++)
+      value = (value << 8) | field[i];
+    return value;
+  }
+  for (size_t i = 0; i < len && field[i]; i++) {
+    if (field[i] >= '0' && field[i] <= '7')
+      value = value * 8 + (field[i] - '0');
+  }
+  return value;
+}
 
-    char *full_pathname =
-        malloc(strlen(dir_mapping->dirpath) + strlen(pathname) + 2);
-    if (full_pathname) {
-      /* Check if directory path already ends with slash */
-      size_t dir_len = strlen(dir_mapping->dirpath);
-      int dir_ends_with_slash =
-          (dir_len > 0 && dir_mapping->dirpath[dir_len - 1] == '/');
+/* Walk the tar headers; returns 0 if fd is a ustar/GNU tar */
+static int index_tar_archive(int fd, off_t size, archive_index_t *index) {
+  unsigned char header[512];
+  if (size < 512 || read_source_at(fd, header, 512, 0) != 0 ||
+      memcmp(header + 257, "ustar", 5) != 0)
+    return -1;
 
-      if (dir_ends_with_slash) {
-        snprintf(full_pathname,
-                 strlen(dir_mapping->dirpath) + strlen(pathname) + 2, "%s%s",
-                 dir_mapping->dirpath, pathname);
+  size_t capacity = 0;
+  char long_name[PATH_MAX] = "";
+  off_t pos = 0;
+  while (pos + 512 <= size && read_source_at(fd, header, 512, pos) == 0 &&
+         header[0]) {
+    off_t member_size = parse_tar_number(header + 124, 12);
+    off_t data = pos + 512;
+    char type = header[156];
+
+    if (type == 'L' || type == 'x') {
+      /* GNU long name, or a PAX header that may carry "path=" */
+      char text[PATH_MAX + 64];
+      size_t n = MIN((size_t)member_size, sizeof(text) - 1);
+      if (read_source_at(fd, (unsigned char *)text, n, data) != 0)
+        break;
+      text[n] = '\0';
+      if (type == 'L') {
+        snprintf(long_name, sizeof(long_name), "%.*s",
+                 (int)sizeof(long_name) - 1, text);
+      } else {
+        for (char *record = text; record < text + n;) {
+          char *end;
+          long len = strtol(record, &end, 10);
+          if (len <= 0 || *end != ' ')
+            break;
+          if (strncmp(end + 1, "path=", 5) == 0) {
+            int value_len = (int)(len - (end + 6 - record) - 1);
+            snprintf(long_name, sizeof(long_name), "%.*s",
+                     MAX(value_len, 0), end + 6);
+          }
+          record += len;
+        }
+      }
+    } else if (type == '0' || type == '\0' || type == '7') {
+      char name[PATH_MAX];
+      if (long_name[0]) {
+        snprintf(name, sizeof(name), "%s", long_name);
+      } else if (header[345]) {
+        snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
       } else {
-        snprintf(full_pathname,
-                 strlen(dir_mapping->dirpath) + strlen(pathname) + 2, "%s/%s",
-                 dir_mapping->dirpath, pathname);
+        snprintf(name, sizeof(name), "%.100s", header);
       }
-      cache_path(cache_key, full_pathname);
-      return full_pathname;
+      const char *member_name = strncmp(name, "./", 2) == 0 ? name + 2 : name;
+      archive_member_t member = {.header = pos,
+                                 .data = data,
+                                 .size = member_size,
+                                 .packed_size = member_size,
+                                 .method = 0};
+      if (add_archive_member(index, &capacity, member_name,
+                             strlen(member_name), member) != 0)
+        break;
+      long_name[0] = '\0';
+    } else {
+      long_name[0] = '\0';
     }
-  } else {
-    fex_log("No directory mapping found for fd %d\n", dirfd);
+    pos = data + ((member_size + 511) & ~(off_t)511);
   }
+  return 0;
+}
 
-#if 0
-  /* Fallback: try /proc/self/fd/ approach */
-  char dirpath[PATH_MAX];
-  char fdpath[64];
-  snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", dirfd);
-
-  ssize_t len = readlink(fdpath, dirpath, sizeof(dirpath) - 1);
-  if (len == -1) {
-    /* If we can't resolve the directory, construct relative to cwd */
-    fex_log("Failed to resolve directory for fd %d, trying relative to cwd\n",
-            dirfd);
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd))) {
-      size_t full_len = strlen(cwd) + 1 + strlen(pathname) + 1;
-      char *full_pathname = malloc(full_len);
-      if (full_pathname) {
-        snprintf(full_pathname, full_len, "%s/%s", cwd, pathname);
-        return full_pathname;
-      }
+/* Find or build the member index of the archive open on fd. Called with
+ * archive_mutex held. */
+static archive_index_t *get_archive_index(int fd, const struct stat *st) {
+  archive_index_t **link = &archive_indexes;
+  for (archive_index_t *index = archive_indexes; index;
+       link = &index->next, index = index->next) {
+    if (index->ino == st->st_ino && index->dev == st->st_dev &&
+        index->mtime.tv_sec == st->st_mtim.tv_sec &&
+        index->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+      /* Move to the front */
+      *link = index->next;
+      index->next = archive_indexes;
+      archive_indexes = index;
+      return index;
     }
-    return strdup(pathname);
   }
-  dirpath[len] = '\0';
 
-  /* Construct full pathname */
-  size_t full_len =
-      len + 1 + strlen(pathname) + 1; /* dir + '/' + file + '\0' */
-  char *full_pathname = malloc(full_len);
-  if (!full_pathname)
+  archive_index_t *index = calloc(1, sizeof(*index));
+  if (!index)
+    return NULL;
+  if (index_zip_archive(fd, st->st_size, index) != 0 &&
+      index_tar_archive(fd, st->st_size, index) != 0) {
+    fex_log("Not a zip or tar archive\n");
+    free(index);
     return NULL;
-
-  snprintf(full_pathname, full_len, "%s/%s", dirpath, pathname);
-  return full_pathname;
-#else
-  char *fallback = strdup(pathname);
-  if (fallback) {
-    cache_path(cache_key, fallback);
   }
-  return fallback;
-#endif
+  qsort(index->members, index->count, sizeof(archive_member_t),
+        compare_archive_members);
+  index->dev = st->st_dev;
+  index->ino = st->st_ino;
+  index->mtime = st->st_mtim;
+  index->next = archive_indexes;
+  archive_indexes = index;
+  fex_log("Indexed archive with %zu members\n", index->count);
+
+  /* Forget the least recently used archive beyond the limit */
+  if (++archive_index_count > FEX_ARCHIVE_CACHE) {
+    archive_index_t **last = &archive_indexes;
+    while ((*last)->next)
+      last = &(*last)->next;
+    archive_index_t *victim = *last;
+    *last = NULL;
+    for (size_t i = 0; i < victim->count; i++) {
+      free(victim->members[i].name);
+      if (victim->members[i].inflated_fd >= 0) {
+        orig_close(victim->members[i].inflated_fd);
+        if (!archive_member_on_disk(&victim->members[i]))
+          archive_inflated_bytes -= victim->members[i].size;
+      }
+    }
+    free(victim->members);
+    free(victim);
+    archive_index_count--;
+  }
+  return index;
 }
 
-/* Generate C variable name from filename (without extension) */
-char *generate_c_variable_name(const char *filename) {
-  if (!filename)
-    return NULL;
+/* Inflate a deflated zip member into a memfd, or an unlinked temporary
+ * file when it is too large to keep in memory. *keep is cleared when a
+ * large member had to fall back to a memfd, which is then not kept. */
+static int inflate_archive_member(int fd, const archive_member_t *member,
+                                  int *keep) {
+  int out_fd = -1;
+  *keep = 1;
+  if (archive_member_on_disk(member)) {
+    const char *tmpdir = getenv("TMPDIR");
+    out_fd = orig_open(tmpdir && *tmpdir ? tmpdir : "/tmp",
+                       O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    *keep = out_fd >= 0;
+  }
+  if (out_fd < 0)
+    out_fd = memfd_create("fex-member", MFD_CLOEXEC);
+  if (out_fd < 0)
+    return -1;
 
-  /* Find the base filename (after last slash) */
-  const char *base = strrchr(filename, '/');
-  if (base) {
-    base++; /* Skip the slash */
-  } else {
-    base = filename;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    orig_close(out_fd);
+    return -1;
+  }
+  unsigned char *in = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  unsigned char *out = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  off_t read_pos = member->data;
+  off_t remaining = member->packed_size;
+  off_t written = 0;
+  int status = in && out ? Z_OK : Z_MEM_ERROR;
+  while (status == Z_OK) {
+    if (stream.avail_in == 0 && remaining > 0) {
+      size_t n = MIN((off_t)FEX_RENDER_SCRATCH_SIZE, remaining);
+      if (read_source_at(fd, in, n, read_pos) != 0) {
+        status = Z_ERRNO;
+        break;
+      }
+      stream.next_in = in;
+      stream.avail_in = n;
+      read_pos += n;
+      remaining -= n;
+    }
+    stream.next_out = out;
+    stream.avail_out = FEX_RENDER_SCRATCH_SIZE;
+    status = inflate(&stream, Z_NO_FLUSH);
+    size_t produced = FEX_RENDER_SCRATCH_SIZE - stream.avail_out;
+    if (produced && write_all(out_fd, out, produced) != 0) {
+      status = Z_ERRNO;
+      break;
+    }
+    written += produced;
+    if (status == Z_BUF_ERROR && remaining == 0 && stream.avail_in == 0)
+      break;
+    if (status == Z_BUF_ERROR)
+      status = Z_OK;
   }
+  inflateEnd(&stream);
+  fex_buffer_free(in, FEX_RENDER_SCRATCH_SIZE);
+  fex_buffer_free(out, FEX_RENDER_SCRATCH_SIZE);
 
-  /* Find the extension and calculate length without it */
-  const char *ext = strrchr(base, '.');
-  size_t len = ext ? (size_t)(ext - base) : strlen(base);
+  if (status != Z_STREAM_END || written != member->size) {
+    fex_log("Failed to inflate archive member %s\n", member->name);
+    orig_close(out_fd);
+    return -1;
+  }
+  return out_fd;
+}
 
-  /* Allocate memory for the variable name */
-  char *var_name = malloc(len + 1);
-  if (!var_name)
+/* Find a member in the index of the archive open on archive_fd, reading
+ * where its zip data starts. Called with archive_mutex held; sets errno
+ * and returns NULL on failure. */
+static archive_member_t *find_archive_member(int archive_fd,
+                                             const struct stat *st,
+                                             const char *member_name) {
+  archive_index_t *index = get_archive_index(archive_fd, st);
+  archive_member_t key = {.name = (char *)member_name};
+  archive_member_t *member =
+      index ? bsearch(&key, index->members, index->count,
+                      sizeof(archive_member_t), compare_archive_members)
+            : NULL;
+  if (!member) {
+    errno = ENOENT;
     return NULL;
+  }
 
-  /* Copy and sanitize the name */
-  for (size_t i = 0; i < len; i++) {
-    char c = base[i];
-    /* Replace invalid characters with underscores */
-    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
-        (c >= '0' && c <= '9') || c == '_') {
-      var_name[i] = c;
-    } else {
-      var_name[i] = '_';
+  /* Zip data starts after the variable-length local header */
+  if (member->data < 0) {
+    unsigned char local[30];
+    if (read_source_at(archive_fd, local, sizeof(local), member->header) != 0 ||
+        get_le32(local) != 0x04034b50) {
+      errno = EIO;
+      return NULL;
     }
+    member->data =
+        member->header + 30 + get_le16(local + 26) + get_le16(local + 28);
   }
-  var_name[len] = '\0';
+  return member;
+}
 
-  /* Ensure it doesn't start with a digit */
-  if (len > 0 && var_name[0] >= '0' && var_name[0] <= '9') {
-    /* Prepend underscore by shifting and adding */
-    char *new_name = malloc(len + 2);
-    if (new_name) {
-      new_name[0] = '_';
-      strcpy(new_name + 1, var_name);
-      free(var_name);
-      var_name = new_name;
+/* Close the inflated copies of the least recently used archives, other
+ * than keep, until the total is within FEX_ARCHIVE_INFLATED_MAX. Called
+ * with archive_mutex held. */
+static void trim_inflated_members(const archive_member_t *keep) {
+  while (archive_inflated_bytes > FEX_ARCHIVE_INFLATED_MAX) {
+    archive_member_t *victim = NULL;
+    for (archive_index_t *index = archive_indexes; index; index = index->next) {
+      for (size_t i = 0; i < index->count; i++) {
+        if (index->members[i].inflated_fd >= 0 &&
+            !archive_member_on_disk(&index->members[i]) &&
+            &index->members[i] != keep)
+          victim = &index->members[i];
+      }
     }
+    if (!victim)
+      return;
+    orig_close(victim->inflated_fd);
+    victim->inflated_fd = -1;
+    archive_inflated_bytes -= victim->size;
   }
-
-  return var_name;
 }
 
-/* Generate C code strings and calculate simulated size for a .fex file */
-int generate_fex_code_data(const char *filename, off_t original_size,
-                           char **header_string, char **footer_string,
-                           off_t *simulated_size, off_t *header_len,
-                           off_t *data_len, off_t *footer_start) {
-  if (!filename || !header_string || !footer_string || !simulated_size ||
-      !header_len || !data_len || !footer_start) {
+/* Resolve a member of the archive open on archive_fd into a source. On
+ * success the source owns a descriptor distinct from archive_fd. Without
+ * need_bytes only the length and metadata are wanted, so a deflated
+ * member is not inflated and the source's bytes are not its contents. */
+static int open_archive_member(int archive_fd, const struct stat *st,
+                               const char *member_name, int need_bytes,
+                               fex_source_t *source) {
+  pthread_mutex_lock(&archive_mutex);
+  archive_member_t *member = find_archive_member(archive_fd, st, member_name);
+  if (!member) {
+    int error = errno;
+    pthread_mutex_unlock(&archive_mutex);
+    errno = error;
     return -1;
   }
 
-  /* Initialize output parameters */
-  *header_string = NULL;
-  *footer_string = NULL;
-  *simulated_size = 0;
-  *header_len = 0;
-  *data_len = 0;
-  *footer_start = 0;
-
-  /* Generate C variable name */
-  char *var_name = generate_c_variable_name(filename);
-  if (!var_name) {
-    return -1;
+  int fd;
+  source->length = member->size;
+  if (member->method == 8 && need_bytes) {
+    fd = member->inflated_fd >= 0
+             ? fcntl(member->inflated_fd, F_DUPFD_CLOEXEC, 0)
+             : -1;
+    source->offset = 0;
+    if (member->inflated_fd < 0) {
+      /* Inflate without the lock; a racing thread may do the same work */
+      archive_member_t copy = *member;
+      int keep;
+      pthread_mutex_unlock(&archive_mutex);
+      fd = inflate_archive_member(archive_fd, &copy, &keep);
+      pthread_mutex_lock(&archive_mutex);
+      member = fd >= 0 && keep
+                   ? find_archive_member(archive_fd, st, member_name)
+                   : NULL;
+      if (member && member->inflated_fd < 0) {
+        member->inflated_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (member->inflated_fd >= 0 && !archive_member_on_disk(member)) {
+          archive_inflated_bytes += member->size;
+          trim_inflated_members(member);
+        }
+      }
+    }
+  } else {
+    fd = fcntl(archive_fd, F_DUPFD_CLOEXEC, 0);
+    source->offset = member->data;
   }
-
-  /* Generate header string */
-  size_t header_buf_len =
-      strlen(var_name) + 50; /* Buffer for "unsigned char []= {" */
-  *header_string = malloc(header_buf_len);
-  if (!*header_string) {
-    free(var_name);
+  pthread_mutex_unlock(&archive_mutex);
+  if (fd < 0) {
+    errno = EIO;
     return -1;
   }
-  snprintf(*header_string, header_buf_len, "unsigned char %s[] = {\n",
-           var_name);
+  source->fd = fd;
+  source->st = *st;
+  return 0;
+}
 
-  /* Generate footer string */
-  size_t footer_buf_len =
-      strlen(var_name) +
-      100; /* Buffer for "};\nunsigned long _SIZE = <number>;" */
-  *footer_string = malloc(footer_buf_len);
-  if (!*footer_string) {
-    free(var_name);
-    free(*header_string);
-    *header_string = NULL;
-    return -1;
+/* For "<archive>/<member>" with <archive> a regular file served as .fex,
+ * return the length of the archive part; 0 for any other path */
+static size_t fex_archive_prefix(const char *pathname) {
+  char prefix[PATH_MAX];
+  for (const char *slash = strchr(pathname + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    unsigned char last = slash[-1];
+    size_t len = slash - pathname;
+    if (!fex_match_any_tail &&
+        !(fex_tail_last_bytes[last / 8] & (1 << (last % 8))))
+      continue;
+    if (len >= sizeof(prefix))
+      return 0;
+    memcpy(prefix, pathname, len);
+    prefix[len] = '\0';
+    struct stat st;
+    if (should_process_as_fex(prefix) && orig_stat(prefix, &st) == 0 &&
+        S_ISREG(st.st_mode))
+      return slash[1] ? len : 0;
   }
-  snprintf(*footer_string, footer_buf_len,
-           "\n};\n\nunsigned long %s_SIZE = %ld;\n", var_name, original_size);
-
-  /* Calculate all size components */
-  *header_len = strlen(*header_string);
-  *data_len = strlen(hex_table[0]) *
-              original_size; /* 6 chars per byte in C array format */
-  *footer_start = *header_len + *data_len;
-  *simulated_size = *header_len + *data_len + strlen(*footer_string);
-
-  fex_log("Generated C code for %s:\n", filename);
-  fex_log("Header: %s\n", *header_string);
-  fex_log("Footer: %s\n", *footer_string);
-  fex_log("Simulated size: %ld bytes (header=%ld, data=%ld, footer=%ld)\n",
-          *simulated_size, *header_len, *data_len, strlen(*footer_string));
-
-  free(var_name);
   return 0;
 }
 
-/* Find a tracked .fex file by file descriptor */
-fex_file_entry_t *find_fex_file_by_fd(int fd) {
-  pthread_mutex_lock(&fex_files_mutex);
-  fex_file_entry_t *current = fex_files_head;
-  while (current) {
-    if (current->fd == fd) {
-      pthread_mutex_unlock(&fex_files_mutex);
-      return current;
-    }
-    current = current->next;
-  }
-  pthread_mutex_unlock(&fex_files_mutex);
-  return NULL;
+/* Open the archive part of an archive member path and resolve the member,
+ * as open_archive_member() does */
+static int open_archive_path(const char *pathname, size_t prefix_len,
+                             int need_bytes, fex_source_t *source) {
+  char archive[PATH_MAX];
+  memcpy(archive, pathname, prefix_len);
+  archive[prefix_len] = '\0';
+  int archive_fd = orig_open(archive, O_RDONLY | O_CLOEXEC);
+  if (archive_fd < 0)
+    return -1;
+  struct stat st;
+  int result = orig_fstat(archive_fd, &st) == 0
+                   ? open_archive_member(archive_fd, &st,
+                                         pathname + prefix_len + 1,
+                                         need_bytes, source)
+                   : -1;
+  int saved_errno = errno;
+  orig_close(archive_fd);
+  errno = saved_errno;
+  return result;
 }
 
-/* Find a tracked .fex file by FILE pointer */
-fex_file_entry_t *find_fex_file_by_fp(FILE *fp) {
-  pthread_mutex_lock(&fex_files_mutex);
-  fex_file_entry_t *current = fex_files_head;
-  while (current) {
-    if (current->fp == fp) {
-      pthread_mutex_unlock(&fex_files_mutex);
-      return current;
+/* ========== POINTER MANIFESTS ========== */
+
+/* A .fex may name the bytes to embed instead of holding them:
+ *
+ *   #!fex pointer
+ *   path ../blobs/firmware.bin
+ *   offset 1048576
+ *   length 20971520
+ *
+ * A relative path is taken from the manifest's directory. offset defaults
+ * to 0 and length to the rest of the target. The C text of that range is
+ * served straight from the target, nothing is copied. */
+
+#define FEX_POINTER_MAGIC "#!fex pointer\n"
+#define FEX_POINTER_MAX 4096 /* Larger files are never pointers */
+
+/* Read the pointer manifest on fd into a target path, offset and length;
+ * returns 0 if fd holds one */
+static int parse_fex_pointer(int fd, const char *manifest_path, off_t size,
+                             char *target, size_t target_size, char *member,
+                             off_t *offset, off_t *length) {
+  char text[FEX_POINTER_MAX + 1];
+  size_t magic_len = sizeof(FEX_POINTER_MAGIC) - 1;
+  if (size < (off_t)magic_len || size > FEX_POINTER_MAX)
+    return -1;
+  ssize_t n = pread(fd, text, size, 0);
+  if (n < (ssize_t)magic_len || memcmp(text, FEX_POINTER_MAGIC, magic_len))
+    return -1;
+  text[n] = '\0';
+
+  *offset = 0;
+  *length = -1;
+  target[0] = '\0';
+  member[0] = '\0';
+  char *save = NULL;
+  for (char *line = strtok_r(text + magic_len, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    char *value;
+    if (strncmp(line, "path ", 5) == 0) {
+      value = line + 5;
+      const char *slash = strrchr(manifest_path, '/');
+      if (value[0] != '/' && slash) {
+        snprintf(target, target_size, "%.*s/%s",
+                 (int)(slash - manifest_path), manifest_path, value);
+      } else {
+        snprintf(target, target_size, "%s", value);
+      }
+    } else if (strncmp(line, "offset ", 7) == 0) {
+      *offset = strtoll(line + 7, NULL, 0);
+    } else if (strncmp(line, "length ", 7) == 0) {
+      *length = strtoll(line + 7, NULL, 0);
+    } else if (strncmp(line, "member ", 7) == 0 && member) {
+      snprintf(member, PATH_MAX, "%s", line + 7);
     }
-    current = current->next;
   }
-  pthread_mutex_unlock(&fex_files_mutex);
-  return NULL;
+  return (target[0] && *offset >= 0) ? 0 : -1;
 }
 
-/* Track a .fex file opened with file descriptor */
-void track_fex_file_fd(int fd, const char *pathname, int flags) {
-  if (!should_process_as_fex(pathname) || fd < 0)
+/* resolve_fex_source(), where need_bytes 0 wants only the length and
+ * metadata of the source, as for open_archive_member() */
+static void resolve_fex_range(int fd, const char *path, const struct stat *st,
+                              int need_bytes, fex_source_t *source) {
+  source->fd = fd;
+  source->offset = 0;
+  source->length = st->st_size;
+  source->st = *st;
+
+  char target[PATH_MAX];
+  char member[PATH_MAX];
+  off_t offset, length;
+  if (!S_ISREG(st->st_mode) ||
+      parse_fex_pointer(fd, path, st->st_size, target, sizeof(target), member,
+                        &offset, &length) != 0)
     return;
 
-  /* Don't track files opened for write operations */
-  if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) {
-    fex_log("Skipping .fex file tracking (opened for write): fd=%d, "
-            "filename=%s, flags=0x%x\n",
-            fd, pathname, flags);
+  int target_fd = orig_open(target, O_RDONLY | O_CLOEXEC);
+  struct stat target_st;
+  if (target_fd < 0 || orig_fstat(target_fd, &target_st) != 0) {
+    fex_log("Pointer %s: cannot open target %s\n", path, target);
+    if (target_fd >= 0)
+      orig_close(target_fd);
     return;
   }
 
-  pthread_mutex_lock(&fex_files_mutex);
-
-  /* Get file size */
-  struct stat st;
-  off_t file_size = 0;
-  if (orig_fstat(fd, &st) == 0) {
-    file_size = st.st_size;
+  /* An archive member becomes the target; offset and length apply to it */
+  if (member[0]) {
+    fex_source_t archive_source;
+    int result = open_archive_member(target_fd, &target_st, member,
+                                     need_bytes, &archive_source);
+    orig_close(target_fd);
+    if (result != 0) {
+      fex_log("Pointer %s: no member %s in %s\n", path, member, target);
+      return;
+    }
+    target_fd = archive_source.fd;
+    offset = MIN(offset, archive_source.length);
+    source->fd = target_fd;
+    source->offset = archive_source.offset + offset;
+    off_t available = archive_source.length - offset;
+    source->length = (length < 0) ? available : MIN(length, available);
+    source->st = archive_source.st;
+    return;
   }
 
-  /* Create new entry */
-  fex_file_entry_t *entry = malloc(sizeof(fex_file_entry_t));
-  if (entry) {
-    entry->fd = fd;
-    entry->fp = NULL;
-    entry->original_filename = strdup(pathname);
-    entry->original_size = file_size;
-    entry->simulated_position = 0;
+  /* Clamp the range to the target */
+  offset = MIN(offset, target_st.st_size);
+  off_t available = target_st.st_size - offset;
+  source->fd = target_fd;
+  source->offset = offset;
+  source->length = (length < 0) ? available : MIN(length, available);
+  source->st = target_st;
+  fex_log("Pointer %s -> %s [%ld, +%ld)\n", path, target, source->offset,
+          source->length);
+}
 
-    /* Generate C code strings and calculate simulated size */
-    if (generate_fex_code_data(pathname, file_size, &entry->header_string,
-                               &entry->footer_string, &entry->simulated_size,
-                               &entry->header_len, &entry->data_len,
-                               &entry->footer_start) != 0) {
-      /* Failed to generate code data */
-      entry->header_string = NULL;
-      entry->footer_string = NULL;
-      entry->simulated_size = 0;
-      entry->header_len = 0;
-      entry->data_len = 0;
-      entry->footer_start = 0;
-    }
-
-    /* Initialize buffer fields */
-    entry->buffer = NULL;
-    entry->block_size = 0;
-    entry->current_block = -1;
-    entry->original_fp = NULL;
+/* Find the bytes a .fex open on fd embeds: its own contents, or the range
+ * of a pointer manifest's target. A pointer that cannot be resolved is
+ * served as plain data. */
+static void resolve_fex_source(int fd, const char *path, const struct stat *st,
+                               fex_source_t *source) {
+  resolve_fex_range(fd, path, st, 1, source);
+}
+
+/* Close a pointer target opened by resolve_fex_source() */
+static void release_fex_source(int fd, const fex_source_t *source) {
+  if (source->fd != fd)
+    orig_close(source->fd);
+}
 
-    /* Initialize buffer with simulated content */
-    initialize_fex_buffer(entry);
+/* Hand a resolved source over to an entry */
+static void set_entry_source(fex_file_entry_t *entry, int fd,
+                             const fex_source_t *source) {
+  entry->source_fd = source->fd;
+  entry->owns_source = source->fd != fd;
+  entry->source_offset = source->offset;
+  entry->st_dev = source->st.st_dev;
+  entry->st_ino = source->st.st_ino;
+  entry->st_mtim = source->st.st_mtim;
+}
 
-    entry->next = fex_files_head;
-    fex_files_head = entry;
+/* Number of bytes a .fex at path embeds, given its stat() */
+static off_t fex_source_length(const char *path, const struct stat *st) {
+  if (!S_ISREG(st->st_mode) || st->st_size > FEX_POINTER_MAX)
+    return st->st_size;
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return st->st_size;
+  fex_source_t source;
+  resolve_fex_range(fd, path, st, 0, &source);
+  release_fex_source(fd, &source);
+  orig_close(fd);
+  return source.length;
+}
 
-    fex_log("Tracking .fex file: fd=%d, filename=%s, size=%ld\n", fd, pathname,
-            file_size);
+/* ========== COMPRESSED SOURCES ========== */
+
+/* The zlib format embeds the zlib stream of the source instead of its
+ * bytes. Each source range is compressed once into a memfd that stat()
+ * and every later open in the process reuse; the stream then renders
+ * like any other source. The compressed length is also kept on disk, one
+ * small file per range in FEX_ZLIB_CACHE (default $XDG_CACHE_HOME/fex or
+ * ~/.cache/fex; empty disables), named by the source's identity, the
+ * range, the level and the zlib version, so stat() in a later process
+ * does not compress again. */
+
+#define FEX_PACKED_CACHE 64 /* Compressed streams kept */
+
+typedef struct packed_source {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t offset;
+  off_t length;
+  int fd;              /* memfd holding the stream */
+  off_t packed_length; /* Length of the stream */
+  struct packed_source *next;
+} packed_source_t;
+
+static packed_source_t *packed_sources = NULL;
+static size_t packed_source_count = 0;
+static pthread_mutex_t packed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pick the directory of compressed lengths; it is only created when the
+ * first length is stored */
+static void init_packed_cache_dir(void) {
+  const char *dir = getenv("FEX_ZLIB_CACHE");
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (dir) {
+    snprintf(packed_cache_dir, sizeof(packed_cache_dir), "%s", dir);
+  } else if (xdg && xdg[0] == '/') {
+    snprintf(packed_cache_dir, sizeof(packed_cache_dir), "%s/fex", xdg);
+  } else if (home && home[0] == '/') {
+    snprintf(packed_cache_dir, sizeof(packed_cache_dir), "%s/.cache/fex",
+             home);
+    packed_cache_in_home = 1;
   }
+}
 
-  pthread_mutex_unlock(&fex_files_mutex);
+/* Create the directory of compressed lengths */
+static int make_packed_cache_dir(void) {
+  if (packed_cache_in_home) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", packed_cache_dir);
+    *strrchr(parent, '/') = '\0';
+    mkdir(parent, 0700);
+  }
+  if (mkdir(packed_cache_dir, 0700) != 0 && errno != EEXIST) {
+    fex_log("Cannot create %s, compressed lengths are not kept\n",
+            packed_cache_dir);
+    return -1;
+  }
+  return 0;
 }
 
-/* Track a .fex file opened with FILE pointer */
-void track_fex_file_fp(FILE *fp, const char *pathname, const char *mode) {
-  if (!should_process_as_fex(pathname) || !fp)
-    return;
+/* Path of the file holding the compressed length of a source range */
+static int packed_length_path(const fex_source_t *source, char *path,
+                              size_t size) {
+  pthread_once(&packed_cache_once, init_packed_cache_dir);
+  const struct stat *st = &source->st;
+  int chars = snprintf(
+      path, size, "%s/%lx-%lx-%lld.%09ld-%lld-%lld-%d-%x.zlen",
+      packed_cache_dir, (unsigned long)st->st_dev, (unsigned long)st->st_ino,
+      (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+      (long long)source->offset, (long long)source->length, zlib_level,
+      ZLIB_VERNUM);
+  return (packed_cache_dir[0] && chars > 0 && (size_t)chars < size) ? 0 : -1;
+}
 
-  /* Don't track files opened for write operations */
-  if (mode && (strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+') ||
-               strstr(mode, "r+"))) {
-    fex_log("Skipping .fex file tracking (opened for write): fp=%p, "
-            "filename=%s, mode=%s\n",
-            fp, pathname, mode);
+/* Compressed length of a source range another process stored; -1 if
+ * there is none */
+static off_t load_packed_length(const fex_source_t *source) {
+  char path[PATH_MAX];
+  if (packed_length_path(source, path, sizeof(path)) != 0)
+    return -1;
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  char text[32];
+  ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+  orig_close(fd);
+  if (n <= 0)
+    return -1;
+  text[n] = '\0';
+  char *end;
+  long long length = strtoll(text, &end, 10);
+  return (end != text && *end == '\n' && length > 0) ? length : -1;
+}
+
+/* Store the compressed length of a source range for later processes. The
+ * file is written aside and renamed into place, so readers never see a
+ * partial one. */
+static void store_packed_length(const fex_source_t *source,
+                                off_t packed_length) {
+  char path[PATH_MAX];
+  char temp[PATH_MAX + 32];
+  if (packed_length_path(source, path, sizeof(path)) != 0)
     return;
+  snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+  int fd = orig_open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == ENOENT && make_packed_cache_dir() == 0)
+    fd = orig_open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+  char text[32];
+  int len = snprintf(text, sizeof(text), "%lld\n", (long long)packed_length);
+  int result = write_all(fd, (const unsigned char *)text, len);
+  orig_close(fd);
+  if (result != 0 || rename(temp, path) != 0)
+    unlink(temp);
+}
+
+/* Compress a source range into a new memfd */
+static int deflate_fex_source(const fex_source_t *source,
+                              off_t *packed_length) {
+  int out_fd = memfd_create("fex-zlib", MFD_CLOEXEC);
+  if (out_fd < 0)
+    return -1;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit(&stream, zlib_level) != Z_OK) {
+    orig_close(out_fd);
+    return -1;
+  }
+  unsigned char *in = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  unsigned char *out = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  off_t read_pos = source->offset;
+  off_t remaining = source->length;
+  off_t written = 0;
+  int status = in && out ? Z_OK : Z_MEM_ERROR;
+  while (status == Z_OK) {
+    if (stream.avail_in == 0 && remaining > 0) {
+      size_t n = MIN((off_t)FEX_RENDER_SCRATCH_SIZE, remaining);
+      if (read_source_at(source->fd, in, n, read_pos) != 0) {
+        status = Z_ERRNO;
+        break;
+      }
+      stream.next_in = in;
+      stream.avail_in = n;
+      read_pos += n;
+      remaining -= n;
+    }
+    stream.next_out = out;
+    stream.avail_out = FEX_RENDER_SCRATCH_SIZE;
+    status = deflate(&stream, remaining ? Z_NO_FLUSH : Z_FINISH);
+    size_t produced = FEX_RENDER_SCRATCH_SIZE - stream.avail_out;
+    if (produced && write_all(out_fd, out, produced) != 0) {
+      status = Z_ERRNO;
+      break;
+    }
+    written += produced;
   }
+  deflateEnd(&stream);
+  fex_buffer_free(in, FEX_RENDER_SCRATCH_SIZE);
+  fex_buffer_free(out, FEX_RENDER_SCRATCH_SIZE);
 
-  pthread_mutex_lock(&fex_files_mutex);
+  if (status != Z_STREAM_END) {
+    orig_close(out_fd);
+    return -1;
+  }
+  *packed_length = written;
+  return out_fd;
+}
 
-  /* Get file size via fileno */
-  int fd = orig_fileno(fp);
-  struct stat st;
-  off_t file_size = 0;
-  if (fd >= 0 && orig_fstat(fd, &st) == 0) {
-    file_size = st.st_size;
+/* Return a descriptor of the compressed stream of a source range, which
+ * the caller closes, compressing it on first use; -1 on failure */
+static int get_packed_source(const fex_source_t *source, off_t *packed_length) {
+  const struct stat *st = &source->st;
+  pthread_mutex_lock(&packed_mutex);
+  packed_source_t **link = &packed_sources;
+  for (packed_source_t *p = packed_sources; p; link = &p->next, p = p->next) {
+    if (p->ino == st->st_ino && p->dev == st->st_dev &&
+        p->mtime.tv_sec == st->st_mtim.tv_sec &&
+        p->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        p->offset == source->offset && p->length == source->length) {
+      /* Move to the front */
+      *link = p->next;
+      p->next = packed_sources;
+      packed_sources = p;
+      *packed_length = p->packed_length;
+      int fd = fcntl(p->fd, F_DUPFD_CLOEXEC, 0);
+      pthread_mutex_unlock(&packed_mutex);
+      return fd;
+    }
+  }
+  pthread_mutex_unlock(&packed_mutex);
+
+  /* Compress without the lock; a racing thread may do the same work */
+  off_t length;
+  int packed_fd = deflate_fex_source(source, &length);
+  packed_source_t *p = packed_fd >= 0 ? malloc(sizeof(*p)) : NULL;
+  if (!p) {
+    if (packed_fd >= 0)
+      orig_close(packed_fd);
+    return -1;
   }
+  *p = (packed_source_t){st->st_dev,   st->st_ino, st->st_mtim,
+                         source->offset, source->length, packed_fd,
+                         length,        NULL};
+  fex_log("Compressed %ld bytes to %ld\n", source->length, length);
+  store_packed_length(source, length);
+
+  pthread_mutex_lock(&packed_mutex);
+  p->next = packed_sources;
+  packed_sources = p;
+  if (++packed_source_count > FEX_PACKED_CACHE) {
+    packed_source_t **last = &packed_sources;
+    while ((*last)->next)
+      last = &(*last)->next;
+    packed_source_t *victim = *last;
+    *last = NULL;
+    orig_close(victim->fd);
+    free(victim);
+    packed_source_count--;
+  }
+  *packed_length = length;
+  int fd = fcntl(packed_fd, F_DUPFD_CLOEXEC, 0);
+  pthread_mutex_unlock(&packed_mutex);
+  return fd;
+}
 
-  /* Create new entry */
-  fex_file_entry_t *entry = malloc(sizeof(fex_file_entry_t));
-  if (entry) {
-    entry->fd = fd;
-    entry->fp = fp;
-    entry->original_filename = strdup(pathname);
-    entry->original_size = file_size;
-    entry->simulated_position = 0;
+/* Replace a source resolved on fd with its compressed stream. The
+ * original is released; the new source is never fd. */
+static int pack_fex_source(int fd, fex_source_t *source) {
+  off_t packed_length;
+  int packed_fd = get_packed_source(source, &packed_length);
+  if (packed_fd < 0)
+    return -1;
+  release_fex_source(fd, source);
+  source->fd = packed_fd;
+  source->offset = 0;
+  source->length = packed_length;
+  return 0;
+}
 
-    /* Generate C code strings and calculate simulated size */
-    if (generate_fex_code_data(pathname, file_size, &entry->header_string,
-                               &entry->footer_string, &entry->simulated_size,
-                               &entry->header_len, &entry->data_len,
-                               &entry->footer_start) != 0) {
-      /* Failed to generate code data */
-      entry->header_string = NULL;
-      entry->footer_string = NULL;
-      entry->simulated_size = 0;
-      entry->header_len = 0;
-      entry->data_len = 0;
-      entry->footer_start = 0;
-    }
-
-    /* Initialize buffer fields */
-    entry->buffer = NULL;
-    entry->block_size = 0;
-    entry->current_block = 0;
-    entry->original_fp = NULL;
+/* Compressed length of a source range: from this process's streams, from
+ * a length another process stored, or by compressing it; -1 on failure */
+static off_t get_packed_length(const fex_source_t *source) {
+  const struct stat *st = &source->st;
+  off_t length = -1;
+  pthread_mutex_lock(&packed_mutex);
+  for (packed_source_t *p = packed_sources; p; p = p->next) {
+    if (p->ino == st->st_ino && p->dev == st->st_dev &&
+        p->mtime.tv_sec == st->st_mtim.tv_sec &&
+        p->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        p->offset == source->offset && p->length == source->length) {
+      length = p->packed_length;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&packed_mutex);
+  if (length >= 0 || (length = load_packed_length(source)) >= 0)
+    return length;
 
-    /* Initialize buffer with simulated content */
-    initialize_fex_buffer(entry);
+  int packed_fd = get_packed_source(source, &length);
+  if (packed_fd < 0)
+    return -1;
+  orig_close(packed_fd);
+  return length;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Simulated size of a resolved source rendered in a format */
+static off_t fex_source_size(const char *name, const fex_source_t *source,
+                             int format) {
+  off_t length = source->length;
+  if (format == FEX_FORMAT_ZLIB && (length = get_packed_length(source)) < 0)
+    return -1;
+  return fex_simulated_size(name, length, source->length, format);
+}
 
-    entry->next = fex_files_head;
-    fex_files_head = entry;
+/* Simulated size of the .fex at path, given its stat() and the number of
+ * bytes it embeds */
+static off_t fex_path_size(const char *path, const struct stat *st,
+                           off_t original_size, int format) {
+  if (format != FEX_FORMAT_ZLIB)
+    return fex_simulated_size(path, original_size, original_size, format);
 
-    fex_log("Tracking .fex file: fp=%p, fd=%d, filename=%s, size=%ld\n", fp, fd,
-            pathname, file_size);
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  fex_source_t source;
+  resolve_fex_source(fd, path, st, &source);
+  off_t size = fex_source_size(path, &source, format);
+  release_fex_source(fd, &source);
+  orig_close(fd);
+  return size;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* ========== VIRTUAL PATHS ========== */
+
+/* Paths that do not exist on disk but are still served: a .fex path with a
+ * derived suffix, rendered in another format ("logo.fex.raw" is the bytes
+ * logo.fex embeds), and archive members. These are only resolved after the
+ * real open or stat failed with ENOENT or ENOTDIR, so ordinary paths never
+ * pay for them. The result is an anonymous rendered copy. */
+
+/* Strip a derived suffix from name in place; returns its format, or -1 */
+static int strip_derived_suffix(char *name) {
+  size_t len = strlen(name);
+  for (size_t i = 0;
+       i < sizeof(fex_derived_suffixes) / sizeof(fex_derived_suffixes[0]);
+       i++) {
+    size_t suffix_len = strlen(fex_derived_suffixes[i].suffix);
+    if (len > suffix_len &&
+        memcmp(name + len - suffix_len, fex_derived_suffixes[i].suffix,
+               suffix_len) == 0) {
+      name[len - suffix_len] = '\0';
+      return fex_derived_suffixes[i].format;
+    }
   }
+  return -1;
+}
 
-  pthread_mutex_unlock(&fex_files_mutex);
+#ifndef FEX_NO_INTERPOSE
+/* Cheap pre-filter on a raw, unresolved path the real call failed on with
+ * 'missing': 0 means it can never be virtual, so dirfd need not be
+ * resolved. Either the path ends in a derived suffix after a name a rule
+ * may match, or ENOTDIR came from a component a rule may match. */
+static int fex_path_may_be_virtual(const char *pathname, int missing) {
+  char name[PATH_MAX];
+  if ((missing != ENOENT && missing != ENOTDIR) || !pathname ||
+      snprintf(name, sizeof(name), "%s", pathname) >= (int)sizeof(name))
+    return 0;
+  if (strip_derived_suffix(name) >= 0 && fex_path_may_match(name))
+    return 1;
+  if (missing != ENOTDIR)
+    return 0;
+  for (const char *slash = strchr(pathname + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    unsigned char last = slash[-1];
+    if (fex_match_any_tail ||
+        (fex_tail_last_bytes[last / 8] & (1 << (last % 8))))
+      return 1;
+  }
+  return 0;
 }
+#endif /* FEX_NO_INTERPOSE */
+
+/* Resolve a missing path into the source it renders, the name it is
+ * rendered under and the format. 'missing' is the errno of the real call.
+ * With size_only the source need only be sized, not read. On success the
+ * caller owns source->fd. */
+static int resolve_virtual_path(const char *pathname, int missing,
+                                int size_only, char *name,
+                                fex_source_t *source, int *format) {
+  if (snprintf(name, PATH_MAX, "%s", pathname) >= PATH_MAX)
+    return -1;
+  *format = strip_derived_suffix(name);
+  int derived = *format >= 0;
+  if (!derived) {
+    /* Only a path through a regular file can name an archive member */
+    if (missing != ENOTDIR)
+      return -1;
+    *format = default_format;
+  }
+  /* A compressed size is only known from the bytes */
+  int need_bytes = !size_only || *format == FEX_FORMAT_ZLIB;
+  if (derived && should_process_as_fex(name)) {
+    int fd = orig_open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && orig_fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      /* A declaration needs no bytes, so a pointer is not even parsed */
+      if (*format == FEX_FORMAT_HEADER) {
+        *source = (fex_source_t){fd, 0, st.st_size, st};
+        return 0;
+      }
+      resolve_fex_range(fd, name, &st, need_bytes, source);
+      if (source->fd != fd)
+        orig_close(fd);
+      return 0;
+    }
+    if (fd >= 0)
+      orig_close(fd);
+  }
 
-/* Remove tracking for a file descriptor */
-void untrack_fex_file_fd(int fd) {
-  pthread_mutex_lock(&fex_files_mutex);
+  size_t prefix_len = fex_archive_prefix(name);
+  return prefix_len ? open_archive_path(name, prefix_len, need_bytes, source)
+                    : -1;
+}
 
-  fex_file_entry_t **current = &fex_files_head;
-  while (*current) {
-    fex_file_entry_t *entry = *current;
-    if (entry->fd == fd) {
-      *current = entry->next;
-      fex_log("Untracking .fex file: fd=%d, filename=%s\n", entry->fd,
-              entry->original_filename);
-      free_fex_buffer(entry);
-      free(entry->original_filename);
-      free(entry->header_string);
-      free(entry->footer_string);
-      free(entry);
-      break;
-    } else {
-      current = &(entry->next);
+#ifndef FEX_NO_INTERPOSE
+/* open() of a missing path; fails with the real call's errno unless the
+ * path is virtual */
+static int open_fex_virtual(const char *pathname, int flags) {
+  int missing = errno;
+  char name[PATH_MAX];
+  fex_source_t source;
+  int format;
+  if (resolve_virtual_path(pathname, missing, 0, name, &source,
+                           &format) != 0) {
+    errno = missing;
+    return -1;
+  }
+  if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) {
+    orig_close(source.fd);
+    errno = EACCES;
+    return -1;
+  }
+
+  /* The raw bytes of a whole file are the file itself */
+  if (format == FEX_FORMAT_RAW && source.offset == 0 &&
+      source.length == source.st.st_size) {
+    fex_log("Opened %s as the source itself (fd %d)\n", pathname, source.fd);
+    return source.fd;
+  }
+
+  int fd = render_source_to_anonymous_file(name, &source, format);
+  orig_close(source.fd);
+  if (fd < 0) {
+    errno = EIO;
+  }
+  fex_log("Opened virtual path %s as fd %d\n", pathname, fd);
+  return fd;
+}
+
+/* stat() of a missing path: the source file's metadata with the rendered
+ * size */
+static int stat_fex_virtual(const char *pathname, struct stat *statbuf) {
+  int missing = errno;
+  char name[PATH_MAX];
+  fex_source_t source;
+  int format;
+  if (resolve_virtual_path(pathname, missing, 1, name, &source,
+                           &format) != 0) {
+    errno = missing;
+    return -1;
+  }
+  off_t simulated_size = fex_source_size(name, &source, format);
+  orig_close(source.fd);
+  if (simulated_size < 0) {
+    errno = missing;
+    return -1;
+  }
+  *statbuf = source.st;
+  statbuf->st_mode = S_IFREG | (source.st.st_mode & 0444);
+  statbuf->st_nlink = 1;
+  statbuf->st_size = simulated_size;
+  statbuf->st_blksize = block_size_base;
+  statbuf->st_blocks =
+      (simulated_size + statbuf->st_blksize - 1) / statbuf->st_blksize;
+  return 0;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* ========== RENDERING ENGINE ========== */
+
+/* Render source bytes as C array text. The byte at source index 'index' is
+ * written at dst[0]; every 16th byte ends its line with a newline. dst must
+ * hold FEX_HEX_WIDTH * count bytes. */
+static void render_hex_run(unsigned char *dst, const unsigned char *src,
+                           off_t index, size_t count) {
+  size_t i = 0;
+
+  /* Align to the start of a 16-byte line, then emit whole lines */
+  while (i < count && (index + i) % 16 != 0) {
+    const char *hex = ((index + i) % 16 == 15) ? hex_tableCR[src[i]]
+                                               : hex_table[src[i]];
+    memcpy(dst + i * FEX_HEX_WIDTH, hex, FEX_HEX_WIDTH);
+    i++;
+  }
+  for (; i + 16 <= count; i += 16) {
+    unsigned char *out = dst + i * FEX_HEX_WIDTH;
+    for (int j = 0; j < 15; j++) {
+      memcpy(out + j * FEX_HEX_WIDTH, hex_table[src[i + j]], FEX_HEX_WIDTH);
     }
+    memcpy(out + 15 * FEX_HEX_WIDTH, hex_tableCR[src[i + 15]], FEX_HEX_WIDTH);
+  }
+  for (; i < count; i++) {
+    const char *hex = ((index + i) % 16 == 15) ? hex_tableCR[src[i]]
+                                               : hex_table[src[i]];
+    memcpy(dst + i * FEX_HEX_WIDTH, hex, FEX_HEX_WIDTH);
+  }
+}
+
+/* Render 'len' bytes of the data section starting at 'data_offset'. src[0]
+ * must be the source byte at data_offset / FEX_HEX_WIDTH and src must cover
+ * every source byte touched by the span. */
+static void render_data_span(const unsigned char *src, off_t data_offset,
+                             unsigned char *dst, size_t len) {
+  if (simple_override) {
+    memset(dst, '!', len);
+    return;
   }
 
-  pthread_mutex_unlock(&fex_files_mutex);
+  off_t index = data_offset / FEX_HEX_WIDTH;
+  size_t skip = data_offset % FEX_HEX_WIDTH;
+  unsigned char tmp[FEX_HEX_WIDTH];
+
+  /* Leading partial element */
+  if (skip) {
+    size_t n = MIN(len, FEX_HEX_WIDTH - skip);
+    render_hex_run(tmp, src, index, 1);
+    memcpy(dst, tmp + skip, n);
+    dst += n;
+    len -= n;
+    src++;
+    index++;
+  }
+
+  /* Whole elements */
+  size_t whole = len / FEX_HEX_WIDTH;
+  render_hex_run(dst, src, index, whole);
+  dst += whole * FEX_HEX_WIDTH;
+  len -= whole * FEX_HEX_WIDTH;
+  src += whole;
+  index += whole;
+
+  /* Trailing partial element */
+  if (len) {
+    render_hex_run(tmp, src, index, 1);
+    memcpy(dst, tmp, len);
+  }
 }
 
-/* Remove tracking for a FILE pointer */
-void untrack_fex_file_fp(FILE *fp) {
-  pthread_mutex_lock(&fex_files_mutex);
+/* Rendered text of whole lines of zero bytes; a run of zeros at any data
+ * offset is a slice of it, repeated */
+#define FEX_ZERO_LINE (16 * FEX_HEX_WIDTH)
+#define FEX_ZERO_PATTERN_LINES 64
+static unsigned char zero_pattern[FEX_ZERO_PATTERN_LINES * FEX_ZERO_LINE];
+static pthread_once_t zero_pattern_once = PTHREAD_ONCE_INIT;
+static _Atomic(uint64_t) fex_hole_bytes = 0;
+
+static void init_zero_pattern(void) {
+  for (size_t i = 0; i < FEX_ZERO_PATTERN_LINES * 16; i++) {
+    memcpy(zero_pattern + i * FEX_HEX_WIDTH,
+           i % 16 == 15 ? hex_tableCR[0] : hex_table[0], FEX_HEX_WIDTH);
+  }
+}
+
+/* Render 'len' bytes of an all-zero data section at 'data_offset' */
+static void render_zero_span(off_t data_offset, unsigned char *dst,
+                             size_t len) {
+  if (simple_override) {
+    memset(dst, '!', len);
+    return;
+  }
+  pthread_once(&zero_pattern_once, init_zero_pattern);
+  size_t phase = data_offset % FEX_ZERO_LINE;
+  while (len) {
+    size_t n = MIN(len, sizeof(zero_pattern) - phase);
+    memcpy(dst, zero_pattern + phase, n);
+    dst += n;
+    len -= n;
+    phase = 0;
+  }
+}
+
+/* Guards the hole probe state (probe_fd and extent) of every entry */
+static pthread_mutex_t extent_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Descriptor SEEK_DATA/SEEK_HOLE may move; called with extent_mutex held.
+ * src_fd is often the caller's own descriptor, whose file offset dup()ed
+ * descriptors and children share, so it is reopened privately once per
+ * entry. -1 if that fails: the source is then all data. */
+static int get_probe_fd(fex_file_entry_t *entry, int src_fd) {
+  if (entry->owns_source)
+    return src_fd;
+  if (entry->probe_fd == -1) {
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", src_fd);
+    entry->probe_fd = orig_open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (entry->probe_fd < 0)
+      entry->probe_fd = -2;
+  }
+  return entry->probe_fd;
+}
+
+/* Find the hole or data extent of the source containing 'offset', reusing
+ * the one in 'extent' or the last one the entry found when they still
+ * apply. Offsets are relative to the entry's source_offset in the file
+ * (non-zero for pointer manifests). Without SEEK_HOLE support the whole
+ * file is one data extent. */
+static void find_source_extent(fex_file_entry_t *entry, int src_fd,
+                               off_t offset, source_extent_t *extent) {
+  if (offset >= extent->start && offset < extent->end) {
+    return;
+  }
+  pthread_mutex_lock(&extent_mutex);
+  if (offset >= entry->extent.start && offset < entry->extent.end) {
+    *extent = entry->extent;
+    pthread_mutex_unlock(&extent_mutex);
+    return;
+  }
+  int probe_fd = get_probe_fd(entry, src_fd);
+  pthread_mutex_unlock(&extent_mutex);
+
+  off_t base = entry->source_offset;
+  off_t size = entry->original_size;
+  if (probe_fd < 0) {
+    *extent = (source_extent_t){offset, size, 0};
+    return;
+  }
+  off_t data = orig_lseek(probe_fd, base + offset, SEEK_DATA);
+  if (data < 0) {
+    /* ENXIO: nothing but a hole up to EOF */
+    *extent = (source_extent_t){offset, size, errno == ENXIO};
+  } else if (data - base > offset) {
+    *extent = (source_extent_t){offset, MIN(data - base, size), 1};
+  } else {
+    off_t hole = orig_lseek(probe_fd, base + offset, SEEK_HOLE) - base;
+    *extent = (source_extent_t){offset, hole > offset ? MIN(hole, size) : size,
+                                0};
+  }
+  pthread_mutex_lock(&extent_mutex);
+  entry->extent = *extent;
+  pthread_mutex_unlock(&extent_mutex);
+}
+
+/* Read exactly 'count' bytes at 'offset' from the source; a short source is
+ * zero-padded so the rendered layout stays consistent with the stat size */
+static int read_source_at(int src_fd, unsigned char *buf, size_t count,
+                          off_t offset) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t n = pread(src_fd, buf + done, count - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0) {
+      memset(buf + done, 0, count - done);
+      break;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/* Render the simulated output range [offset, offset + len) of an entry into
+ * dst, reading source bytes with pread() through 'scratch'. Safe to call
+ * concurrently for disjoint ranges: besides the immutable layout only the
+ * hole probe state is used, under extent_mutex. */
+static int render_output_range(fex_file_entry_t *entry, int src_fd,
+                               off_t offset, unsigned char *dst, size_t len,
+                               unsigned char *scratch, size_t scratch_size) {
+  off_t end = offset + len;
+  source_extent_t extent = {0, 0, 0};
+
+  /* Header section */
+  if (offset < entry->header_len) {
+    size_t n = MIN(len, (size_t)(entry->header_len - offset));
+    memcpy(dst, entry->header_string + offset, n);
+    dst += n;
+    offset += n;
+  }
+
+  /* Data section, one scratch buffer of source at a time */
+  while (offset < end && offset < entry->footer_start) {
+    off_t data_offset = offset - entry->header_len;
+    off_t span_end = MIN(end, entry->footer_start);
+
+    /* Raw data sections are the source bytes themselves */
+    if (entry->format == FEX_FORMAT_RAW ||
+        entry->format == FEX_FORMAT_ELF_OBJECT) {
+      size_t span = span_end - offset;
+      if (read_source_at(src_fd, dst, span,
+                         entry->source_offset + data_offset) != 0) {
+        return -1;
+      }
+      dst += span;
+      offset += span;
+      continue;
+    }
+
+    off_t first = data_offset / FEX_HEX_WIDTH;
+    off_t last = (span_end - entry->header_len - 1) / FEX_HEX_WIDTH;
+    size_t src_count = MIN((size_t)(last - first + 1), scratch_size);
+
+    /* Holes render from the zero pattern, data stops at the next hole */
+    if (!simple_override) {
+      find_source_extent(entry, src_fd, first, &extent);
+      if (extent.hole) {
+        size_t span = MIN((size_t)(span_end - offset),
+                          (size_t)(extent.end * FEX_HEX_WIDTH - data_offset));
+        render_zero_span(data_offset, dst, span);
+        atomic_fetch_add(&fex_hole_bytes, span / FEX_HEX_WIDTH);
+        dst += span;
+        offset += span;
+        continue;
+      }
+      src_count = MIN(src_count, (size_t)(extent.end - first));
+    }
+    size_t span = MIN((size_t)(span_end - offset),
+                      (first + src_count) * FEX_HEX_WIDTH - data_offset);
+
+    if (!simple_override &&
+        read_source_at(src_fd, scratch, src_count,
+                       entry->source_offset + first) != 0) {
+      return -1;
+    }
+    render_data_span(scratch, data_offset, dst, span);
+    dst += span;
+    offset += span;
+  }
+
+  /* Footer section */
+  if (offset < end) {
+    memcpy(dst, entry->footer_string + (offset - entry->footer_start),
+           end - offset);
+  }
+  return 0;
+}
+
+/* ========== PARALLEL RENDER POOL ========== */
+
+/* A large render request split into fixed-size output chunks. Idle workers
+ * claim the next unrendered chunk with an atomic increment, so fast threads
+ * naturally take over work from slow ones. */
+typedef struct fex_render_job {
+  fex_file_entry_t *entry;
+  int src_fd;
+  off_t start;
+  unsigned char *dst;
+  size_t len;
+  size_t chunk_size;
+  size_t chunk_count;
+  _Atomic(size_t) next_chunk;
+  _Atomic(int) failed;
+  int workers; /* Pool threads inside this job, guarded by render_pool_mutex */
+  struct fex_render_job *next;
+} fex_render_job_t;
+
+static pthread_mutex_t render_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_pool_done_cond = PTHREAD_COND_INITIALIZER;
+static fex_render_job_t *render_pool_jobs = NULL;
+static int render_pool_started = 0;
+
+static void run_render_chunks(fex_render_job_t *job, unsigned char *scratch) {
+  size_t chunk;
+  while ((chunk = atomic_fetch_add(&job->next_chunk, 1)) < job->chunk_count) {
+    size_t chunk_offset = chunk * job->chunk_size;
+    size_t chunk_len = MIN(job->chunk_size, job->len - chunk_offset);
+    if (render_output_range(job->entry, job->src_fd, job->start + chunk_offset,
+                            job->dst + chunk_offset, chunk_len, scratch,
+                            FEX_RENDER_SCRATCH_SIZE) != 0) {
+      atomic_store(&job->failed, 1);
+    }
+  }
+}
+
+static void *render_pool_worker(void *arg) {
+  (void)arg;
+  unsigned char *scratch = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  if (!scratch)
+    return NULL;
+
+  pthread_mutex_lock(&render_pool_mutex);
+  for (;;) {
+    fex_render_job_t *job = render_pool_jobs;
+    while (job && atomic_load(&job->next_chunk) >= job->chunk_count) {
+      job = job->next;
+    }
+    if (!job) {
+      pthread_cond_wait(&render_pool_work_cond, &render_pool_mutex);
+      continue;
+    }
+
+    job->workers++;
+    pthread_mutex_unlock(&render_pool_mutex);
+    run_render_chunks(job, scratch);
+    pthread_mutex_lock(&render_pool_mutex);
+    job->workers--;
+    pthread_cond_broadcast(&render_pool_done_cond);
+  }
+  return NULL;
+}
+
+/* Forked children inherit the pool state but not its threads */
+static void render_pool_atfork_child(void) {
+  pthread_mutex_init(&render_pool_mutex, NULL);
+  pthread_cond_init(&render_pool_work_cond, NULL);
+  pthread_cond_init(&render_pool_done_cond, NULL);
+  render_pool_jobs = NULL;
+  render_pool_started = 0;
+}
+
+/* Start worker threads on first use; called with render_pool_mutex held */
+static void start_render_pool(void) {
+  if (render_pool_started)
+    return;
+  render_pool_started = 1;
+
+  static int atfork_registered = 0;
+  if (!atfork_registered) {
+    pthread_atfork(NULL, NULL, render_pool_atfork_child);
+    atfork_registered = 1;
+  }
+
+  /* The submitting thread renders too, so start one worker fewer */
+  for (int i = 1; i < render_threads; i++) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, render_pool_worker, NULL) != 0) {
+      fex_log("Failed to start render worker %d\n", i);
+      pthread_attr_destroy(&attr);
+      break;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  fex_log("Render pool started with %d threads\n", render_threads);
+}
+
+/* Render [offset, offset + len) of an entry into dst. Requests at or above
+ * the parallel threshold are split into chunks rendered by the pool. */
+int fex_render_range(fex_file_entry_t *entry, int src_fd, off_t offset,
+                     unsigned char *dst, size_t len) {
+  if (!entry || !entry->header_string || !entry->footer_string)
+    return -1;
+  if (len == 0)
+    return 0;
+  if (entry->bundle)
+    return render_bundle_range(entry->bundle, offset, dst, len);
+
+  unsigned char *scratch = fex_buffer_alloc(FEX_RENDER_SCRATCH_SIZE);
+  if (!scratch)
+    return -1;
+
+  if (render_threads <= 1 || parallel_threshold == 0 ||
+      len < parallel_threshold) {
+    int result = render_output_range(entry, src_fd, offset, dst, len, scratch,
+                                     FEX_RENDER_SCRATCH_SIZE);
+    fex_buffer_free(scratch, FEX_RENDER_SCRATCH_SIZE);
+    return result;
+  }
+
+  fex_render_job_t job = {
+      .entry = entry,
+      .src_fd = src_fd,
+      .start = offset,
+      .dst = dst,
+      .len = len,
+      .chunk_size = parallel_chunk_size,
+      .chunk_count = (len + parallel_chunk_size - 1) / parallel_chunk_size,
+      .workers = 0,
+  };
+  atomic_init(&job.next_chunk, 0);
+  atomic_init(&job.failed, 0);
+
+  fex_log("Parallel render: offset=%ld, len=%zu, chunks=%zu\n", offset, len,
+          job.chunk_count);
+
+  pthread_mutex_lock(&render_pool_mutex);
+  start_render_pool();
+  job.next = render_pool_jobs;
+  render_pool_jobs = &job;
+  pthread_cond_broadcast(&render_pool_work_cond);
+  pthread_mutex_unlock(&render_pool_mutex);
+
+  run_render_chunks(&job, scratch);
+  fex_buffer_free(scratch, FEX_RENDER_SCRATCH_SIZE);
+
+  /* Unlink the job so no new worker joins, then wait for the ones inside */
+  pthread_mutex_lock(&render_pool_mutex);
+  fex_render_job_t **link = &render_pool_jobs;
+  while (*link != &job) {
+    link = &(*link)->next;
+  }
+  *link = job.next;
+  while (job.workers > 0) {
+    pthread_cond_wait(&render_pool_done_cond, &render_pool_mutex);
+  }
+  pthread_mutex_unlock(&render_pool_mutex);
+
+  return atomic_load(&job.failed) ? -1 : 0;
+}
+
+/* Render the whole simulated file into an anonymous descriptor, positioned
+ * at offset 0; returns the descriptor or -1 */
+static int render_to_anonymous_file(fex_file_entry_t *entry, int src_fd) {
+  /* Prefer a memfd (sealable, so fexd can share it); fall back to an
+   * unlinked file in /tmp */
+  int temp_fd = memfd_create("fex", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (temp_fd == -1) {
+    char temp_template[] = "/tmp/fex_XXXXXX";
+    temp_fd = mkstemp(temp_template);
+    if (temp_fd != -1) {
+      unlink(temp_template);
+    }
+  }
+  if (temp_fd == -1) {
+    return -1;
+  }
+
+  if (ftruncate(temp_fd, entry->simulated_size) != 0) {
+    orig_close(temp_fd);
+    return -1;
+  }
+  if (entry->simulated_size == 0) {
+    return temp_fd;
+  }
+
+  unsigned char *map = orig_mmap(NULL, entry->simulated_size,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, temp_fd, 0);
+  if (map == MAP_FAILED) {
+    orig_close(temp_fd);
+    return -1;
+  }
+
+  int result = fex_render_range(entry, src_fd, 0, map, entry->simulated_size);
+  munmap(map, entry->simulated_size);
+  if (result != 0) {
+    orig_close(temp_fd);
+    return -1;
+  }
+  return temp_fd;
+}
+
+/* Render the C code for a resolved source into an anonymous file; 'name'
+ * picks the variable name */
+static int render_source_to_anonymous_file(const char *name,
+                                           const fex_source_t *source,
+                                           int format) {
+  /* The zlib format renders the compressed stream */
+  fex_source_t packed = *source;
+  if (format == FEX_FORMAT_ZLIB) {
+    packed.fd = get_packed_source(source, &packed.length);
+    packed.offset = 0;
+    if (packed.fd < 0)
+      return -1;
+  }
+
+  /* Lay out the rendered file exactly as the read() path and stat() see it */
+  char header[FEX_HEADER_MAX];
+  char footer[FEX_FOOTER_MAX];
+  fex_file_entry_t layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.original_size = packed.length;
+  layout.source_offset = packed.offset;
+  layout.probe_fd = -1;
+  layout.format = format;
+  layout.header_string = header;
+  layout.footer_string = footer;
+  int temp_fd = -1;
+  if (format_fex_code_data(name, packed.length, source->length, format,
+                           header, footer, &layout.simulated_size,
+                           &layout.header_len, &layout.data_len,
+                           &layout.footer_start) == 0) {
+    temp_fd = render_to_anonymous_file(&layout, packed.fd);
+  }
+  if (layout.probe_fd >= 0)
+    orig_close(layout.probe_fd);
+  if (packed.fd != source->fd)
+    orig_close(packed.fd);
+  if (temp_fd >= 0) {
+    fex_log("Materialized %s: %ld bytes into fd %d\n", name,
+            layout.simulated_size, temp_fd);
+  }
+  return temp_fd;
+}
+
+/* Create an anonymous file containing the generated C code for the source
+ * open on src_fd; 'name' picks the variable name */
+int fex_render_source_fd(int src_fd, const char *name, int format) {
+  struct stat st;
+  if (!name || orig_fstat(src_fd, &st) != 0) {
+    return -1;
+  }
+  fex_source_t source;
+  resolve_fex_source(src_fd, name, &st, &source);
+  int temp_fd = render_source_to_anonymous_file(name, &source, format);
+  release_fex_source(src_fd, &source);
+  return temp_fd;
+}
+
+/* As fex_render_source_fd() for 'length' bytes at 'offset' of src_fd, a
+ * source the caller already resolved: pointer manifests are not followed */
+int fex_render_source_range(int src_fd, off_t offset, off_t length,
+                            const char *name, int format) {
+  fex_source_t source = {src_fd, offset, length, {0}};
+  if (!name || offset < 0 || length < 0 ||
+      orig_fstat(src_fd, &source.st) != 0 ||
+      offset > source.st.st_size || length > source.st.st_size - offset) {
+    return -1;
+  }
+  return render_source_to_anonymous_file(name, &source, format);
+}
+
+/* Create an anonymous file containing the generated C code for a FEX file */
+int create_fex_temp_file(const char *fex_path) {
+  if (!fex_path) {
+    return -1;
+  }
+
+  int src_fd = orig_open(fex_path, O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) {
+    fex_log("Failed to open FEX file: %s\n", fex_path);
+    return -1;
+  }
+
+  int temp_fd = fex_render_source_fd(src_fd, fex_path, default_format);
+  orig_close(src_fd);
+  return temp_fd;
+}
+
+/* ========== RENDER DAEMON CLIENT ========== */
+
+/* With FEX_DAEMON set, read-only opens of a .fex ask fexd for a sealed
+ * memfd holding the rendered file, so concurrent compilers share one copy
+ * in the page cache. Any failure falls back to rendering in-process. */
+
+/* Fill in the abstract socket address fexd listens on */
+socklen_t fex_daemon_address(struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  const char *name = getenv("FEX_DAEMON_SOCKET");
+  int len = name ? snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                            "%s", name)
+                 : snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                            "fexd.%u", (unsigned)getuid());
+  len = MIN(len, (int)sizeof(addr->sun_path) - 2);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* fexd lives next to this library unless FEX_DAEMON_PATH says otherwise */
+static int get_daemon_path(char *path, size_t size) {
+  const char *override = getenv("FEX_DAEMON_PATH");
+  if (override) {
+    return snprintf(path, size, "%s", override) < (int)size ? 0 : -1;
+  }
+  Dl_info info;
+  if (!dladdr((void *)fex_daemon_address, &info) || !info.dli_fname) {
+    return -1;
+  }
+  const char *slash = strrchr(info.dli_fname, '/');
+  int dir_len = slash ? (int)(slash - info.dli_fname) : 1;
+  const char *dir = slash ? info.dli_fname : ".";
+  return snprintf(path, size, "%.*s/fexd", dir_len, dir) < (int)size ? 0 : -1;
+}
+
+/* Environment variables fexd must not inherit: it is no client, and with
+ * them it would preload this library, record a manifest of its own and try
+ * to reach itself */
+static const char *const daemon_unset_env[] = {"LD_PRELOAD", "FEX_DAEMON",
+                                               "FEX_MANIFEST"};
+
+static int is_daemon_unset_env(const char *entry) {
+  for (size_t i = 0;
+       i < sizeof(daemon_unset_env) / sizeof(daemon_unset_env[0]); i++) {
+    size_t len = strlen(daemon_unset_env[i]);
+    if (strncmp(entry, daemon_unset_env[i], len) == 0 && entry[len] == '=')
+      return 1;
+  }
+  return 0;
+}
+
+/* Start fexd detached from this process: double fork so it is never our
+ * child, and only async-signal-safe calls between fork() and exec. The
+ * daemon keeps none of our descriptors: an inherited jobserver pipe or the
+ * compiler's stderr would keep make or ninja waiting until it exits. */
+static void spawn_fex_daemon(void) {
+  char path[PATH_MAX];
+  if (get_daemon_path(path, sizeof(path)) != 0 || access(path, X_OK) != 0) {
+    fex_log("fexd not found, rendering in-process\n");
+    return;
+  }
+  char *const argv[] = {path, NULL};
+
+  /* The environment is filtered before fork(): unsetenv() is not
+   * async-signal-safe */
+  extern char **environ;
+  size_t env_count = 0;
+  while (environ[env_count])
+    env_count++;
+  char **envp = malloc((env_count + 1) * sizeof(char *));
+  if (!envp) {
+    return;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < env_count; i++) {
+    if (!is_daemon_unset_env(environ[i]))
+      envp[kept++] = environ[i];
+  }
+  envp[kept] = NULL;
+  struct rlimit fd_limit;
+  unsigned int max_fd = getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 &&
+                                fd_limit.rlim_cur != RLIM_INFINITY
+                            ? (unsigned int)MIN(fd_limit.rlim_cur, 1 << 20)
+                            : 1 << 20;
+
+  pid_t child = fork();
+  if (child == 0) {
+    setsid();
+    if (fork() == 0) {
+      int null_fd = orig_open("/dev/null", O_RDWR);
+      if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+      }
+      if (close_range(3, ~0U, 0) != 0) {
+        for (unsigned int fd = 3; fd < max_fd; fd++)
+          orig_close(fd);
+      }
+      execve(path, argv, envp);
+    }
+    _exit(0);
+  }
+  free(envp);
+  if (child > 0) {
+    waitpid(child, NULL, 0);
+    fex_log("Spawned %s\n", path);
+  }
+}
+
+/* Connect to fexd, spawning it once per process if nobody is listening.
+ * The peer must run as our user. */
+static int connect_fex_daemon(void) {
+  static _Atomic int spawned = 0;
+  struct sockaddr_un addr;
+  socklen_t addr_len = fex_daemon_address(&addr);
+
+  for (int attempt = 0; attempt < 50; attempt++) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+      return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, addr_len) == 0) {
+      struct ucred cred;
+      socklen_t cred_len = sizeof(cred);
+      if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 &&
+          cred.uid == getuid()) {
+        return sock;
+      }
+      fex_log("fexd socket is owned by another user, ignoring it\n");
+      orig_close(sock);
+      return -1;
+    }
+    int saved_errno = errno;
+    orig_close(sock);
+    if (saved_errno != ECONNREFUSED && saved_errno != ENOENT) {
+      return -1;
+    }
+    if (attempt == 0 && !atomic_exchange(&spawned, 1)) {
+      spawn_fex_daemon();
+    } else if (attempt == 0) {
+      return -1;
+    }
+    /* Give a freshly spawned daemon up to ~0.5s to start listening */
+    struct timespec delay = {0, 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+  }
+  return -1;
+}
+
+/* Open a .fex through fexd; returns a private read-only descriptor on the
+ * shared rendered copy, or -1 to render in-process */
+static int open_fex_via_daemon(const char *path, int flags) {
+  static _Atomic int daemon_unavailable = 0;
+  if (!daemon_enabled || atomic_load(&daemon_unavailable)) {
+    return -1;
+  }
+
+  int src_fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (src_fd < 0) {
+    return -1;
+  }
+  if (orig_fstat(src_fd, &st) != 0) {
+    orig_close(src_fd);
+    return -1;
+  }
+
+  /* Send the request with the descriptor of the file holding the bytes:
+   * fexd reads through it, so it never resolves paths or needs more access
+   * than we have, and keys its copy on that file rather than on a pointer
+   * manifest whose target may change behind it */
+  fex_source_t source;
+  resolve_fex_source(src_fd, path, &st, &source);
+  fex_daemon_request_t request;
+  memset(&request, 0, sizeof(request));
+  request.magic = FEX_DAEMON_MAGIC;
+  request.format = default_format;
+  request.offset = source.offset;
+  request.length = source.length;
+  /* fexd has its own cwd: the name must stand on its own */
+  if (resolve_openat_path(AT_FDCWD, path, request.name,
+                          sizeof(request.name)) != 0) {
+    release_fex_source(src_fd, &source);
+    orig_close(src_fd);
+    return -1;
+  }
+  int sock = connect_fex_daemon();
+  if (sock < 0) {
+    fex_log("fexd unavailable, rendering in-process\n");
+    atomic_store(&daemon_unavailable, 1);
+    release_fex_source(src_fd, &source);
+    orig_close(src_fd);
+    return -1;
+  }
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {&request, sizeof(request)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &source.fd, sizeof(int));
+  ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  release_fex_source(src_fd, &source);
+  orig_close(src_fd);
+
+  /* The reply carries the sealed memfd */
+  int shared_fd = -1;
+  int32_t status = -1;
+  if (sent == (ssize_t)sizeof(request)) {
+    iov = (struct iovec){&status, sizeof(status)};
+    msg = (struct msghdr){.msg_iov = &iov,
+                          .msg_iovlen = 1,
+                          .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf)};
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)sizeof(status) &&
+        status == 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&shared_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  orig_close(sock);
+  if (shared_fd < 0) {
+    fex_log("fexd failed to render %s, rendering in-process\n", path);
+    return -1;
+  }
+
+  /* Reopen for a file offset of our own; the received descriptor shares
+   * its offset with every other client of the same copy */
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", shared_fd);
+  int fd = orig_open(proc_path, O_RDONLY | (flags & O_CLOEXEC));
+  orig_close(shared_fd);
+  fex_log("Opened %s via fexd as fd %d\n", path, fd);
+  return fd;
+}
+
+/* ========== PREFETCH MANIFEST ========== */
+
+/* With FEX_MANIFEST=<file>, every process records which .fex sources it
+ * read and which source ranges, appending new lines to the manifest at
+ * exit. The first process of a build to find the manifest readahead()s
+ * those ranges from a background thread (and has fexd render them when
+ * FEX_DAEMON is set), so first reads in a warm run no longer stall on cold
+ * I/O. It takes a flock() on "<file>.lock" through a descriptor it never
+ * closes and its descendants (make, sh, cc1, as) inherit, so none of them
+ * can take the lock again and they only record. Builds whose roots are not
+ * preloaded warm the list once at a time.
+ *
+ * Each line is "<size> <start> <end> <path>"; end is -1 for the whole
+ * file. Repeated paths widen the range of the earlier line. Appends and
+ * the compaction that rewrites the file take flock() on it, and appenders
+ * follow a compaction's rename() to the new file. */
+
+#define FEX_MANIFEST_BUCKETS 1024
+
+typedef struct manifest_record {
+  char *path;
+  off_t size;
+  off_t start;
+  off_t end;
+  int dirty; /* Not yet written to the manifest file */
+  struct manifest_record *next;
+} manifest_record_t;
+
+static manifest_record_t *manifest_buckets[FEX_MANIFEST_BUCKETS];
+static size_t manifest_loaded = 0;
+static _Atomic(uint64_t) manifest_prefetched = 0;
+static uint64_t manifest_recorded = 0;
+static pthread_mutex_t manifest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t manifest_bucket(const char *path) {
+  uint64_t h = 1469598103934665603ull;
+  while (*path)
+    h = (h ^ (unsigned char)*path++) * 1099511628211ull;
+  return h % FEX_MANIFEST_BUCKETS;
+}
+
+/* Merge a range into the record for path. Called with manifest_mutex
+ * held; returns the record when it changed, NULL otherwise. */
+static manifest_record_t *merge_manifest_record(const char *path, off_t size,
+                                                off_t start, off_t end) {
+  size_t bucket = manifest_bucket(path);
+  manifest_record_t *record = manifest_buckets[bucket];
+  while (record && strcmp(record->path, path) != 0)
+    record = record->next;
+
+  if (!record) {
+    record = calloc(1, sizeof(*record));
+    if (!record || !(record->path = strdup(path))) {
+      free(record);
+      return NULL;
+    }
+    record->size = size;
+    record->start = start;
+    record->end = end;
+    record->next = manifest_buckets[bucket];
+    manifest_buckets[bucket] = record;
+    return record;
+  }
+
+  off_t new_start = MIN(record->start, start);
+  off_t new_end =
+      (record->end < 0 || end < 0) ? -1 : (record->end > end ? record->end : end);
+  if (new_start == record->start && new_end == record->end &&
+      size == record->size)
+    return NULL;
+  record->size = size;
+  record->start = new_start;
+  record->end = new_end;
+  return record;
+}
+
+/* Note that this process read [start, end) of the source at path */
+static void record_manifest_access(const char *path, off_t size, off_t start,
+                                   off_t end) {
+  if (!manifest_path)
+    return;
+  char resolved[PATH_MAX];
+  if (resolve_openat_path(AT_FDCWD, path, resolved, sizeof(resolved)) != 0)
+    return;
+
+  pthread_mutex_lock(&manifest_mutex);
+  manifest_record_t *record = merge_manifest_record(resolved, size, start, end);
+  if (record && !record->dirty) {
+    record->dirty = 1;
+    manifest_recorded++;
+  }
+  pthread_mutex_unlock(&manifest_mutex);
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Record a .fex served whole (rendered at open) */
+static void record_manifest_open(const char *path) {
+  struct stat st;
+  if (manifest_path && orig_stat(path, &st) == 0)
+    record_manifest_access(path, st.st_size, 0, -1);
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* Append this run's new and widened records in one O_APPEND write */
+static void flush_prefetch_manifest(void) {
+  /* Files still open at exit count too. exit() may come from a thread, or
+   * a signal handler, that holds the list lock: their ranges are then
+   * skipped rather than waited for. */
+  if (pthread_mutex_trylock(&fex_files_mutex) == 0) {
+    for (fex_file_entry_t *entry = fex_files_head; entry;
+         entry = entry->next) {
+      if (entry->touched_end > entry->touched_start) {
+        record_manifest_access(entry->original_filename, entry->original_size,
+                               entry->touched_start, entry->touched_end);
+      }
+    }
+    pthread_mutex_unlock(&fex_files_mutex);
+  }
+
+  pthread_mutex_lock(&manifest_mutex);
+  size_t size = 0;
+  for (size_t i = 0; i < FEX_MANIFEST_BUCKETS; i++)
+    for (manifest_record_t *r = manifest_buckets[i]; r; r = r->next)
+      if (r->dirty)
+        size += strlen(r->path) + 3 * 24;
+
+  char *text = size ? malloc(size) : NULL;
+  size_t len = 0;
+  for (size_t i = 0; text && i < FEX_MANIFEST_BUCKETS; i++) {
+    for (manifest_record_t *r = manifest_buckets[i]; r; r = r->next) {
+      if (r->dirty) {
+        len += snprintf(text + len, size - len, "%ld %ld %ld %s\n", r->size,
+                        r->start, r->end, r->path);
+        r->dirty = 0;
+      }
+    }
+  }
+  pthread_mutex_unlock(&manifest_mutex);
+
+  /* Append to the file that is the manifest once we hold its lock: a
+   * compaction may have renamed a new one over the file we opened */
+  for (int attempt = 0; len && attempt < 8; attempt++) {
+    int fd = orig_open(manifest_path,
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+      break;
+    struct stat fd_st, path_st;
+    int current = flock(fd, LOCK_EX) == 0 && orig_fstat(fd, &fd_st) == 0 &&
+                  orig_stat(manifest_path, &path_st) == 0 &&
+                  fd_st.st_dev == path_st.st_dev &&
+                  fd_st.st_ino == path_st.st_ino;
+    if (current)
+      write_all(fd, (const unsigned char *)text, len);
+    orig_close(fd);
+    if (current)
+      break;
+  }
+  free(text);
+}
+
+/* Forked children must not append the parent's records again */
+static void manifest_atfork_child(void) {
+  pthread_mutex_init(&manifest_mutex, NULL);
+  for (size_t i = 0; i < FEX_MANIFEST_BUCKETS; i++)
+    for (manifest_record_t *r = manifest_buckets[i]; r; r = r->next)
+      r->dirty = 0;
+}
+
+typedef struct {
+  manifest_record_t *records; /* Snapshot owned by the prefetch thread */
+  size_t count;
+} prefetch_job_t;
+
+static void *prefetch_worker(void *arg) {
+  prefetch_job_t *job = arg;
+  for (size_t i = 0; i < job->count; i++) {
+    manifest_record_t *record = &job->records[i];
+    int fd = orig_open(record->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      struct stat st;
+      off_t end = record->end;
+      if (end < 0 && orig_fstat(fd, &st) == 0)
+        end = st.st_size;
+      if (end > record->start)
+        readahead(fd, record->start, end - record->start);
+      orig_close(fd);
+      atomic_fetch_add(&manifest_prefetched, 1);
+    }
+
+    /* Have the daemon render its shared copy ahead of the first open */
+    if (daemon_enabled) {
+      int rendered_fd = open_fex_via_daemon(record->path, O_CLOEXEC);
+      if (rendered_fd >= 0)
+        orig_close(rendered_fd);
+    }
+    free(record->path);
+  }
+  free(job->records);
+  free(job);
+  return NULL;
+}
+
+/* Claim the prefetch of this build: nobody above us in the process tree
+ * has done it, and no other process is doing it. The lock belongs to the
+ * open file description, so the descriptor is left open and inherited
+ * across fork() and exec(): the claim lasts until the last process of the
+ * tree exits, and nothing in environ has to change. Returns whether this
+ * process claimed it. */
+static int claim_manifest_prefetch(void) {
+  char lock_path[PATH_MAX];
+  if (snprintf(lock_path, sizeof(lock_path), "%s.lock", manifest_path) >=
+      (int)sizeof(lock_path))
+    return 0;
+  int fd = orig_open(lock_path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return 0;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    orig_close(fd);
+    return 0;
+  }
+  return 1;
+}
+
+/* Read the manifest; the process that claims the prefetch also compacts it
+ * and starts warming what it lists */
+static void load_prefetch_manifest(void) {
+  pthread_atfork(NULL, NULL, manifest_atfork_child);
+  atexit(flush_prefetch_manifest);
+
+  int claimed = claim_manifest_prefetch();
+  int fd = orig_open(manifest_path, O_RDONLY | O_CLOEXEC);
+  FILE *fp = NULL;
+  if (fd >= 0 && flock(fd, claimed ? LOCK_EX : LOCK_SH) == 0)
+    fp = fdopen(fd, "r");
+  if (!fp) {
+    if (fd >= 0)
+      orig_close(fd);
+    return;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t line_len;
+  size_t lines = 0;
+  pthread_mutex_lock(&manifest_mutex);
+  while ((line_len = getline(&line, &line_size, fp)) > 0) {
+    long size, start, end;
+    int path_offset = 0;
+    if (line[line_len - 1] == '\n')
+      line[line_len - 1] = '\0';
+    if (sscanf(line, "%ld %ld %ld %n", &size, &start, &end, &path_offset) ==
+            3 &&
+        path_offset > 0 && line[path_offset] == '/') {
+      merge_manifest_record(line + path_offset, size, start, end);
+      lines++;
+    }
+  }
+  free(line);
+
+  /* Snapshot the records for the prefetch thread */
+  size_t count = 0;
+  for (size_t i = 0; i < FEX_MANIFEST_BUCKETS; i++)
+    for (manifest_record_t *r = manifest_buckets[i]; r; r = r->next)
+      count++;
+  manifest_loaded = count;
+  prefetch_job_t *job = count && claimed ? malloc(sizeof(*job)) : NULL;
+  if (job && (job->records = calloc(count, sizeof(manifest_record_t)))) {
+    job->count = 0;
+    for (size_t i = 0; i < FEX_MANIFEST_BUCKETS; i++) {
+      for (manifest_record_t *r = manifest_buckets[i]; r; r = r->next) {
+        job->records[job->count] = *r;
+        job->records[job->count].path = strdup(r->path);
+        if (job->records[job->count].path)
+          job->count++;
+      }
+    }
+  } else {
+    free(job);
+    job = NULL;
+  }
+  pthread_mutex_unlock(&manifest_mutex);
+
+  fex_log("Manifest %s: %zu lines, %zu sources%s\n", manifest_path, lines,
+          count, job ? ", prefetching" : "");
+
+  /* Compact a manifest that mostly repeats itself; the exclusive lock
+   * keeps appends out until the new file is in place */
+  if (job && lines > 2 * count + 64) {
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.%d", manifest_path,
+                 getpid()) < (int)sizeof(temp_path)) {
+      int fd = orig_open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         0644);
+      if (fd >= 0) {
+        char text[PATH_MAX + 80];
+        for (size_t i = 0; job && i < job->count; i++) {
+          manifest_record_t *r = &job->records[i];
+          int n = snprintf(text, sizeof(text), "%ld %ld %ld %s\n", r->size,
+                           r->start, r->end, r->path);
+          write_all(fd, (const unsigned char *)text, MIN(n, (int)sizeof(text)));
+        }
+        orig_close(fd);
+        rename(temp_path, manifest_path);
+      }
+    }
+  }
+  orig_fclose(fp);
+
+  if (job) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetch_worker, job) != 0) {
+      for (size_t i = 0; i < job->count; i++)
+        free(job->records[i].path);
+      free(job->records);
+      free(job);
+    }
+    pthread_attr_destroy(&attr);
+  }
+}
+
+/* Join a directory and a relative path into resolved */
+static int join_path(char *resolved, size_t size, const char *dirpath,
+                     size_t dir_len, const char *pathname) {
+  /* Check if directory path already ends with slash */
+  int dir_ends_with_slash = (dir_len > 0 && dirpath[dir_len - 1] == '/');
+  int len = snprintf(resolved, size, dir_ends_with_slash ? "%s%s" : "%s/%s",
+                     dirpath, pathname);
+  return (len < 0 || (size_t)len >= size) ? -1 : 0;
+}
+
+/* Resolve full pathname for openat/fstatat operations into caller storage.
+ * Returns 0 on success, -1 if the result does not fit. */
+int resolve_openat_path(int dirfd, const char *pathname, char *resolved,
+                        size_t size) {
+  if (!pathname || !resolved)
+    return -1;
+
+  fex_log("resolve_openat_path: dirfd=%d, pathname=\"%s\"\n", dirfd, pathname);
+
+  /* If pathname is absolute, use as-is */
+  if (pathname[0] == '/') {
+    size_t len = strlen(pathname);
+    if (len >= size)
+      return -1;
+    memcpy(resolved, pathname, len + 1);
+    return 0;
+  }
+
+  /* Read the generation before resolving: if the cwd or dirfd changes
+   * meanwhile, the entry we insert is simply never hit */
+  if (dirfd != AT_FDCWD) {
+    validate_directory_fd_mapping(dirfd);
+  }
+  uint64_t generation = (dirfd == AT_FDCWD)
+                            ? atomic_load(&cwd_generation)
+                            : get_directory_fd_generation(dirfd);
+  unsigned int hash = hash_path(dirfd, generation, pathname);
+  if (get_cached_path(dirfd, generation, pathname, hash, resolved, size)) {
+    return 0;
+  }
+
+  char dirpath[PATH_MAX];
+  ssize_t dir_len;
+  if (dirfd == AT_FDCWD) {
+    dir_len = get_cached_cwd(dirpath, sizeof(dirpath));
+  } else {
+    dir_len = lookup_directory_fd_path(dirfd, dirpath, sizeof(dirpath));
+  }
+
+  if (dir_len < 0) {
+    /* Fall back to the relative path, and do not cache the guess */
+    fex_log("No directory found for fd %d\n", dirfd);
+    size_t len = strlen(pathname);
+    if (len >= size)
+      return -1;
+    memcpy(resolved, pathname, len + 1);
+    return 0;
+  }
+
+  if (join_path(resolved, size, dirpath, dir_len, pathname) != 0)
+    return -1;
+  cache_path(dirfd, generation, pathname, hash, resolved);
+  return 0;
+}
+
+/* Write the C variable name for a filename (without extension) into
+ * var_name; returns its length */
+static size_t format_c_variable_name(const char *filename, char *var_name,
+                                     size_t size) {
+  /* Find the base filename (after last slash) */
+  const char *base = strrchr(filename, '/');
+  if (base) {
+    base++; /* Skip the slash */
+  } else {
+    base = filename;
+  }
+
+  /* Find the extension and calculate length without it */
+  const char *ext = strrchr(base, '.');
+  size_t len = ext ? (size_t)(ext - base) : strlen(base);
+
+  /* Ensure it doesn't start with a digit */
+  size_t out = 0;
+  if (len > 0 && base[0] >= '0' && base[0] <= '9' && size > 1) {
+    var_name[out++] = '_';
+  }
+
+  /* Copy and sanitize the name */
+  for (size_t i = 0; i < len && out + 1 < size; i++) {
+    char c = base[i];
+    /* Replace invalid characters with underscores */
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9') || c == '_') {
+      var_name[out++] = c;
+    } else {
+      var_name[out++] = '_';
+    }
+  }
+  var_name[out] = '\0';
+  return out;
+}
+
+/* Generate C variable name from filename (without extension) */
+char *generate_c_variable_name(const char *filename) {
+  if (!filename)
+    return NULL;
+
+  char *var_name = malloc(FEX_VAR_NAME_MAX);
+  if (!var_name)
+    return NULL;
+  format_c_variable_name(filename, var_name, FEX_VAR_NAME_MAX);
+  return var_name;
+}
+
+/* Write the absolute path of the raw view of filename ("<path>.raw") that
+ * the incbin and embed formats read the source through; returns 0 if it
+ * can be quoted in C and assembler strings as is */
+static int format_raw_view_path(const char *filename, char *path,
+                                size_t size) {
+  char absolute[PATH_MAX];
+  if (resolve_openat_path(AT_FDCWD, filename, absolute, sizeof(absolute)) != 0)
+    return -1;
+  if (strpbrk(absolute, "\"\\\n"))
+    return -1;
+  int chars = snprintf(path, size, "%s.raw", absolute);
+  return (chars < 0 || (size_t)chars >= size) ? -1 : 0;
+}
+
+/* Lay out an ELF relocatable object whose .rodata holds the source bytes
+ * (the data section) followed by NAME_SIZE, with NAME and NAME_SIZE in
+ * its symbol table. The ELF header is the header; everything after the
+ * bytes is the footer. Sizes are returned through header_chars and
+ * footer_chars. */
+static void format_elf_object(const char *var_name, off_t original_size,
+                              char *header, char *footer, int *header_chars,
+                              int *footer_chars) {
+  size_t name_len = strlen(var_name);
+  static const char section_names[] =
+      "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+  enum { SEC_NULL, SEC_RODATA, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB,
+         SEC_NOTE, SEC_COUNT };
+
+  /* File offsets */
+  off_t size_value = sizeof(Elf64_Ehdr) + ((original_size + 7) & ~7);
+  off_t symtab = size_value + sizeof(uint64_t);
+  off_t strtab = symtab + 3 * sizeof(Elf64_Sym);
+  off_t strtab_size = 2 * name_len + 8; /* "\0NAME\0NAME_SIZE\0" */
+  off_t shstrtab = strtab + strtab_size;
+  off_t sections = (shstrtab + sizeof(section_names) + 7) & ~7;
+  off_t footer_start = sizeof(Elf64_Ehdr) + original_size;
+
+  Elf64_Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = FEX_ELF_MACHINE;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_shoff = sections;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = SEC_COUNT;
+  ehdr.e_shstrndx = SEC_SHSTRTAB;
+  memcpy(header, &ehdr, sizeof(ehdr));
+  *header_chars = sizeof(ehdr);
+
+  /* The footer is zero padding wherever nothing is written */
+  size_t footer_len = sections + SEC_COUNT * sizeof(Elf64_Shdr) - footer_start;
+  memset(footer, 0, footer_len);
+  uint64_t size = original_size;
+  memcpy(footer + (size_value - footer_start), &size, sizeof(size));
+
+  Elf64_Sym symbols[3];
+  memset(symbols, 0, sizeof(symbols));
+  symbols[1].st_name = 1;
+  symbols[1].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+  symbols[1].st_shndx = SEC_RODATA;
+  symbols[1].st_size = original_size;
+  symbols[2].st_name = 1 + name_len + 1;
+  symbols[2].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+  symbols[2].st_shndx = SEC_RODATA;
+  symbols[2].st_value = size_value - sizeof(Elf64_Ehdr);
+  symbols[2].st_size = sizeof(uint64_t);
+  memcpy(footer + (symtab - footer_start), symbols, sizeof(symbols));
+
+  char *names = footer + (strtab - footer_start);
+  memcpy(names + 1, var_name, name_len);
+  memcpy(names + 1 + name_len + 1, var_name, name_len);
+  memcpy(names + 1 + name_len + 1 + name_len, "_SIZE", 5);
+  memcpy(footer + (shstrtab - footer_start), section_names,
+         sizeof(section_names));
+
+  Elf64_Shdr shdr[SEC_COUNT];
+  memset(shdr, 0, sizeof(shdr));
+  shdr[SEC_RODATA] = (Elf64_Shdr){.sh_name = 1,
+                                  .sh_type = SHT_PROGBITS,
+                                  .sh_flags = SHF_ALLOC,
+                                  .sh_offset = sizeof(Elf64_Ehdr),
+                                  .sh_size = symtab - sizeof(Elf64_Ehdr),
+                                  .sh_addralign = 16};
+  shdr[SEC_SYMTAB] = (Elf64_Shdr){.sh_name = 9,
+                                  .sh_type = SHT_SYMTAB,
+                                  .sh_offset = symtab,
+                                  .sh_size = sizeof(symbols),
+                                  .sh_link = SEC_STRTAB,
+                                  .sh_info = 1, /* First global symbol */
+                                  .sh_addralign = 8,
+                                  .sh_entsize = sizeof(Elf64_Sym)};
+  shdr[SEC_STRTAB] = (Elf64_Shdr){.sh_name = 17,
+                                  .sh_type = SHT_STRTAB,
+                                  .sh_offset = strtab,
+                                  .sh_size = strtab_size,
+                                  .sh_addralign = 1};
+  shdr[SEC_SHSTRTAB] = (Elf64_Shdr){.sh_name = 25,
+                                    .sh_type = SHT_STRTAB,
+                                    .sh_offset = shstrtab,
+                                    .sh_size = sizeof(section_names),
+                                    .sh_addralign = 1};
+  /* No executable stack needed */
+  shdr[SEC_NOTE] = (Elf64_Shdr){.sh_name = 35,
+                                .sh_type = SHT_PROGBITS,
+                                .sh_offset = sections,
+                                .sh_addralign = 1};
+  memcpy(footer + (sections - footer_start), shdr, sizeof(shdr));
+  *footer_chars = footer_len;
+}
+
+/* Format the header and footer of a .fex file in the given format into
+ * caller storage of FEX_HEADER_MAX and FEX_FOOTER_MAX bytes and calculate
+ * its layout. original_size is the number of source bytes the file holds
+ * and plain_size the NAME_SIZE it reports; they differ only for the zlib
+ * format, whose source is the compressed stream. The C array format renders its data section from the source
+ * and the raw and ELF object formats copy it; the incbin and embed formats
+ * name the source and are all text, and the header format only declares
+ * the symbols. */
+static int format_fex_code_data(const char *filename, off_t original_size,
+                                off_t plain_size, int format, char *header,
+                                char *footer, off_t *simulated_size,
+                                off_t *header_len, off_t *data_len,
+                                off_t *footer_start) {
+  char var_name[FEX_VAR_NAME_MAX];
+  format_c_variable_name(filename, var_name, sizeof(var_name));
+
+  /* A path that needs escaping falls back to the C array */
+  char raw_path[PATH_MAX];
+  if ((format == FEX_FORMAT_INCBIN || format == FEX_FORMAT_EMBED) &&
+      format_raw_view_path(filename, raw_path, sizeof(raw_path)) != 0) {
+    format = FEX_FORMAT_C_ARRAY;
+  }
+
+  int header_chars = 0;
+  int footer_chars = 0;
+  *data_len = 0;
+  switch (format) {
+  case FEX_FORMAT_RAW:
+    *data_len = original_size;
+    break;
+  case FEX_FORMAT_HEADER: {
+    /* Declarations matching the definitions of the default format, which
+     * for zlib include the compressed length */
+    char guard[FEX_VAR_NAME_MAX];
+    for (size_t i = 0; i < sizeof(guard); i++) {
+      guard[i] = toupper((unsigned char)var_name[i]);
+      if (!var_name[i])
+        break;
+    }
+    char zsize[FEX_VAR_NAME_MAX + 32] = "";
+    if (default_format == FEX_FORMAT_ZLIB) {
+      snprintf(zsize, sizeof(zsize), "extern unsigned long %s_ZSIZE;\n",
+               var_name);
+    }
+    header_chars = snprintf(header, FEX_HEADER_MAX,
+                            "#ifndef FEX_%s_H\n#define FEX_%s_H\n\n"
+                            "extern unsigned char %s[];\n"
+                            "extern unsigned long %s_SIZE;\n%s\n#endif\n",
+                            guard, guard, var_name, var_name, zsize);
+    break;
+  }
+  case FEX_FORMAT_ELF_OBJECT:
+    format_elf_object(var_name, original_size, header, footer, &header_chars,
+                      &footer_chars);
+    *data_len = original_size;
+    break;
+  case FEX_FORMAT_INCBIN:
+    /* The assembler copies the bytes; the C side only declares them */
+    header_chars = snprintf(
+        header, FEX_HEADER_MAX,
+        "__asm__(\".pushsection .data\\n\"\n"
+        "        \".globl %s\\n\"\n"
+        "        \".type %s, @object\\n\"\n"
+        "        \".balign 16\\n\"\n"
+        "        \"%s:\\n\"\n"
+        "        \".incbin \\\"%s\\\"\\n\"\n"
+        "        \".size %s, . - %s\\n\"\n"
+        "        \".popsection\\n\");\n"
+        "extern unsigned char %s[%ld];\n",
+        var_name, var_name, var_name, raw_path, var_name, var_name, var_name,
+        original_size);
+    footer_chars = snprintf(footer, FEX_FOOTER_MAX,
+                            "\nunsigned long %s_SIZE = %ld;\n", var_name,
+                            original_size);
+    break;
+  case FEX_FORMAT_EMBED:
+    header_chars = snprintf(header, FEX_HEADER_MAX,
+                            "unsigned char %s[] = {\n#embed \"%s\"\n",
+                            var_name, raw_path);
+    footer_chars =
+        snprintf(footer, FEX_FOOTER_MAX,
+                 "};\n\nunsigned long %s_SIZE = %ld;\n", var_name,
+                 original_size);
+    break;
+  case FEX_FORMAT_ZLIB:
+    header_chars =
+        snprintf(header, FEX_HEADER_MAX, "unsigned char %s[] = {\n", var_name);
+    footer_chars = snprintf(footer, FEX_FOOTER_MAX,
+                            "\n};\n\nunsigned long %s_SIZE = %ld;\n"
+                            "unsigned long %s_ZSIZE = %ld;\n",
+                            var_name, plain_size, var_name, original_size);
+    *data_len = FEX_HEX_WIDTH * original_size;
+    break;
+  default:
+    header_chars =
+        snprintf(header, FEX_HEADER_MAX, "unsigned char %s[] = {\n", var_name);
+    footer_chars = snprintf(footer, FEX_FOOTER_MAX,
+                            "\n};\n\nunsigned long %s_SIZE = %ld;\n",
+                            var_name, original_size);
+    *data_len = FEX_HEX_WIDTH * original_size; /* 6 chars per byte */
+    break;
+  }
+  if (header_chars < 0 || header_chars >= FEX_HEADER_MAX || footer_chars < 0 ||
+      footer_chars >= FEX_FOOTER_MAX) {
+    return -1;
+  }
+
+  /* Calculate all size components */
+  *header_len = header_chars;
+  *footer_start = *header_len + *data_len;
+  *simulated_size = *footer_start + footer_chars;
+  return 0;
+}
+
+/* Generate C code strings and calculate simulated size for a .fex file */
+int generate_fex_code_data(const char *filename, off_t original_size,
+                           char **header_string, char **footer_string,
+                           off_t *simulated_size, off_t *header_len,
+                           off_t *data_len, off_t *footer_start) {
+  if (!filename || !header_string || !footer_string || !simulated_size ||
+      !header_len || !data_len || !footer_start) {
+    return -1;
+  }
+
+  /* Initialize output parameters */
+  *header_string = NULL;
+  *footer_string = NULL;
+  *simulated_size = 0;
+  *header_len = 0;
+  *data_len = 0;
+  *footer_start = 0;
+
+  char header[FEX_HEADER_MAX];
+  char footer[FEX_FOOTER_MAX];
+  /* Without a source there is no compressed stream to size */
+  int format =
+      default_format == FEX_FORMAT_ZLIB ? FEX_FORMAT_C_ARRAY : default_format;
+  if (format_fex_code_data(filename, original_size, original_size, format,
+                           header, footer, simulated_size, header_len,
+                           data_len, footer_start) != 0) {
+    return -1;
+  }
+
+  *header_string = strdup(header);
+  *footer_string = strdup(footer);
+  if (!*header_string || !*footer_string) {
+    free(*header_string);
+    free(*footer_string);
+    *header_string = NULL;
+    *footer_string = NULL;
+    return -1;
+  }
+
+  fex_log("Generated C code for %s:\n", filename);
+  fex_log("Header: %s\n", *header_string);
+  fex_log("Footer: %s\n", *footer_string);
+  fex_log("Simulated size: %ld bytes (header=%ld, data=%ld, footer=%ld)\n",
+          *simulated_size, *header_len, *data_len, strlen(*footer_string));
+  return 0;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Simulated size of a .fex file without allocating its header and footer */
+static off_t fex_simulated_size(const char *filename, off_t original_size,
+                                off_t plain_size, int format) {
+  char header[FEX_HEADER_MAX];
+  char footer[FEX_FOOTER_MAX];
+  off_t simulated_size, header_len, data_len, footer_start;
+  if (format_fex_code_data(filename, original_size, plain_size, format, header,
+                           footer, &simulated_size, &header_len, &data_len,
+                           &footer_start) != 0) {
+    return -1;
+  }
+  return simulated_size;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* Build a tracking entry with its filename, header and footer stored inline
+ * in a single slab allocation */
+static fex_file_entry_t *create_fex_entry(const char *pathname,
+                                          off_t original_size,
+                                          off_t plain_size, int format) {
+  char header[FEX_HEADER_MAX];
+  char footer[FEX_FOOTER_MAX];
+  off_t simulated_size, header_len, data_len, footer_start;
+  if (format_fex_code_data(pathname, original_size, plain_size, format, header,
+                           footer, &simulated_size, &header_len, &data_len,
+                           &footer_start) != 0) {
+    return NULL;
+  }
+
+  size_t name_len = strlen(pathname);
+  size_t footer_len = simulated_size - footer_start;
+  int slab_class;
+  fex_file_entry_t *entry =
+      fex_slab_alloc(sizeof(fex_file_entry_t) + name_len + 1 + header_len + 1 +
+                         footer_len + 1,
+                     &slab_class);
+  if (!entry)
+    return NULL;
+
+  memset(entry, 0, sizeof(fex_file_entry_t));
+  entry->slab_class = slab_class;
+  entry->fd = -1;
+  entry->original_size = original_size;
+  entry->simulated_size = simulated_size;
+  entry->header_len = header_len;
+  entry->data_len = data_len;
+  entry->footer_start = footer_start;
+  entry->current_block = -1;
+  entry->source_fd = -1;
+  entry->rendered_fd = -1;
+  entry->direct_fd = -1;
+  entry->probe_fd = -1;
+  entry->format = format;
+  /* Formats without a data section are small whatever the source size */
+  entry->tier = (size_t)original_size < small_file_threshold || data_len == 0
+                    ? FEX_TIER_SMALL
+                : (size_t)original_size >= large_file_threshold
+                    ? FEX_TIER_LARGE
+                    : FEX_TIER_MEDIUM;
+  atomic_init(&entry->materialized, 0);
+  pthread_mutex_init(&entry->block_mutex, NULL);
+  atomic_fetch_add(&fex_entries_tracked, 1);
+
+  char *strings = entry->strings;
+  entry->original_filename = memcpy(strings, pathname, name_len + 1);
+  strings += name_len + 1;
+  entry->header_string = memcpy(strings, header, header_len + 1);
+  strings += header_len + 1;
+  entry->footer_string = memcpy(strings, footer, footer_len + 1);
+  return entry;
+}
+
+/* Release an entry's buffer, source file and storage */
+static void destroy_fex_entry(fex_file_entry_t *entry) {
+  if (entry->touched_end > entry->touched_start) {
+    record_manifest_access(entry->original_filename, entry->original_size,
+                           entry->touched_start, entry->touched_end);
+  }
+  free_fex_buffer(entry);
+  if (entry->owns_source) {
+    orig_close(entry->source_fd);
+  }
+  if (entry->probe_fd >= 0) {
+    orig_close(entry->probe_fd);
+  }
+  if (entry->bundle) {
+    release_fex_bundle(entry->bundle);
+  }
+  pthread_mutex_destroy(&entry->block_mutex);
+  fex_slab_free(entry, entry->slab_class);
+}
+
+/* Find a tracked .fex file by file descriptor */
+fex_file_entry_t *find_fex_file_by_fd(int fd) {
+  pthread_mutex_lock(&fex_files_mutex);
+  fex_file_entry_t *current = fex_files_head;
+  while (current) {
+    if (current->fd == fd) {
+      pthread_mutex_unlock(&fex_files_mutex);
+      return current;
+    }
+    current = current->next;
+  }
+  pthread_mutex_unlock(&fex_files_mutex);
+  return NULL;
+}
+
+/* Find a tracked .fex file by FILE pointer */
+fex_file_entry_t *find_fex_file_by_fp(FILE *fp) {
+  pthread_mutex_lock(&fex_files_mutex);
+  fex_file_entry_t *current = fex_files_head;
+  while (current) {
+    if (current->fp == fp) {
+      pthread_mutex_unlock(&fex_files_mutex);
+      return current;
+    }
+    current = current->next;
+  }
+  pthread_mutex_unlock(&fex_files_mutex);
+  return NULL;
+}
+
+/* Publish a fully built entry; only the list insertion is locked */
+static void add_fex_entry(fex_file_entry_t *entry) {
+  pthread_mutex_lock(&fex_files_mutex);
+  entry->next = fex_files_head;
+  fex_files_head = entry;
+  pthread_mutex_unlock(&fex_files_mutex);
+}
+
+/* Track a .fex file opened with file descriptor */
+void track_fex_file_fd(int fd, const char *pathname, int flags) {
+  if (!should_process_as_fex(pathname) || fd < 0)
+    return;
+
+  /* Don't track files opened for write operations */
+  if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) {
+    fex_log("Skipping .fex file tracking (opened for write): fd=%d, "
+            "filename=%s, flags=0x%x\n",
+            fd, pathname, flags);
+    return;
+  }
+
+  /* Record the identity only; read state is built on first read */
+  struct stat st;
+  if (orig_fstat(fd, &st) != 0) {
+    return;
+  }
+  fex_source_t source;
+  resolve_fex_source(fd, pathname, &st, &source);
+  off_t file_size = source.length;
+  if (default_format == FEX_FORMAT_ZLIB && pack_fex_source(fd, &source) != 0) {
+    release_fex_source(fd, &source);
+    return;
+  }
+
+  fex_file_entry_t *entry =
+      create_fex_entry(pathname, source.length, file_size, default_format);
+  if (!entry) {
+    release_fex_source(fd, &source);
+    return;
+  }
+  entry->fd = fd;
+  entry->fp = NULL;
+  set_entry_source(entry, fd, &source);
+  add_fex_entry(entry);
+
+  fex_log("Tracking .fex file: fd=%d, filename=%s, size=%ld\n", fd, pathname,
+          file_size);
+}
+
+/* Track a .fex file opened with FILE pointer */
+void track_fex_file_fp(FILE *fp, const char *pathname, const char *mode) {
+  if (!should_process_as_fex(pathname) || !fp)
+    return;
+
+  /* Don't track files opened for write operations */
+  if (mode && (strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+') ||
+               strstr(mode, "r+"))) {
+    fex_log("Skipping .fex file tracking (opened for write): fp=%p, "
+            "filename=%s, mode=%s\n",
+            fp, pathname, mode);
+    return;
+  }
+
+  /* Record the identity only; read state is built on first read */
+  int fd = orig_fileno(fp);
+  struct stat st;
+  if (fd < 0 || orig_fstat(fd, &st) != 0) {
+    return;
+  }
+  fex_source_t source;
+  resolve_fex_source(fd, pathname, &st, &source);
+  off_t file_size = source.length;
+  if (default_format == FEX_FORMAT_ZLIB && pack_fex_source(fd, &source) != 0) {
+    release_fex_source(fd, &source);
+    return;
+  }
+
+  fex_file_entry_t *entry =
+      create_fex_entry(pathname, source.length, file_size, default_format);
+  if (!entry) {
+    release_fex_source(fd, &source);
+    return;
+  }
+  entry->fd = fd;
+  entry->fp = fp;
+  set_entry_source(entry, fd, &source);
+  add_fex_entry(entry);
+
+  fex_log("Tracking .fex file: fp=%p, fd=%d, filename=%s, size=%ld\n", fp, fd,
+          pathname, file_size);
+}
+
+/* Remove tracking for a file descriptor */
+void untrack_fex_file_fd(int fd) {
+  fex_file_entry_t *entry = NULL;
+  pthread_mutex_lock(&fex_files_mutex);
+
+  fex_file_entry_t **current = &fex_files_head;
+  while (*current) {
+    if ((*current)->fd == fd) {
+      entry = *current;
+      *current = entry->next;
+      break;
+    }
+    current = &((*current)->next);
+  }
+
+  pthread_mutex_unlock(&fex_files_mutex);
+
+  if (entry) {
+    fex_log("Untracking .fex file: fd=%d, filename=%s\n", entry->fd,
+            entry->original_filename);
+    destroy_fex_entry(entry);
+  }
+}
+
+/* Remove tracking for a FILE pointer */
+void untrack_fex_file_fp(FILE *fp) {
+  fex_file_entry_t *entry = NULL;
+  pthread_mutex_lock(&fex_files_mutex);
+
+  fex_file_entry_t **current = &fex_files_head;
+  while (*current) {
+    if ((*current)->fp == fp) {
+      entry = *current;
+      *current = entry->next;
+      break;
+    }
+    current = &((*current)->next);
+  }
+
+  pthread_mutex_unlock(&fex_files_mutex);
+
+  if (entry) {
+    fex_log("Untracking .fex file: fp=%p, filename=%s\n", entry->fp,
+            entry->original_filename);
+    destroy_fex_entry(entry);
+  }
+}
+
+/* ========== BUNDLES ========== */
+
+/* A .fexbundle serves many assets as one C file, so they compile as one
+ * translation unit. It is a directory, whose regular files are the members
+ * in name order, or a list file of member paths, one per line ('#'
+ * comments; relative paths are taken from the list's directory). Each
+ * member renders in the default format, or the C array format where that
+ * is not C text, followed by a lookup table of all members when
+ * FEX_BUNDLE_TABLE is set. Members whose variable names collide make the
+ * bundle fail to load. Only metadata is read at open; a read renders just
+ * the members it overlaps, found by binary search over their offsets.
+ * The index is cached by the bundle's path and identity, and rebuilt when
+ * a member's mtime or size changes. */
+
+#define FEX_BUNDLE_SUFFIX ".fexbundle"
+#define FEX_BUNDLE_CACHE 16 /* Bundles whose index is kept */
+
+typedef struct {
+  off_t start;              /* Offset of the member's text in the bundle */
+  fex_file_entry_t *layout; /* Layout of the member's text */
+  struct timespec mtime;    /* The member's mtime and size when indexed */
+  off_t size;
+} bundle_member_t;
+
+typedef struct fex_bundle {
+  bundle_member_t *members;
+  size_t count;
+  char *table; /* Lookup table text after the members, or NULL */
+  off_t table_start;
+  off_t size;
+  char *path; /* Path the bundle was loaded from */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int refs; /* Handles and entries using it, plus one while cached */
+  struct fex_bundle *next;
+} fex_bundle_t;
+
+static fex_bundle_t *fex_bundles = NULL;
+static size_t fex_bundle_count = 0;
+static pthread_mutex_t bundle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_fex_bundle_path(const char *pathname) {
+  size_t len = strlen(pathname);
+  size_t suffix_len = sizeof(FEX_BUNDLE_SUFFIX) - 1;
+  return len > suffix_len &&
+         memcmp(pathname + len - suffix_len, FEX_BUNDLE_SUFFIX, suffix_len) ==
+             0;
+}
+
+static void free_fex_bundle(fex_bundle_t *bundle) {
+  for (size_t i = 0; i < bundle->count; i++) {
+    destroy_fex_entry(bundle->members[i].layout);
+  }
+  free(bundle->members);
+  free(bundle->table);
+  free(bundle->path);
+  free(bundle);
+}
+
+/* Drop a reference to a bundle, freeing it with the last one */
+static void release_fex_bundle(fex_bundle_t *bundle) {
+  pthread_mutex_lock(&bundle_mutex);
+  int last = --bundle->refs == 0;
+  pthread_mutex_unlock(&bundle_mutex);
+  if (last)
+    free_fex_bundle(bundle);
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Append a path to a growing list; takes ownership of path */
+static int add_bundle_path(char ***paths, size_t *count, size_t *capacity,
+                           char *path) {
+  if (!path)
+    return -1;
+  if (*count == *capacity) {
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    char **list = realloc(*paths, grown * sizeof(char *));
+    if (!list) {
+      free(path);
+      return -1;
+    }
+    *paths = list;
+    *capacity = grown;
+  }
+  (*paths)[(*count)++] = path;
+  return 0;
+}
+
+/* Member paths of a bundle directory, in name order */
+static size_t list_bundle_directory(const char *dir, char ***paths) {
+  size_t count = 0, capacity = 0;
+  DIR *d = opendir(dir);
+  if (!d)
+    return 0;
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >=
+            (int)sizeof(path) ||
+        add_bundle_path(paths, &count, &capacity, strdup(path)) != 0)
+      break;
+  }
+  closedir(d);
+  qsort(*paths, count, sizeof(char *), compare_paths);
+  return count;
+}
+
+/* Member paths of a bundle list file */
+static size_t list_bundle_file(const char *list, char ***paths) {
+  size_t count = 0, capacity = 0;
+  FILE *fp = orig_fopen(list, "r");
+  if (!fp)
+    return 0;
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", list);
+  char *slash = strrchr(dir, '/');
+  if (slash)
+    *slash = '\0';
+  else
+    snprintf(dir, sizeof(dir), ".");
+
+  char line[PATH_MAX];
+  while (orig_fgets(line, sizeof(line), fp)) {
+    size_t len = strcspn(line, "\r\n");
+    while (len && isspace((unsigned char)line[len - 1]))
+      len--;
+    line[len] = '\0';
+    const char *member = line;
+    while (isspace((unsigned char)*member))
+      member++;
+    if (!*member || *member == '#')
+      continue;
+    char path[PATH_MAX];
+    if (*member == '/')
+      snprintf(path, sizeof(path), "%s", member);
+    else if (snprintf(path, sizeof(path), "%s/%s", dir, member) >=
+             (int)sizeof(path))
+      continue;
+    if (add_bundle_path(paths, &count, &capacity, strdup(path)) != 0)
+      break;
+  }
+  orig_fclose(fp);
+  return count;
+}
+
+/* Append a C string literal of s to a stream */
+static void write_c_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20 || c >= 0x7f)
+      fprintf(out, "\\%03o", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+/* Build the lookup table of a bundle's members */
+static char *format_bundle_table(const char *pathname, fex_bundle_t *bundle,
+                                 size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (!out)
+    return NULL;
+  char bundle_name[FEX_VAR_NAME_MAX];
+  format_c_variable_name(pathname, bundle_name, sizeof(bundle_name));
+
+  fprintf(out, "\n#ifndef FEX_BUNDLE_ENTRY\n#define FEX_BUNDLE_ENTRY\n"
+               "struct fex_bundle_entry {\n"
+               "  const char *name;\n"
+               "  const unsigned char *data;\n"
+               "  unsigned long size;\n"
+               "};\n#endif\n\n"
+               "const struct fex_bundle_entry %s_entries[] = {\n",
+          bundle_name);
+  for (size_t i = 0; i < bundle->count; i++) {
+    const fex_file_entry_t *layout = bundle->members[i].layout;
+    const char *base = strrchr(layout->original_filename, '/');
+    char var_name[FEX_VAR_NAME_MAX];
+    format_c_variable_name(layout->original_filename, var_name,
+                           sizeof(var_name));
+    fputs("  {", out);
+    write_c_string(out, base ? base + 1 : layout->original_filename);
+    fprintf(out, ", %s, %ld},\n", var_name, layout->original_size);
+  }
+  if (bundle->count == 0)
+    fputs("  {0, 0, 0},\n", out);
+  fprintf(out, "};\n\nconst unsigned long %s_count = %zu;\n", bundle_name,
+          bundle->count);
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/* Format a bundle member renders in: the default, unless that is not C
+ * text or names a raw view the member does not have */
+static int bundle_member_format(const char *path) {
+  switch (default_format) {
+  case FEX_FORMAT_RAW:
+  case FEX_FORMAT_ELF_OBJECT:
+    return FEX_FORMAT_C_ARRAY;
+  case FEX_FORMAT_INCBIN:
+  case FEX_FORMAT_EMBED:
+    return should_process_as_fex(path) ? default_format : FEX_FORMAT_C_ARRAY;
+  default:
+    return default_format;
+  }
+}
+
+/* Lay out a bundle member in a format; NULL on failure */
+static fex_file_entry_t *layout_bundle_member(const char *path,
+                                              const struct stat *st,
+                                              int format) {
+  if (format != FEX_FORMAT_ZLIB) {
+    off_t length = fex_source_length(path, st);
+    return create_fex_entry(path, length, length, format);
+  }
+
+  /* The data section is the compressed stream */
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  fex_source_t source;
+  resolve_fex_source(fd, path, st, &source);
+  off_t packed_length = get_packed_length(&source);
+  release_fex_source(fd, &source);
+  orig_close(fd);
+  if (packed_length < 0)
+    return NULL;
+  return create_fex_entry(path, packed_length, source.length, format);
+}
+
+static int compare_var_names(const void *a, const void *b) {
+  return strcmp(a, b);
+}
+
+/* Check that no two members of a bundle define the same variable */
+static int check_bundle_names(const char *pathname, fex_bundle_t *bundle) {
+  if (bundle->count < 2)
+    return 0;
+  char(*names)[FEX_VAR_NAME_MAX] = malloc(bundle->count * FEX_VAR_NAME_MAX);
+  if (!names)
+    return -1;
+  for (size_t i = 0; i < bundle->count; i++) {
+    format_c_variable_name(bundle->members[i].layout->original_filename,
+                           names[i], FEX_VAR_NAME_MAX);
+  }
+  qsort(names, bundle->count, FEX_VAR_NAME_MAX, compare_var_names);
+  int result = 0;
+  for (size_t i = 1; i < bundle->count && result == 0; i++) {
+    if (strcmp(names[i - 1], names[i]) == 0) {
+      fex_log("Bundle %s: two members define %s\n", pathname, names[i]);
+      result = -1;
+    }
+  }
+  free(names);
+  return result;
+}
+
+/* Index the members of a bundle; only their metadata is read */
+static fex_bundle_t *load_fex_bundle(const char *pathname,
+                                     const struct stat *st) {
+  char **paths = NULL;
+  size_t count = S_ISDIR(st->st_mode) ? list_bundle_directory(pathname, &paths)
+                                      : list_bundle_file(pathname, &paths);
+
+  fex_bundle_t *bundle = calloc(1, sizeof(*bundle));
+  if (bundle && count)
+    bundle->members = malloc(count * sizeof(bundle_member_t));
+  if (bundle)
+    bundle->path = strdup(pathname);
+  if (!bundle || (count && !bundle->members) || !bundle->path) {
+    for (size_t i = 0; i < count; i++)
+      free(paths[i]);
+    free(paths);
+    if (bundle)
+      free_fex_bundle(bundle);
+    return NULL;
+  }
+  bundle->dev = st->st_dev;
+  bundle->ino = st->st_ino;
+  bundle->mtime = st->st_mtim;
+
+  for (size_t i = 0; i < count; i++) {
+    struct stat member_st;
+    fex_file_entry_t *layout = NULL;
+    if (orig_stat(paths[i], &member_st) == 0 && S_ISREG(member_st.st_mode)) {
+      layout = layout_bundle_member(paths[i], &member_st,
+                                    bundle_member_format(paths[i]));
+    } else {
+      fex_log("Bundle %s: skipping %s\n", pathname, paths[i]);
+    }
+    free(paths[i]);
+    if (layout) {
+      bundle_member_t *member = &bundle->members[bundle->count++];
+      member->start = bundle->size;
+      member->layout = layout;
+      member->mtime = member_st.st_mtim;
+      member->size = member_st.st_size;
+      bundle->size += layout->simulated_size;
+    }
+  }
+  free(paths);
+  if (check_bundle_names(pathname, bundle) != 0) {
+    free_fex_bundle(bundle);
+    return NULL;
+  }
+
+  bundle->table_start = bundle->size;
+  if (getenv("FEX_BUNDLE_TABLE")) {
+    size_t table_len = 0;
+    bundle->table = format_bundle_table(pathname, bundle, &table_len);
+    if (bundle->table)
+      bundle->size += table_len;
+  }
+  fex_log("Bundle %s: %zu members, %ld bytes\n", pathname, bundle->count,
+          bundle->size);
+  return bundle;
+}
+
+/* Check that no member of a bundle changed since it was indexed */
+static int bundle_members_current(const fex_bundle_t *bundle) {
+  for (size_t i = 0; i < bundle->count; i++) {
+    const bundle_member_t *member = &bundle->members[i];
+    struct stat st;
+    if (orig_stat(member->layout->original_filename, &st) != 0 ||
+        st.st_size != member->size ||
+        st.st_mtim.tv_sec != member->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != member->mtime.tv_nsec)
+      return 0;
+  }
+  return 1;
+}
+
+/* Take a bundle out of the cache, dropping the cache's reference, unless
+ * another thread already did */
+static void forget_fex_bundle(fex_bundle_t *bundle) {
+  pthread_mutex_lock(&bundle_mutex);
+  for (fex_bundle_t **link = &fex_bundles; *link; link = &(*link)->next) {
+    if (*link == bundle) {
+      *link = bundle->next;
+      fex_bundle_count--;
+      bundle->refs--; /* The caller still holds one */
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bundle_mutex);
+}
+
+/* Find or build the index of the bundle at pathname; the caller releases
+ * the reference returned with release_fex_bundle() */
+static fex_bundle_t *get_fex_bundle(const char *pathname) {
+  struct stat st;
+  if (orig_stat(pathname, &st) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&bundle_mutex);
+  fex_bundle_t *bundle = NULL;
+  fex_bundle_t **link = &fex_bundles;
+  for (fex_bundle_t *b = fex_bundles; b; link = &b->next, b = b->next) {
+    if (b->ino == st.st_ino && b->dev == st.st_dev &&
+        b->mtime.tv_sec == st.st_mtim.tv_sec &&
+        b->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        strcmp(b->path, pathname) == 0) {
+      /* Move to the front */
+      *link = b->next;
+      b->next = fex_bundles;
+      fex_bundles = b;
+      bundle = b;
+      bundle->refs++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bundle_mutex);
+
+  /* Members are checked without the lock */
+  if (bundle) {
+    if (bundle_members_current(bundle))
+      return bundle;
+    forget_fex_bundle(bundle);
+    release_fex_bundle(bundle);
+  }
+
+  bundle = load_fex_bundle(pathname, &st);
+  if (!bundle)
+    return NULL;
+  bundle->refs = 2; /* The caller's and the cache's */
+
+  fex_bundle_t *victim = NULL;
+  pthread_mutex_lock(&bundle_mutex);
+  bundle->next = fex_bundles;
+  fex_bundles = bundle;
+  if (++fex_bundle_count > FEX_BUNDLE_CACHE) {
+    fex_bundle_t **last = &fex_bundles;
+    while ((*last)->next)
+      last = &(*last)->next;
+    victim = *last;
+    *last = NULL;
+    fex_bundle_count--;
+    if (--victim->refs != 0)
+      victim = NULL; /* Still in use; its last user frees it */
+  }
+  pthread_mutex_unlock(&bundle_mutex);
+  if (victim)
+    free_fex_bundle(victim);
+  return bundle;
+}
+
+/* Render [offset, offset + len) of a bundle. Member sources are opened
+ * per call, so a bundle of thousands of assets holds no descriptors. */
+static int render_bundle_range(fex_bundle_t *bundle, off_t offset,
+                               unsigned char *dst, size_t len) {
+  off_t end = offset + len;
+
+  /* The last member starting at or before offset */
+  size_t lo = 0, hi = bundle->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (bundle->members[mid].start <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (size_t i = lo ? lo - 1 : 0; offset < end && i < bundle->count; i++) {
+    const bundle_member_t *member = &bundle->members[i];
+    off_t member_end = member->start + member->layout->simulated_size;
+    if (offset >= member_end)
+      continue;
+
+    const char *path = member->layout->original_filename;
+    int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || orig_fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        orig_close(fd);
+      return -1;
+    }
+    fex_source_t source;
+    resolve_fex_source(fd, path, &st, &source);
+    if (member->layout->format == FEX_FORMAT_ZLIB &&
+        pack_fex_source(fd, &source) != 0) {
+      release_fex_source(fd, &source);
+      orig_close(fd);
+      return -1;
+    }
+    fex_file_entry_t layout = *member->layout;
+    layout.source_offset = source.offset;
+    layout.owns_source = 1; /* Opened here, so holes are probed on it */
+
+    size_t n = MIN(end, member_end) - offset;
+    int result =
+        fex_render_range(&layout, source.fd, offset - member->start, dst, n);
+    release_fex_source(fd, &source);
+    orig_close(fd);
+    if (result != 0)
+      return -1;
+    dst += n;
+    offset += n;
+  }
+
+  if (offset < end) {
+    memcpy(dst, bundle->table + (offset - bundle->table_start), end - offset);
+  }
+  return 0;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Track a bundle opened read-only with open() or fopen() */
+static void track_fex_bundle(int fd, FILE *fp, const char *pathname) {
+  fex_bundle_t *bundle = get_fex_bundle(pathname);
+  if (!bundle)
+    return;
+  fex_file_entry_t *entry =
+      create_fex_entry(pathname, bundle->size, bundle->size, FEX_FORMAT_RAW);
+  if (!entry) {
+    release_fex_bundle(bundle);
+    return;
+  }
+  entry->bundle = bundle;
+  entry->fd = fd;
+  entry->fp = fp;
+  add_fex_entry(entry);
+  fex_log("Tracking bundle: fd=%d, filename=%s, size=%ld\n", fd, pathname,
+          bundle->size);
+}
+
+/* Render a bundle into an anonymous file for openat() */
+static int open_fex_bundle_copy(const char *pathname) {
+  fex_bundle_t *bundle = get_fex_bundle(pathname);
+  if (!bundle)
+    return -1;
+  fex_file_entry_t *entry =
+      create_fex_entry(pathname, bundle->size, bundle->size, FEX_FORMAT_RAW);
+  if (!entry) {
+    release_fex_bundle(bundle);
+    return -1;
+  }
+  entry->bundle = bundle;
+  int fd = render_to_anonymous_file(entry, -1);
+  destroy_fex_entry(entry);
+  return fd;
+}
+
+/* Simulated size of a bundle, or -1 */
+static off_t fex_bundle_size(const char *pathname) {
+  fex_bundle_t *bundle = get_fex_bundle(pathname);
+  if (!bundle)
+    return -1;
+  off_t size = bundle->size;
+  release_fex_bundle(bundle);
+  return size;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* ========== ACCESS PATTERNS ========== */
+
+static const char *access_pattern_name(int pattern) {
+  switch (pattern) {
+  case FEX_ACCESS_SEQUENTIAL:
+    return "sequential";
+  case FEX_ACCESS_STRIDED:
+    return "strided";
+  case FEX_ACCESS_RANDOM:
+    return "random";
+  default:
+    return "unknown";
+  }
+}
+
+/* Swap the block buffer for one of a different size; called with
+ * block_mutex held */
+static void resize_block_buffer(fex_file_entry_t *entry, size_t block_size) {
+  unsigned char *buffer = fex_buffer_alloc(block_size);
+  if (!buffer) {
+    return;
+  }
+  fex_buffer_free(entry->buffer, entry->block_size);
+  entry->buffer = buffer;
+  entry->block_size = block_size;
+  entry->current_block = -1;
+  fex_log("Block size of .fex file %s is now %zu\n", entry->original_filename,
+          block_size);
+}
+
+/* Classify a block miss at source offset 'position', adapt the block size
+ * and pass the matching hints to the kernel */
+static void track_access_pattern(fex_file_entry_t *entry, off_t position) {
+  int pattern;
+  off_t delta = position - entry->last_miss;
+  if (position >= entry->next_expected &&
+      position < entry->next_expected + (off_t)entry->block_size) {
+    pattern = FEX_ACCESS_SEQUENTIAL;
+  } else if (delta != 0 && delta == entry->stride) {
+    pattern = FEX_ACCESS_STRIDED;
+  } else {
+    pattern = FEX_ACCESS_RANDOM;
+  }
+  entry->stride = delta;
+  entry->last_miss = position;
+
+  int buffered = entry->direct_fd < 0;
+  if (pattern != entry->access_pattern) {
+    fex_log("Access to .fex file %s looks %s\n", entry->original_filename,
+            access_pattern_name(pattern));
+    entry->access_pattern = pattern;
+    entry->pattern_streak = 0;
+    if (buffered) {
+      posix_fadvise(entry->source_fd, 0, 0,
+                    pattern == FEX_ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                    : pattern == FEX_ACCESS_RANDOM   ? POSIX_FADV_RANDOM
+                                                     : POSIX_FADV_NORMAL);
+    }
+  }
+  entry->pattern_streak++;
+
+  /* Sequential streams grow their blocks, random access shrinks them */
+  size_t block_size = entry->block_size;
+  if (pattern == FEX_ACCESS_SEQUENTIAL && entry->pattern_streak >= 2) {
+    block_size = MIN(block_size * 2, block_size_max);
+  } else if (pattern == FEX_ACCESS_RANDOM) {
+    block_size = block_size_base;
+  }
+  if (block_size != entry->block_size) {
+    resize_block_buffer(entry, block_size);
+  }
+
+  if (!buffered) {
+    return;
+  }
+  off_t block_start = position - position % (off_t)entry->block_size;
+  if (pattern == FEX_ACCESS_SEQUENTIAL) {
+    /* Start reading the next block, and stop huge streams from pushing
+     * everything else out of the page cache */
+    posix_fadvise(entry->source_fd,
+                  entry->source_offset + block_start + entry->block_size,
+                  entry->block_size, POSIX_FADV_WILLNEED);
+    if ((size_t)entry->original_size >= large_file_threshold &&
+        block_start >= (off_t)entry->block_size) {
+      posix_fadvise(entry->source_fd,
+                    entry->source_offset + block_start - entry->block_size,
+                    entry->block_size, POSIX_FADV_DONTNEED);
+    }
+  } else if (pattern == FEX_ACCESS_STRIDED && position + delta >= 0) {
+    posix_fadvise(entry->source_fd, entry->source_offset + position + delta,
+                  entry->block_size,
+                  POSIX_FADV_WILLNEED);
+  }
+}
+
+/* Read a block through the O_DIRECT descriptor; returns 0 on success. On
+ * any failure direct I/O is abandoned for the entry. */
+static int read_block_direct(fex_file_entry_t *entry, off_t block_start_pos,
+                             size_t bytes_needed) {
+  block_start_pos += entry->source_offset;
+  if ((block_start_pos | (off_t)entry->block_size) &
+      (FEX_DIRECT_IO_ALIGN - 1)) {
+    return -1;
+  }
+  /* Whole aligned blocks only: the tail read is simply short at EOF */
+  ssize_t n;
+  do {
+    n = pread(entry->direct_fd, entry->buffer, entry->block_size,
+              block_start_pos);
+  } while (n < 0 && errno == EINTR);
+  if (n >= 0 && (size_t)n >= bytes_needed) {
+    return 0;
+  }
+  fex_log("Direct read of %s failed, using buffered reads\n",
+          entry->original_filename);
+  orig_close(entry->direct_fd);
+  entry->direct_fd = -1;
+  return -1;
+}
+
+/* ========== RENDERED CHUNK CACHE ========== */
+
+/* Rendered data of one chunk of a source, shared by every entry open on
+ * the same file. Keyed by identity and format, not by descriptor or path,
+ * so reopening a .fex or seeking back over it is a memcpy(). */
+typedef struct render_chunk {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime; /* Content changes make old chunks unreachable */
+  int format;
+  off_t base;            /* Start of the embedded range in the file */
+  off_t index;           /* Chunk number in source bytes / chunk size */
+  size_t len;            /* Rendered bytes in data */
+  size_t charge;         /* Bytes counted against the budget: the buffer */
+  size_t bucket;
+  unsigned char *data;
+  struct render_chunk *hash_next;
+  struct render_chunk *lru_prev; /* Most recently used at the head */
+  struct render_chunk *lru_next;
+} render_chunk_t;
+
+static render_chunk_t **render_cache_buckets = NULL;
+static size_t render_cache_bucket_count = 0;
+static render_chunk_t *render_cache_lru_head = NULL;
+static render_chunk_t *render_cache_lru_tail = NULL;
+static size_t render_cache_bytes = 0;
+static size_t render_cache_chunks = 0;
+static uint64_t render_cache_hits = 0;
+static uint64_t render_cache_misses = 0;
+static uint64_t render_cache_evictions = 0;
+static uint64_t render_cache_hit_ns = 0;  /* Time copying hit chunks */
+static uint64_t render_cache_miss_ns = 0; /* Time rendering missed chunks */
+static uint64_t render_cache_hit_bytes = 0;
+static uint64_t render_cache_miss_bytes = 0;
+static pthread_mutex_t render_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t render_chunk_bucket(const fex_file_entry_t *entry, off_t index) {
+  uint64_t h = (uint64_t)entry->st_ino * 0x9e3779b97f4a7c15ull;
+  h ^= (uint64_t)entry->st_dev + ((uint64_t)index << 8) + entry->format +
+       (uint64_t)entry->source_offset * 31;
+  h *= 0xff51afd7ed558ccdull;
+  return (h ^ (h >> 32)) & (render_cache_bucket_count - 1);
+}
+
+static int render_chunk_matches(const render_chunk_t *chunk,
+                                const fex_file_entry_t *entry, off_t index) {
+  return chunk->index == index && chunk->ino == entry->st_ino &&
+         chunk->base == entry->source_offset &&
+         chunk->dev == entry->st_dev && chunk->format == entry->format &&
+         chunk->mtime.tv_sec == entry->st_mtim.tv_sec &&
+         chunk->mtime.tv_nsec == entry->st_mtim.tv_nsec;
+}
+
+static void render_chunk_unlink_lru(render_chunk_t *chunk) {
+  if (chunk->lru_prev)
+    chunk->lru_prev->lru_next = chunk->lru_next;
+  else
+    render_cache_lru_head = chunk->lru_next;
+  if (chunk->lru_next)
+    chunk->lru_next->lru_prev = chunk->lru_prev;
+  else
+    render_cache_lru_tail = chunk->lru_prev;
+}
+
+static void render_chunk_push_lru(render_chunk_t *chunk) {
+  chunk->lru_prev = NULL;
+  chunk->lru_next = render_cache_lru_head;
+  if (render_cache_lru_head)
+    render_cache_lru_head->lru_prev = chunk;
+  render_cache_lru_head = chunk;
+  if (!render_cache_lru_tail)
+    render_cache_lru_tail = chunk;
+}
+
+/* Drop least recently used chunks until 'needed' more bytes fit. Called
+ * with render_cache_mutex held. */
+static void evict_render_chunks(size_t needed) {
+  while (render_cache_lru_tail &&
+         render_cache_bytes + needed > render_cache_budget) {
+    render_chunk_t *victim = render_cache_lru_tail;
+    render_chunk_unlink_lru(victim);
+    render_chunk_t **link = &render_cache_buckets[victim->bucket];
+    while (*link != victim)
+      link = &(*link)->hash_next;
+    *link = victim->hash_next;
+    render_cache_bytes -= victim->charge;
+    render_cache_chunks--;
+    render_cache_evictions++;
+    fex_buffer_free(victim->data, victim->len);
+    free(victim);
+  }
+}
+
+/* Render chunk 'index' of an entry's data region into dst */
+static int render_chunk(fex_file_entry_t *entry, off_t index,
+                        unsigned char *dst, size_t source_len) {
+  off_t source_start = index * (off_t)render_chunk_size;
+  unsigned char *scratch = fex_buffer_alloc(source_len);
+  if (!scratch ||
+      read_source_at(entry->source_fd, scratch, source_len,
+                     entry->source_offset + source_start)) {
+    fex_buffer_free(scratch, source_len);
+    return -1;
+  }
+  render_data_span(scratch, source_start * FEX_HEX_WIDTH, dst,
+                   source_len * FEX_HEX_WIDTH);
+  fex_buffer_free(scratch, source_len);
+  return 0;
+}
+
+/* Copy up to 'len' rendered data bytes at data_offset from the chunk cache,
+ * rendering and inserting the chunk on a miss. Returns bytes copied, or 0
+ * when the cache cannot serve the request. */
+static size_t read_rendered_chunk(fex_file_entry_t *entry, off_t data_offset,
+                                  unsigned char *dst, size_t len) {
+  off_t real_position = data_offset / FEX_HEX_WIDTH;
+  off_t index = real_position / (off_t)render_chunk_size;
+  size_t source_len =
+      MIN(render_chunk_size,
+          (size_t)(entry->original_size - index * (off_t)render_chunk_size));
+  size_t chunk_len = source_len * FEX_HEX_WIDTH;
+  size_t within = data_offset - index * (off_t)render_chunk_size * FEX_HEX_WIDTH;
+  size_t n = MIN(len, chunk_len - within);
+  size_t charge = fex_buffer_bytes(chunk_len);
+  if (charge > render_cache_budget)
+    return 0;
+
+  uint64_t start = monotonic_ns();
+  pthread_mutex_lock(&render_cache_mutex);
+  if (!render_cache_buckets) {
+    /* Two buckets per chunk the budget can hold */
+    size_t chunk_bytes = fex_buffer_bytes(render_chunk_size * FEX_HEX_WIDTH);
+    size_t want = render_cache_budget / chunk_bytes * 2;
+    render_cache_bucket_count = 16;
+    while (render_cache_bucket_count < want)
+      render_cache_bucket_count <<= 1;
+    render_cache_buckets =
+        calloc(render_cache_bucket_count, sizeof(render_chunk_t *));
+    if (!render_cache_buckets) {
+      pthread_mutex_unlock(&render_cache_mutex);
+      return 0;
+    }
+  }
+
+  size_t bucket = render_chunk_bucket(entry, index);
+  for (render_chunk_t *chunk = render_cache_buckets[bucket]; chunk;
+       chunk = chunk->hash_next) {
+    if (render_chunk_matches(chunk, entry, index)) {
+      memcpy(dst, chunk->data + within, n);
+      render_chunk_unlink_lru(chunk);
+      render_chunk_push_lru(chunk);
+      render_cache_hits++;
+      render_cache_hit_bytes += n;
+      render_cache_hit_ns += monotonic_ns() - start;
+      pthread_mutex_unlock(&render_cache_mutex);
+      return n;
+    }
+  }
+  render_cache_misses++;
+  pthread_mutex_unlock(&render_cache_mutex);
+
+  /* Render outside the lock; a racing miss on the same chunk just wastes
+   * one render, the first insert wins */
+  render_chunk_t *chunk = malloc(sizeof(*chunk));
+  unsigned char *data = chunk ? fex_buffer_alloc(chunk_len) : NULL;
+  if (!data || render_chunk(entry, index, data, source_len) != 0) {
+    fex_buffer_free(data, chunk_len);
+    free(chunk);
+    return 0;
+  }
+  memcpy(dst, data + within, n);
+  *chunk = (render_chunk_t){.dev = entry->st_dev,
+                            .ino = entry->st_ino,
+                            .mtime = entry->st_mtim,
+                            .format = entry->format,
+                            .base = entry->source_offset,
+                            .index = index,
+                            .len = chunk_len,
+                            .charge = charge,
+                            .bucket = bucket,
+                            .data = data};
+
+  pthread_mutex_lock(&render_cache_mutex);
+  render_cache_miss_bytes += n;
+  render_cache_miss_ns += monotonic_ns() - start;
+  for (render_chunk_t *other = render_cache_buckets[bucket]; other;
+       other = other->hash_next) {
+    if (render_chunk_matches(other, entry, index)) {
+      pthread_mutex_unlock(&render_cache_mutex);
+      fex_buffer_free(data, chunk_len);
+      free(chunk);
+      return n;
+    }
+  }
+  evict_render_chunks(charge);
+  chunk->hash_next = render_cache_buckets[bucket];
+  render_cache_buckets[bucket] = chunk;
+  render_chunk_push_lru(chunk);
+  render_cache_bytes += charge;
+  render_cache_chunks++;
+  pthread_mutex_unlock(&render_cache_mutex);
+  return n;
+}
+
+/* Print status of all tracked .fex files */
+void print_fex_files_status(void) {
+  pthread_mutex_lock(&fex_files_mutex);
+
+  fex_log("=== Currently tracked .fex files ===\n");
+  fex_file_entry_t *current = fex_files_head;
+  int count = 0;
+
+  while (current) {
+    fex_log("  [%d] %s (fd=%d, fp=%p, original_size=%ld, simulated_size=%ld)\n",
+            ++count, current->original_filename, current->fd, current->fp,
+            current->original_size, current->simulated_size);
+    fex_log("      Buffer: %p (block_size=%zu, current_block=%ld, "
+            "materialized=%d, access=%s%s)\n",
+            current->buffer, current->block_size, current->current_block,
+            atomic_load(&current->materialized),
+            access_pattern_name(current->access_pattern),
+            current->direct_fd >= 0 ? ", O_DIRECT" : "");
+    if (current->header_string) {
+      fex_log("      Header: %s\n", current->header_string);
+    }
+    if (current->footer_string) {
+      fex_log("      Footer: %s\n", current->footer_string);
+    }
+    current = current->next;
+  }
+
+  if (count == 0) {
+    fex_log("  No .fex files currently tracked\n");
+  }
+  fex_log("Entries: %lu tracked, %lu materialized by a read\n",
+          atomic_load(&fex_entries_tracked),
+          atomic_load(&fex_entries_materialized));
+  fex_log("Sparse: %lu source bytes rendered from holes without I/O\n",
+          atomic_load(&fex_hole_bytes));
+  fex_log("Tiers: small < %zu bytes: %lu, medium: %lu, "
+          "large >= %zu bytes: %lu\n",
+          small_file_threshold, atomic_load(&fex_tier_entries[FEX_TIER_SMALL]),
+          atomic_load(&fex_tier_entries[FEX_TIER_MEDIUM]),
+          large_file_threshold,
+          atomic_load(&fex_tier_entries[FEX_TIER_LARGE]));
+  pthread_mutex_lock(&fex_buffer_mutex);
+  fex_log("Memory: %zu bytes of entry slabs, %lu buffers allocated, %lu "
+          "reused, %zu/%zu bytes pooled\n",
+          fex_slab_bytes, fex_buffer_allocations, fex_buffer_reuses,
+          fex_buffer_pooled_bytes, buffer_pool_budget);
+  pthread_mutex_unlock(&fex_buffer_mutex);
+  if (render_cache_budget) {
+    pthread_mutex_lock(&render_cache_mutex);
+    fex_log("Render cache: %zu/%zu bytes in %zu chunks, hits=%lu, misses=%lu, "
+            "evictions=%lu\n",
+            render_cache_bytes, render_cache_budget, render_cache_chunks,
+            render_cache_hits, render_cache_misses, render_cache_evictions);
+    fex_log("Render cache cost: hits %.2f ns/KB, misses %.2f ns/KB\n",
+            render_cache_hit_bytes
+                ? render_cache_hit_ns * 1024.0 / render_cache_hit_bytes
+                : 0.0,
+            render_cache_miss_bytes
+                ? render_cache_miss_ns * 1024.0 / render_cache_miss_bytes
+                : 0.0);
+    pthread_mutex_unlock(&render_cache_mutex);
+  }
+  if (manifest_path) {
+    fex_log("Manifest: %zu sources loaded, %lu prefetched, %lu recorded\n",
+            manifest_loaded, atomic_load(&manifest_prefetched),
+            manifest_recorded);
+  }
+  pthread_mutex_lock(&path_cache_mutex);
+  fex_log("Path cache: %zu/%zu entries, hits=%lu, misses=%lu, "
+          "evictions=%lu\n",
+          path_cache_used, path_cache_capacity, path_cache_hits,
+          path_cache_misses, path_cache_evictions);
+  pthread_mutex_unlock(&path_cache_mutex);
+  fex_log("=== End of .fex files status ===\n");
+
+  pthread_mutex_unlock(&fex_files_mutex);
+}
+
+/* Load specific block into buffer */
+size_t load_block_into_buffer(fex_file_entry_t *entry, off_t block_number) {
+  if (!entry || entry->source_fd < 0 || !entry->buffer) {
+    return -1;
+  }
+
+  off_t block_start_pos = block_number * entry->block_size;
+  if (block_start_pos >= entry->original_size) {
+    return -1;
+  }
+
+  /* Read the block with pread(): the tracked descriptor is the source, and
+   * its file offset is simulated, so it is never disturbed */
+  size_t bytes_read =
+      MIN(entry->block_size, (size_t)(entry->original_size - block_start_pos));
+  if ((entry->direct_fd < 0 ||
+       read_block_direct(entry, block_start_pos, bytes_read) != 0) &&
+      read_source_at(entry->source_fd, entry->buffer, bytes_read,
+                     entry->source_offset + block_start_pos) != 0) {
+    fex_log("Failed to read block %ld at position %ld of original file %s\n",
+            block_number, block_start_pos, entry->original_filename);
+    return -1;
+  }
+
+  /* Update tracking information */
+  entry->current_block = block_number;
+  entry->next_expected = block_start_pos + bytes_read;
+
+  fex_log("Loaded block %ld (%zu bytes) from position %ld for .fex file %s\n",
+          block_number, bytes_read, block_start_pos, entry->original_filename);
+  return bytes_read;
+}
+
+/* Initialize buffer for .fex file entry */
+void initialize_fex_buffer(fex_file_entry_t *entry) {
+  if (!entry) {
+    return;
+  }
+
+  /* Start at the configured block size (4KB default) */
+  entry->block_size = block_size_base;
+
+  /* Take a recycled, page-aligned buffer from the pool */
+  entry->buffer = fex_buffer_alloc(entry->block_size);
+  if (!entry->buffer) {
+    fex_log("Failed to allocate buffer of size %zu for .fex file %s\n",
+            entry->block_size, entry->original_filename);
+    return;
+  }
+
+  fex_log("Initialized buffer for .fex file %s: block_size=%zu, "
+          "current_block=%ld\n",
+          entry->original_filename, entry->block_size, entry->current_block);
+}
+
+/* Free buffer for .fex file entry */
+void free_fex_buffer(fex_file_entry_t *entry) {
+  if (!entry) {
+    return;
+  }
+
+  if (entry->buffer) {
+    fex_log("Freeing buffer for .fex file %s\n", entry->original_filename);
+    fex_buffer_free(entry->buffer, entry->block_size);
+    entry->buffer = NULL;
+  }
+
+  if (entry->direct_fd >= 0) {
+    orig_close(entry->direct_fd);
+    entry->direct_fd = -1;
+  }
+
+  /* Close the rendered copy made for mmap() */
+  if (entry->rendered_fd >= 0) {
+    orig_close(entry->rendered_fd);
+    entry->rendered_fd = -1;
+  }
+
+  entry->block_size = 0;
+}
+
+/* Small tier: render the whole file once so reads become memcpy() */
+static int render_small_entry(fex_file_entry_t *entry) {
+  unsigned char *rendered = fex_buffer_alloc(entry->simulated_size);
+  if (!rendered) {
+    return -1;
+  }
+  if (fex_render_range(entry, entry->source_fd, 0, rendered,
+                       entry->simulated_size) != 0) {
+    fex_buffer_free(rendered, entry->simulated_size);
+    return -1;
+  }
+  entry->buffer = rendered;
+  entry->block_size = entry->simulated_size;
+  fex_log("Rendered small .fex file %s into %ld contiguous bytes\n",
+          entry->original_filename, entry->simulated_size);
+  return 0;
+}
+
+/* Huge sources stream through the block cache with O_DIRECT instead of
+ * being mapped, so they do not evict the rest of the page cache */
+static int open_direct_source(fex_file_entry_t *entry) {
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", entry->source_fd);
+  entry->direct_fd = orig_open(proc_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+  if (entry->direct_fd < 0) {
+    fex_log("O_DIRECT unavailable for .fex file %s\n",
+            entry->original_filename);
+    return -1;
+  }
+  fex_log("Reading .fex file %s with O_DIRECT\n", entry->original_filename);
+  return 0;
+}
+
+/* Large tier: no block cache, each read renders its range straight from
+ * pread() into a pooled buffer. The source is not mapped: a file truncated
+ * while mapped would raise SIGBUS in the host, where pread() just comes up
+ * short and the rest renders as zeros. */
+static void stream_large_entry(fex_file_entry_t *entry) {
+  posix_fadvise(entry->source_fd, entry->source_offset, entry->original_size,
+                POSIX_FADV_SEQUENTIAL);
+  fex_log("Streaming large .fex file %s (%ld bytes)\n",
+          entry->original_filename, entry->original_size);
+}
+
+/* Build the read state of an entry on first use, according to its size
+ * tier. Opening, closing and fstat() of a .fex never get here. */
+static int materialize_fex_entry(fex_file_entry_t *entry) {
+  int state = atomic_load_explicit(&entry->materialized, memory_order_acquire);
+  if (state)
+    return state > 0 ? 0 : -1;
+
+  pthread_mutex_lock(&fex_materialize_mutex);
+  state = atomic_load_explicit(&entry->materialized, memory_order_relaxed);
+  if (!state) {
+    if (entry->tier == FEX_TIER_LARGE && direct_io_threshold &&
+        (size_t)entry->original_size >= direct_io_threshold &&
+        open_direct_source(entry) == 0) {
+      entry->tier = FEX_TIER_MEDIUM;
+    }
+    /* A tier that cannot be set up degrades to the block cache */
+    if (entry->tier == FEX_TIER_SMALL && render_small_entry(entry) != 0) {
+      entry->tier = FEX_TIER_MEDIUM;
+    }
+    if (entry->tier == FEX_TIER_LARGE) {
+      stream_large_entry(entry);
+    }
+    if (entry->tier == FEX_TIER_MEDIUM) {
+      initialize_fex_buffer(entry);
+    }
+    state = (entry->buffer || entry->tier == FEX_TIER_LARGE) ? 1 : -1;
+    atomic_fetch_add(&fex_tier_entries[entry->tier], 1);
+    atomic_store_explicit(&entry->materialized, state, memory_order_release);
+    atomic_fetch_add(&fex_entries_materialized, 1);
+  }
+  pthread_mutex_unlock(&fex_materialize_mutex);
+  return state > 0 ? 0 : -1;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Rendered copy of an entry backing mmap() of its descriptor */
+static int get_rendered_fd(fex_file_entry_t *entry) {
+  pthread_mutex_lock(&fex_materialize_mutex);
+  if (entry->rendered_fd < 0) {
+    entry->rendered_fd = render_to_anonymous_file(entry, entry->source_fd);
+    fex_log("Rendered %s for mmap() into fd %d\n", entry->original_filename,
+            entry->rendered_fd);
+  }
+  int rendered_fd = entry->rendered_fd;
+  pthread_mutex_unlock(&fex_materialize_mutex);
+  return rendered_fd;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+size_t read_bytes_from_buffer(fex_file_entry_t *entry, unsigned char *buffer,
+                              size_t size) {
+  if (!entry || !entry->header_string || !entry->footer_string) {
+    return 0;
+  }
+  if (entry->simulated_position >= entry->simulated_size) {
+    return 0;
+  }
+
+  size_t bytes_read = 0;
+  off_t start_position = entry->simulated_position;
+  source_extent_t extent = {0, 0, 0};
+  size = MIN(size, (size_t)(entry->simulated_size - entry->simulated_position));
+
+  /* Bundles render exactly the range asked for */
+  if (entry->bundle) {
+    if (fex_render_range(entry, -1, start_position, buffer, size) != 0)
+      return 0;
+    entry->simulated_position += size;
+    return size;
+  }
+
+  /* Large requests bypass the block buffer and render in parallel */
+  if (entry->tier != FEX_TIER_SMALL && parallel_threshold &&
+      size >= parallel_threshold &&
+      fex_render_range(entry, entry->source_fd, entry->simulated_position,
+                       buffer, size) == 0) {
+    entry->simulated_position += size;
+    fex_log("read_bytes_from_buffer() rendered %zu bytes at %ld directly for "
+            ".fex file %s\n",
+            size, start_position, entry->original_filename);
+    return size;
+  }
+
+  while (size) {
+    size_t added = 0;
+
+    /* Use pre-calculated values from the structure */
+    if (entry->simulated_position < entry->header_len) {
+      added = MIN(size, entry->header_len - entry->simulated_position);
+      memcpy(buffer, entry->header_string + entry->simulated_position, added);
+    } else if (entry->simulated_position < entry->footer_start) {
+      size_t data_left = entry->footer_start - entry->simulated_position;
+      /* Simple override mode - just fill with '!' characters */
+      if (simple_override) {
+        added = MIN(size, data_left);
+        memset(buffer, '!', added);
+      } else { /* Calculate the real position in the original file */
+        off_t data_offset = entry->simulated_position - entry->header_len;
+        off_t real_position = data_offset / FEX_HEX_WIDTH;
+        if (materialize_fex_entry(entry) != 0) {
+          break;
+        }
+        if (entry->tier == FEX_TIER_SMALL) {
+          /* Everything from here to EOF is already rendered */
+          added = MIN(size, (size_t)(entry->simulated_size -
+                                     entry->simulated_position));
+          memcpy(buffer, entry->buffer + entry->simulated_position, added);
+          goto advance;
+        }
+        /* Holes in the source render as zeros without any I/O */
+        find_source_extent(entry, entry->source_fd, real_position, &extent);
+        if (extent.hole) {
+          added = MIN(MIN(size, data_left),
+                      (size_t)(extent.end * FEX_HEX_WIDTH - data_offset));
+          render_zero_span(data_offset, buffer, added);
+          atomic_fetch_add(&fex_hole_bytes, added / FEX_HEX_WIDTH);
+          goto advance;
+        }
+        if (render_cache_budget &&
+            (added = read_rendered_chunk(entry, data_offset, buffer,
+                                         MIN(size, data_left))) > 0) {
+          goto advance;
+        }
+        if (entry->tier == FEX_TIER_LARGE) {
+          added = MIN(size, data_left);
+          if (fex_render_range(entry, entry->source_fd,
+                               entry->simulated_position, buffer,
+                               added) != 0) {
+            added = 0;
+          }
+          goto advance;
+        }
+        /* Readers sharing the descriptor must not see the buffer swapped
+         * or refilled under them */
+        pthread_mutex_lock(&entry->block_mutex);
+        if (real_position / (off_t)entry->block_size !=
+            entry->current_block) {
+          track_access_pattern(entry, real_position);
+        }
+        off_t block_number = real_position / entry->block_size;
+        /* Load the block if it's not currently loaded */
+        if (block_number != entry->current_block) {
+          if (load_block_into_buffer(entry, block_number) == (size_t)-1) {
+            fex_log("read_bytes_from_buffer() failed to load block %ld for "
+                    ".fex file %s\n",
+                    block_number, entry->original_filename);
+            entry->current_block = -1;
+            pthread_mutex_unlock(&entry->block_mutex);
+            break;
+          }
+        }
+
+        /* Render every element still covered by the loaded block */
+        off_t block_end =
+            MIN((block_number + 1) * (off_t)entry->block_size,
+                entry->original_size);
+        size_t block_left = block_end * FEX_HEX_WIDTH - data_offset;
+        added = MIN(size, MIN(data_left, block_left));
+        render_data_span(entry->buffer + real_position % entry->block_size,
+                         data_offset, buffer, added);
+        pthread_mutex_unlock(&entry->block_mutex);
+      }
+    } else {
+      off_t pos = entry->simulated_position - entry->footer_start;
+      size_t footer_len = strlen(entry->footer_string);
+      if (pos >= footer_len) {
+        added = 0; /* Beyond footer */
+      } else {
+        added = MIN(size, footer_len - pos);
+        memcpy(buffer, entry->footer_string + pos, added);
+      }
+    }
+
+  advance:
+    if (added == 0) {
+      break;
+    }
+
+    buffer += added;
+    entry->simulated_position += added;
+    bytes_read += added;
+    size -= added;
+  }
+
+  /* Remember which source bytes were read, for the prefetch manifest */
+  if (manifest_path && bytes_read) {
+    off_t lo = MAX(start_position, entry->header_len) - entry->header_len;
+    off_t hi = MIN(entry->simulated_position, entry->footer_start) -
+               entry->header_len;
+    if (hi > lo) {
+      if (entry->touched_end <= entry->touched_start) {
+        entry->touched_start = lo / FEX_HEX_WIDTH;
+        entry->touched_end = 0;
+      }
+      entry->touched_start = MIN(entry->touched_start, lo / FEX_HEX_WIDTH);
+      entry->touched_end =
+          MAX(entry->touched_end, (hi + FEX_HEX_WIDTH - 1) / FEX_HEX_WIDTH);
+    }
+  }
+
+  fex_log("read_bytes_from_buffer() read at position %ld, %zu bytes for .fex "
+          "file %s\n",
+          start_position, bytes_read, entry->original_filename);
+
+  return bytes_read;
+}
+
+/* ========== WRITE-PATH DECODING ========== */
+
+/* Where the decoder is relative to the array initializer */
+enum {
+  HEX_SCOPE_SEEK,   /* Before the first '{' or hex literal */
+  HEX_SCOPE_BRACED, /* Inside "{ ... }" of a C initializer */
+  HEX_SCOPE_PLAIN,  /* Bare "0xNN," list without braces */
+  HEX_SCOPE_DONE    /* After the closing '}': footer text is ignored */
+};
+
+/* Lexer state carried across write() boundaries */
+enum {
+  HEX_LEX_SEP,
+  HEX_LEX_IDENT,
+  HEX_LEX_NUMBER,
+  HEX_LEX_ZERO,
+  HEX_LEX_HEX,
+  HEX_LEX_SLASH,
+  HEX_LEX_COMMENT,
+  HEX_LEX_COMMENT_STAR,
+  HEX_LEX_LINE_COMMENT
+};
+
+/* Streaming C initializer decoder bound to the fd receiving the binary */
+typedef struct fex_hex_decoder {
+  int out_fd;
+  int scope;
+  int lex;
+  int digits;
+  unsigned int value;
+  int error;
+  off_t text_position; /* Text bytes accepted so far */
+  size_t out_len;
+  unsigned char out[FEX_DECODE_BUFFER_SIZE];
+} fex_hex_decoder_t;
+
+/* Decoders for .fex files opened for writing with open()/openat(). A
+ * writer is referenced by the list and by each write() in flight; its lock
+ * serializes feeding the decoder. Decoding follows the fd number only: a
+ * descriptor made by dup(), dup2() or fcntl() is written undecoded, except
+ * for an inherited stdout, which is tracked at startup (see
+ * track_inherited_fex_writer()). */
+typedef struct fex_writer {
+  int fd;
+  fex_hex_decoder_t *decoder;
+  pthread_mutex_t lock;
+  int refs;     /* Protected by fex_writers_mutex */
+  int finished; /* Decoder flushed by close(); further writes fail */
+  struct fex_writer *next;
+} fex_writer_t;
+
+static fex_writer_t *fex_writers_head = NULL;
+static pthread_mutex_t fex_writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(int) fex_writer_count = 0;
+
+/* Hex digit values; 0xff marks a non-hex character */
+static unsigned char hex_digit_value[256];
+
+static void init_hex_digit_values(void) {
+  memset(hex_digit_value, 0xff, sizeof(hex_digit_value));
+  for (int c = '0'; c <= '9'; c++)
+    hex_digit_value[c] = c - '0';
+  for (int c = 'a'; c <= 'f'; c++)
+    hex_digit_value[c] = c - 'a' + 10;
+  for (int c = 'A'; c <= 'F'; c++)
+    hex_digit_value[c] = c - 'A' + 10;
+}
+
+#ifndef FEX_NO_INTERPOSE
+static int is_ident_char(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+static int is_space_char(unsigned char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+#endif /* FEX_NO_INTERPOSE */
+
+static int write_all(int fd, const unsigned char *buf, size_t count) {
+  while (count) {
+    ssize_t n = orig_write(fd, buf, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    count -= n;
+  }
+  return 0;
+}
+
+static int hex_decoder_flush(fex_hex_decoder_t *d) {
+  if (d->out_len && write_all(d->out_fd, d->out, d->out_len) != 0) {
+    d->error = errno;
+    return -1;
+  }
+  d->out_len = 0;
+  return 0;
+}
+
+static int hex_decoder_emit(fex_hex_decoder_t *d, unsigned char byte) {
+  if (d->out_len == sizeof(d->out) && hex_decoder_flush(d) != 0)
+    return -1;
+  d->out[d->out_len++] = byte;
+  return 0;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Decode a run of canonical "0xNN," fields each followed by one whitespace
+ * character, as emitted by the renderer and by xxd -i. Returns the number of
+ * text bytes consumed; the caller's lexer is left between tokens. */
+static size_t hex_decode_fast(fex_hex_decoder_t *d, const unsigned char *p,
+                              size_t n) {
+  size_t i = 0;
+  while (n - i >= FEX_HEX_WIDTH) {
+    const unsigned char *f = p + i;
+    unsigned char hi = hex_digit_value[f[2]];
+    unsigned char lo = hex_digit_value[f[3]];
+    if (f[0] != '0' || (f[1] | 0x20) != 'x' || f[4] != ',' ||
+        (hi | lo) > 0x0f || !is_space_char(f[5])) {
+      break;
+    }
+    if (d->out_len == sizeof(d->out) && hex_decoder_flush(d) != 0)
+      break;
+    d->out[d->out_len++] = (unsigned char)(hi << 4 | lo);
+    i += FEX_HEX_WIDTH;
+  }
+  if (i && d->scope == HEX_SCOPE_SEEK)
+    d->scope = HEX_SCOPE_PLAIN;
+  return i;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* End of a hex literal: emit it unless we are past the initializer */
+static void hex_decoder_end_literal(fex_hex_decoder_t *d) {
+  if (d->scope == HEX_SCOPE_DONE)
+    return;
+  if (d->digits == 0 || d->digits > 2) {
+    d->error = EILSEQ;
+    return;
+  }
+  if (d->scope == HEX_SCOPE_SEEK)
+    d->scope = HEX_SCOPE_PLAIN;
+  hex_decoder_emit(d, (unsigned char)d->value);
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Feed C initializer text to the decoder */
+static int hex_decoder_feed(fex_hex_decoder_t *d, const unsigned char *p,
+                            size_t n) {
+  size_t i = 0;
+  while (i < n && !d->error) {
+    if (d->lex == HEX_LEX_SEP && d->scope != HEX_SCOPE_DONE) {
+      i += hex_decode_fast(d, p + i, n - i);
+      if (i == n || d->error)
+        break;
+    }
+
+    unsigned char c = p[i++];
+    switch (d->lex) {
+    case HEX_LEX_SEP:
+      if (c == '/') {
+        d->lex = HEX_LEX_SLASH;
+      } else if (c == '0') {
+        d->lex = HEX_LEX_ZERO;
+      } else if (c >= '1' && c <= '9') {
+        d->lex = HEX_LEX_NUMBER;
+      } else if (is_ident_char(c)) {
+        d->lex = HEX_LEX_IDENT;
+      } else if (c == '{' && d->scope == HEX_SCOPE_SEEK) {
+        d->scope = HEX_SCOPE_BRACED;
+      } else if (c == '}' && d->scope == HEX_SCOPE_BRACED) {
+        d->scope = HEX_SCOPE_DONE;
+      }
+      break;
+    case HEX_LEX_IDENT:
+      if (!is_ident_char(c)) {
+        d->lex = HEX_LEX_SEP;
+        i--;
+      }
+      break;
+    case HEX_LEX_ZERO:
+      if (c == 'x' || c == 'X') {
+        d->lex = HEX_LEX_HEX;
+        d->digits = 0;
+        d->value = 0;
+        break;
+      }
+      d->lex = HEX_LEX_NUMBER;
+      /* fall through */
+    case HEX_LEX_NUMBER:
+      if (!is_ident_char(c)) {
+        /* Only hex literals are data; decimals are fine outside the array */
+        if (d->scope == HEX_SCOPE_BRACED || d->scope == HEX_SCOPE_PLAIN) {
+          d->error = EILSEQ;
+        }
+        d->lex = HEX_LEX_SEP;
+        i--;
+      }
+      break;
+    case HEX_LEX_HEX:
+      if (hex_digit_value[c] <= 0x0f) {
+        d->value = (d->value << 4) | hex_digit_value[c];
+        d->digits++;
+      } else if (is_ident_char(c)) {
+        d->digits = 3; /* Suffixes and stray letters make it invalid */
+      } else {
+        hex_decoder_end_literal(d);
+        d->lex = HEX_LEX_SEP;
+        i--;
+      }
+      break;
+    case HEX_LEX_SLASH:
+      if (c == '*') {
+        d->lex = HEX_LEX_COMMENT;
+      } else if (c == '/') {
+        d->lex = HEX_LEX_LINE_COMMENT;
+      } else {
+        d->lex = HEX_LEX_SEP;
+        i--;
+      }
+      break;
+    case HEX_LEX_COMMENT:
+      if (c == '*')
+        d->lex = HEX_LEX_COMMENT_STAR;
+      break;
+    case HEX_LEX_COMMENT_STAR:
+      if (c == '/')
+        d->lex = HEX_LEX_SEP;
+      else if (c != '*')
+        d->lex = HEX_LEX_COMMENT;
+      break;
+    case HEX_LEX_LINE_COMMENT:
+      if (c == '\n')
+        d->lex = HEX_LEX_SEP;
+      break;
+    }
+  }
+
+  if (d->error) {
+    errno = d->error;
+    return -1;
+  }
+  d->text_position += n;
+  return 0;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* Complete a literal cut off by end of input and flush decoded bytes */
+static int hex_decoder_finish(fex_hex_decoder_t *d) {
+  if (!d->error && d->lex == HEX_LEX_HEX) {
+    hex_decoder_end_literal(d);
+  }
+  d->lex = HEX_LEX_SEP;
+  if (!d->error) {
+    hex_decoder_flush(d);
+  }
+  if (d->error) {
+    errno = d->error;
+    return -1;
+  }
+  return 0;
+}
+
+static fex_hex_decoder_t *create_hex_decoder(int out_fd) {
+  fex_hex_decoder_t *d = malloc(sizeof(fex_hex_decoder_t));
+  if (!d)
+    return NULL;
+  d->out_fd = out_fd;
+  d->scope = HEX_SCOPE_SEEK;
+  d->lex = HEX_LEX_SEP;
+  d->digits = 0;
+  d->value = 0;
+  d->error = 0;
+  d->text_position = 0;
+  d->out_len = 0;
+  return d;
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Should a .fex open with these flags decode written text? */
+static int is_fex_decode_open(const char *pathname, int flags) {
+  return write_decode && (flags & O_ACCMODE) == O_WRONLY &&
+         should_process_as_fex(pathname);
+}
+#endif /* FEX_NO_INTERPOSE */
+
+/* Start decoding writes to a .fex file descriptor */
+void track_fex_writer_fd(int fd, const char *pathname) {
+  fex_writer_t *writer = malloc(sizeof(fex_writer_t));
+  if (!writer)
+    return;
+  writer->fd = fd;
+  writer->decoder = create_hex_decoder(fd);
+  if (!writer->decoder) {
+    free(writer);
+    return;
+  }
+  pthread_mutex_init(&writer->lock, NULL);
+  writer->refs = 1;
+  writer->finished = 0;
+
+  pthread_mutex_lock(&fex_writers_mutex);
+  writer->next = fex_writers_head;
+  fex_writers_head = writer;
+  atomic_fetch_add(&fex_writer_count, 1);
+  pthread_mutex_unlock(&fex_writers_mutex);
+
+  fex_log("Decoding writes to .fex file: fd=%d, filename=%s\n", fd, pathname);
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Find the writer of an fd and take a reference on it */
+static fex_writer_t *acquire_fex_writer(int fd) {
+  if (atomic_load_explicit(&fex_writer_count, memory_order_relaxed) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&fex_writers_mutex);
+  fex_writer_t *current = fex_writers_head;
+  while (current && current->fd != fd) {
+    current = current->next;
+  }
+  if (current)
+    current->refs++;
+  pthread_mutex_unlock(&fex_writers_mutex);
+  return current;
+}
+#endif /* FEX_NO_INTERPOSE */
+
+static void release_fex_writer(fex_writer_t *writer) {
+  pthread_mutex_lock(&fex_writers_mutex);
+  int last = --writer->refs == 0;
+  pthread_mutex_unlock(&fex_writers_mutex);
+  if (last) {
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->decoder);
+    free(writer);
+  }
+}
+
+#ifndef FEX_NO_INTERPOSE
+/* Feed text written to a tracked fd to its decoder; flush writes the
+ * decoded bytes out at once instead of when the buffer fills */
+static int feed_fex_writer(fex_writer_t *writer, const void *buf,
+                           size_t count, int flush) {
+  pthread_mutex_lock(&writer->lock);
+  int result;
+  if (writer->finished) {
+    errno = EBADF;
+    result = -1;
+  } else {
+    result = hex_decoder_feed(writer->decoder, buf, count);
+    if (result == 0 && flush && hex_decoder_flush(writer->decoder) != 0) {
+      errno = writer->decoder->error;
+      result = -1;
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return result;
+}
+#endif /* FEX_NO_INTERPOSE */
 
-  fex_file_entry_t **current = &fex_files_head;
+/* Stop decoding for an fd, flushing pending bytes; returns -1 if any decode
+ * or write error was recorded */
+int untrack_fex_writer_fd(int fd) {
+  if (atomic_load_explicit(&fex_writer_count, memory_order_relaxed) == 0)
+    return 0;
+
+  fex_writer_t *writer = NULL;
+  pthread_mutex_lock(&fex_writers_mutex);
+  fex_writer_t **current = &fex_writers_head;
   while (*current) {
-    fex_file_entry_t *entry = *current;
-    if (entry->fp == fp) {
-      *current = entry->next;
-      fex_log("Untracking .fex file: fp=%p, filename=%s\n", entry->fp,
-              entry->original_filename);
-      free_fex_buffer(entry);
-      free(entry->original_filename);
-      free(entry->header_string);
-      free(entry->footer_string);
-      free(entry);
+    if ((*current)->fd == fd) {
+      writer = *current;
+      *current = writer->next;
+      atomic_fetch_sub(&fex_writer_count, 1);
       break;
-    } else {
-      current = &(entry->next);
     }
+    current = &(*current)->next;
   }
+  pthread_mutex_unlock(&fex_writers_mutex);
 
-  pthread_mutex_unlock(&fex_files_mutex);
+  if (!writer)
+    return 0;
+
+  /* Writes still in flight finish first; later ones see the writer done */
+  pthread_mutex_lock(&writer->lock);
+  int result = hex_decoder_finish(writer->decoder);
+  int saved_errno = errno;
+  writer->finished = 1;
+  fex_log("Finished decoding .fex writes: fd=%d, text=%ld bytes, result=%d\n",
+          fd, writer->decoder->text_position, result);
+  pthread_mutex_unlock(&writer->lock);
+  release_fex_writer(writer);
+  errno = saved_errno;
+  return result;
 }
 
-/* Print status of all tracked .fex files */
-void print_fex_files_status(void) {
-  pthread_mutex_lock(&fex_files_mutex);
+#ifndef FEX_NO_INTERPOSE
+/* Flush the decoded bytes of every tracked fd at exit, for programs that
+ * exit without closing what they wrote */
+static void flush_fex_writers(void) {
+  pthread_mutex_lock(&fex_writers_mutex);
+  for (fex_writer_t *w = fex_writers_head; w; w = w->next) {
+    pthread_mutex_lock(&w->lock);
+    if (!w->finished)
+      hex_decoder_flush(w->decoder);
+    pthread_mutex_unlock(&w->lock);
+  }
+  pthread_mutex_unlock(&fex_writers_mutex);
+}
 
-  fex_log("=== Currently tracked .fex files ===\n");
-  fex_file_entry_t *current = fex_files_head;
-  int count = 0;
+/* fopencookie() callbacks for .fex streams opened for writing */
+static ssize_t fex_writer_cookie_write(void *cookie, const char *buf,
+                                       size_t size) {
+  if (hex_decoder_feed(cookie, (const unsigned char *)buf, size) != 0)
+    return 0;
+  return size;
+}
 
-  while (current) {
-    fex_log("  [%d] %s (fd=%d, fp=%p, original_size=%ld, simulated_size=%ld)\n",
-            ++count, current->original_filename, current->fd, current->fp,
-            current->original_size, current->simulated_size);
-    fex_log("      Buffer: %p (block_size=%zu, current_block=%ld)\n",
-            current->buffer, current->block_size, current->current_block);
-    if (current->header_string) {
-      fex_log("      Header: %s\n", current->header_string);
-    }
-    if (current->footer_string) {
-      fex_log("      Footer: %s\n", current->footer_string);
-    }
-    current = current->next;
+static int fex_writer_cookie_close(void *cookie) {
+  fex_hex_decoder_t *d = cookie;
+  int result = hex_decoder_finish(d);
+  if (orig_close(d->out_fd) != 0)
+    result = -1;
+  free(d);
+  return result;
+}
+
+/* Open a .fex stream whose written C text is stored as binary */
+static FILE *open_fex_writer_stream(const char *pathname, const char *mode) {
+  int flags = O_WRONLY | O_CREAT;
+  flags |= (mode[0] == 'a') ? O_APPEND : O_TRUNC;
+  if (strchr(mode, 'x'))
+    flags |= O_EXCL;
+  if (strchr(mode, 'e'))
+    flags |= O_CLOEXEC;
+
+  int fd = orig_open(pathname, flags, 0666);
+  if (fd < 0)
+    return NULL;
+
+  fex_hex_decoder_t *d = create_hex_decoder(fd);
+  if (!d) {
+    orig_close(fd);
+    errno = ENOMEM;
+    return NULL;
   }
 
-  if (count == 0) {
-    fex_log("  No .fex files currently tracked\n");
+  cookie_io_functions_t io = {
+      .read = NULL,
+      .write = fex_writer_cookie_write,
+      .seek = NULL,
+      .close = fex_writer_cookie_close,
+  };
+  FILE *fp = fopencookie(d, mode, io);
+  if (!fp) {
+    orig_close(fd);
+    free(d);
+    return NULL;
   }
-  fex_log("=== End of .fex files status ===\n");
 
-  pthread_mutex_unlock(&fex_files_mutex);
+  fex_log("Decoding writes to .fex stream: fp=%p, fd=%d, filename=%s\n", fp,
+          fd, pathname);
+  return fp;
 }
 
-/* Load specific block into buffer */
-size_t load_block_into_buffer(fex_file_entry_t *entry, off_t block_number) {
-  if (!entry || !entry->original_fp || !entry->buffer) {
-    return -1;
-  }
-
-  off_t block_start_pos = block_number * entry->block_size;
+/* A stdout inherited already open on a .fex for writing, as after the
+ * shell's "cat f.h > f.fex", is decoded like a descriptor opened here:
+ * write() on fd 1 feeds its decoder. The stdout FILE is left alone, and
+ * glibc flushes its buffer without calling write(), so text printed
+ * through stdio is stored as written; such programs fopen() the .fex. */
+static void track_inherited_fex_writer(void) {
+  int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (flags < 0 || (flags & O_ACCMODE) != O_WRONLY)
+    return;
+  char path[PATH_MAX];
+  ssize_t len = readlink("/proc/self/fd/1", path, sizeof(path) - 1);
+  if (len <= 0)
+    return;
+  path[len] = '\0';
+  if (path[0] != '/' || !should_process_as_fex(path))
+    return;
+  track_fex_writer_fd(STDOUT_FILENO, path);
+}
+#endif /* FEX_NO_INTERPOSE */
 
-  /* Seek to the block position in the original file */
-  if (orig_fseek(entry->original_fp, block_start_pos, SEEK_SET) != 0) {
-    fex_log("Failed to seek to block %ld position %ld in original file %s\n",
-            block_number, block_start_pos, entry->original_filename);
-    return -1;
-  }
+/* ========== PUBLIC API ========== */
 
-  /* Read the block into buffer */
-  size_t bytes_read =
-      orig_fread(entry->buffer, 1, entry->block_size, entry->original_fp);
+/* Rendering for tools that link the library instead of preloading it. A
+ * handle is an entry that is never tracked: reads render the requested
+ * range straight from the source with pread(), so they share no position
+ * and may run concurrently. */
 
-  /* Update tracking information */
-  entry->current_block = block_number;
+struct fex_handle {
+  fex_file_entry_t *entry;
+  int fd; /* Descriptor path was opened on, or -1 */
+};
 
-  fex_log("Loaded block %ld (%zu bytes) from position %ld for .fex file %s\n",
-          block_number, bytes_read, block_start_pos, entry->original_filename);
-  fex_log("Bytes: %02x %02x %02x \n", entry->buffer[0] & 255,
-          entry->buffer[1] & 255, entry->buffer[2] & 255);
-  return bytes_read;
-}
+static pthread_once_t fex_api_once = PTHREAD_ONCE_INIT;
 
-/* Initialize buffer for .fex file entry */
-void initialize_fex_buffer(fex_file_entry_t *entry) {
-  if (!entry) {
-    return;
+/* Open path for rendering; NULL with errno set on failure */
+fex_handle_t *fex_open(const char *path, const fex_options_t *opts) {
+  pthread_once(&fex_api_once, fex_init);
+  if (!path ||
+      (opts && (opts->format < 0 || opts->format >= FEX_FORMAT_COUNT))) {
+    errno = EINVAL;
+    return NULL;
   }
+  int format = opts ? opts->format : default_format;
+  const char *name = opts && opts->name ? opts->name : path;
 
-  /* Use a configurable block size (4KB default) */
-  entry->block_size = get_fex_block_size();
-
-  /* Allocate buffer */
-  entry->buffer = malloc(entry->block_size);
-  if (!entry->buffer) {
-    fex_log("Failed to allocate buffer of size %zu for .fex file %s\n",
-            entry->block_size, entry->original_filename);
-    return;
+  fex_handle_t *handle = malloc(sizeof(*handle));
+  if (!handle) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  handle->fd = -1;
+
+  /* A bundle is rendered from its members */
+  if (is_fex_bundle_path(path)) {
+    fex_bundle_t *bundle = get_fex_bundle(path);
+    handle->entry = bundle ? create_fex_entry(name, bundle->size, bundle->size,
+                                              FEX_FORMAT_RAW)
+                           : NULL;
+    if (!handle->entry) {
+      if (bundle)
+        release_fex_bundle(bundle);
+      free(handle);
+      errno = bundle ? ENOMEM : EIO;
+      return NULL;
+    }
+    handle->entry->bundle = bundle;
+    return handle;
   }
 
-  /* Open original file for buffer operations */
-  entry->original_fp = orig_fopen(entry->original_filename, "rb");
-  if (!entry->original_fp) {
-    fex_log("Failed to open original file %s for buffer operations\n",
-            entry->original_filename);
+  /* Real files first, then the virtual paths open() would serve */
+  fex_source_t source;
+  char virtual_name[PATH_MAX];
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0) {
+    if (orig_fstat(fd, &st) != 0) {
+      int error = errno;
+      orig_close(fd);
+      free(handle);
+      errno = error;
+      return NULL;
+    }
+    resolve_fex_source(fd, path, &st, &source);
   } else {
-    fex_log("Keeping original file %s open for buffer operations\n",
-            entry->original_filename);
+    int missing = errno;
+    int virtual_format;
+    if ((missing != ENOENT && missing != ENOTDIR) ||
+        resolve_virtual_path(path, missing, 0, virtual_name, &source,
+                             &virtual_format) != 0) {
+      free(handle);
+      errno = missing;
+      return NULL;
+    }
+    /* A derived suffix names the format; an archive member takes ours */
+    if (strcmp(virtual_name, path) != 0) {
+      format = virtual_format;
+      if (!opts || !opts->name)
+        name = virtual_name;
+    }
+    fd = source.fd;
   }
 
-  fex_log("Initialized buffer for .fex file %s: block_size=%zu, "
-          "current_block=%ld\n",
-          entry->original_filename, entry->block_size, entry->current_block);
+  off_t plain_size = source.length;
+  if (format == FEX_FORMAT_ZLIB && pack_fex_source(fd, &source) != 0) {
+    release_fex_source(fd, &source);
+    orig_close(fd);
+    free(handle);
+    errno = EIO;
+    return NULL;
+  }
+  handle->entry = create_fex_entry(name, source.length, plain_size, format);
+  if (!handle->entry) {
+    release_fex_source(fd, &source);
+    orig_close(fd);
+    free(handle);
+    errno = ENOMEM;
+    return NULL;
+  }
+  set_entry_source(handle->entry, fd, &source);
+  handle->fd = fd;
+  fex_log("API opened %s: %ld bytes\n", path, handle->entry->simulated_size);
+  return handle;
 }
 
-/* Free buffer for .fex file entry */
-void free_fex_buffer(fex_file_entry_t *entry) {
-  if (!entry) {
-    return;
-  }
+/* Size of the rendered file */
+off_t fex_size(const fex_handle_t *handle) {
+  return handle->entry->simulated_size;
+}
 
-  if (entry->buffer) {
-    fex_log("Freeing buffer for .fex file %s\n", entry->original_filename);
-    free(entry->buffer);
-    entry->buffer = NULL;
+/* stat() of the file holding the bytes path embeds: path itself, a
+ * pointer manifest's target, or the archive of a member. Nothing is
+ * rendered or inflated. */
+int fex_source_stat(const char *path, struct stat *st) {
+  pthread_once(&fex_api_once, fex_init);
+  if (!path || !st) {
+    errno = EINVAL;
+    return -1;
   }
-
-  /* Close the original file if it's open */
-  if (entry->original_fp) {
-    fex_log("Closing original file %s\n", entry->original_filename);
-    orig_fclose(entry->original_fp);
-    entry->original_fp = NULL;
+  fex_source_t source;
+  int fd = orig_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    struct stat path_st;
+    if (orig_fstat(fd, &path_st) != 0) {
+      int error = errno;
+      orig_close(fd);
+      errno = error;
+      return -1;
+    }
+    resolve_fex_range(fd, path, &path_st, 0, &source);
+    *st = source.st;
+    release_fex_source(fd, &source);
+    orig_close(fd);
+    return 0;
   }
 
-  entry->block_size = 0;
+  int missing = errno;
+  char name[PATH_MAX];
+  int format;
+  if ((missing != ENOENT && missing != ENOTDIR) ||
+      resolve_virtual_path(path, missing, 1, name, &source, &format) != 0) {
+    errno = missing;
+    return -1;
+  }
+  *st = source.st;
+  orig_close(source.fd);
+  return 0;
 }
 
-size_t read_bytes_from_buffer(fex_file_entry_t *entry, unsigned char *buffer,
-                              size_t size) {
-  if (!entry || !entry->header_string || !entry->footer_string) {
+/* Render up to len bytes at offset into buf; returns the count, 0 at the
+ * end, or -1 with errno set */
+ssize_t fex_read_at(fex_handle_t *handle, off_t offset, void *buf,
+                    size_t len) {
+  fex_file_entry_t *entry = handle->entry;
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (offset >= entry->simulated_size)
     return 0;
+  size_t count = MIN(len, (size_t)(entry->simulated_size - offset));
+  if (fex_render_range(entry, entry->source_fd, offset, buf, count) != 0) {
+    errno = EIO;
+    return -1;
   }
+  return count;
+}
 
-  size_t bytes_read = 0;
-  off_t start_position = entry->simulated_position;
-  size = MIN(size, entry->simulated_size - entry->simulated_position);
-  while (size) {
-    size_t added = 0;
-
-    /* Use pre-calculated values from the structure */
-    if (entry->simulated_position < entry->header_len) {
-      added = MIN(size, entry->header_len - entry->simulated_position);
-      memcpy(buffer, entry->header_string + entry->simulated_position, added);
-    } else if (entry->simulated_position < entry->footer_start) {
-      /* Simple override mode - just fill with '!' characters */
-      if (simple_override) {
-        memset(buffer, '!', size);
-        fex_log(
-            "read_bytes_from_buffer: simple override: filled %zu bytes with "
-            "'!'\n",
-            size);
-        added = size;
-      } else { /* Calculate the real position in the original file */
-        off_t data_offset = entry->simulated_position - entry->header_len;
-        off_t real_position = data_offset / strlen(hex_table[0]);
-        off_t block_number = real_position / entry->block_size;
-        /* Load the block if it's not currently loaded */
-        if (block_number != entry->current_block) {
-          entry->current_block = block_number;
-          size_t bytes_read = load_block_into_buffer(entry, block_number);
-          if (bytes_read < 0) {
-            fex_log(
-                "read_bytes_into_buffer() failed to load block %ld for .fex "
-                "file %s\n",
-                block_number, entry->original_filename);
-          }
-        }
-        int which_char = data_offset % strlen(hex_table[0]);
-        bool end_of_sixteen = ((real_position % 16) == 15);
-        fex_log("Hmm read_bytes_from_buffer: data_offset=%ld, "
-                "real_position=%ld, block_number=%ld, which_char=%d, "
-                "end_of_sixteen=%d\n",
-                data_offset, real_position, block_number, which_char,
-                end_of_sixteen);
-        const char *hex_value;
-        if (end_of_sixteen) {
-          hex_value =
-              hex_tableCR[entry->buffer[real_position % entry->block_size] &
-                          255];
-        } else {
-          hex_value =
-              hex_table[entry->buffer[real_position % entry->block_size] & 255];
-        }
-        added = MIN(size, strlen(hex_table[0]) - which_char);
-        memcpy(buffer, hex_value + which_char, added);
-      }
-    } else {
-      off_t pos = entry->simulated_position - entry->footer_start;
-      size_t footer_len = strlen(entry->footer_string);
-      if (pos >= footer_len) {
-        added = 0; /* Beyond footer */
-      } else {
-        added = MIN(size, footer_len - pos);
-        memcpy(buffer, entry->footer_string + pos, added);
-      }
-    }
-
-    if (added == 0) {
-      break;
+/* Write the whole rendered file to fd; 0 or -1 with errno set */
+int fex_render_all(fex_handle_t *handle, int fd) {
+  off_t size = handle->entry->simulated_size;
+  size_t chunk = MIN((off_t)FEX_API_RENDER_CHUNK, MAX(size, 1));
+  unsigned char *buf = fex_buffer_alloc(chunk);
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+  int result = 0;
+  for (off_t offset = 0; offset < size && result == 0; offset += chunk) {
+    ssize_t n = fex_read_at(handle, offset, buf, chunk);
+    if (n <= 0 || write_all(fd, buf, n) != 0) {
+      if (n == 0)
+        errno = EIO;
+      result = -1;
     }
-
-    buffer += added;
-    entry->simulated_position += added;
-    bytes_read += added;
-    size -= added;
   }
+  fex_buffer_free(buf, chunk);
+  return result;
+}
 
-  fex_log("fgetc() read at position %ld, %d bytes for .fex file %s\n",
-          start_position, bytes_read, entry->original_filename);
-
-  return bytes_read;
+/* Release a handle and the descriptors it holds */
+void fex_close(fex_handle_t *handle) {
+  if (!handle)
+    return;
+  destroy_fex_entry(handle->entry);
+  if (handle->fd >= 0)
+    orig_close(handle->fd);
+  free(handle);
 }
 
+#ifndef FEX_NO_INTERPOSE
+
 /* Constructor - called when library is loaded */
-__attribute__((constructor)) void fex_constructor(void) { fex_init(); }
+__attribute__((constructor)) void fex_constructor(void) {
+  fex_init();
+  if (write_decode) {
+    track_inherited_fex_writer();
+    atexit(flush_fex_writers);
+  }
+}
 
 /* ========== FILE DESCRIPTOR FUNCTIONS ========== */
 
@@ -1218,23 +6097,38 @@ int open(const char *pathname, int flags, ...) {
 
   fex_log("open(%s, %d, %o)\n", pathname, flags, mode);
 
+  /* Read-only opens of a .fex can be served by fexd */
+  if (daemon_enabled && !(flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC |
+                                   O_APPEND | O_DIRECTORY)) &&
+      should_process_as_fex(pathname)) {
+    int fd = open_fex_via_daemon(pathname, flags);
+    if (fd >= 0) {
+      record_manifest_open(pathname);
+      return fd;
+    }
+  }
+
   int result = orig_open(pathname, flags, mode);
+  if (result < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+    return open_fex_virtual(pathname, flags);
+  }
   fex_log("open() returned %d\n", result);
 
   /* Track .fex files and directories */
   if (result >= 0) {
+    if (is_fex_decode_open(pathname, flags)) {
+      track_fex_writer_fd(result, pathname);
+    }
     track_fex_file_fd(result, pathname, flags);
+    if (!(flags & (O_WRONLY | O_RDWR | O_DIRECTORY)) &&
+        is_fex_bundle_path(pathname)) {
+      track_fex_bundle(result, NULL, pathname);
+    }
 
-    /* Check if this is a directory and add to directory mapping for openat()
-     * support */
-    struct stat file_stat;
-    if (orig_stat(pathname, &file_stat) == 0) {
-      if (S_ISDIR(file_stat.st_mode)) {
-        if (add_directory_fd_mapping(result, pathname) == 0) {
-          fex_log("Added directory mapping: fd %d -> \"%s\"\n", result,
-                  pathname);
-        }
-      }
+    /* A successful O_DIRECTORY open is a directory; anything else is
+     * resolved lazily if it is ever used as an openat() dirfd */
+    if ((flags & O_DIRECTORY) && pathname[0] == '/') {
+      add_directory_fd_mapping(result, pathname, NULL);
     }
   }
 
@@ -1252,11 +6146,45 @@ int openat(int dirfd, const char *pathname, int flags, ...) {
     va_end(args);
   }
 
-  /* Resolve the full path taking dirfd into account */
-  char *resolved_path = resolve_openat_path(dirfd, pathname);
-  if (!resolved_path) {
-    errno = ENOMEM;
-    return -1;
+  /* Bundles open as their rendered text */
+  if (!(flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_DIRECTORY)) &&
+      is_fex_bundle_path(pathname)) {
+    char resolved_path[PATH_MAX];
+    if (resolve_openat_path(dirfd, pathname, resolved_path,
+                            sizeof(resolved_path)) == 0) {
+      int fd = open_fex_bundle_copy(resolved_path);
+      if (fd >= 0)
+        return fd;
+    }
+  }
+
+  /* Reject paths no rule can match before resolving anything */
+  if (!fex_path_may_match(pathname)) {
+    int fd = orig_openat(dirfd, pathname, flags, mode);
+    if (fd >= 0 && (flags & O_DIRECTORY) && pathname[0] == '/') {
+      add_directory_fd_mapping(fd, pathname, NULL);
+    }
+    /* A missing path may be virtual */
+    if (fd < 0 && fex_path_may_be_virtual(pathname, errno)) {
+      int missing = errno;
+      char resolved_path[PATH_MAX];
+      if (resolve_openat_path(dirfd, pathname, resolved_path,
+                              sizeof(resolved_path)) != 0) {
+        errno = missing;
+        return -1;
+      }
+      errno = missing;
+      return open_fex_virtual(resolved_path, flags);
+    }
+    return fd;
+  }
+
+  /* Resolve the full path taking dirfd into account; a path we cannot
+   * resolve is simply passed through */
+  char resolved_path[PATH_MAX];
+  if (resolve_openat_path(dirfd, pathname, resolved_path,
+                          sizeof(resolved_path)) != 0) {
+    return orig_openat(dirfd, pathname, flags, mode);
   }
 
   fex_log("openat(%d, %s, %d, %o) -> resolved path: \"%s\"\n", dirfd, pathname,
@@ -1266,20 +6194,33 @@ int openat(int dirfd, const char *pathname, int flags, ...) {
   if (should_process_as_fex(resolved_path)) {
     fex_log("Processing FEX file: %s\n", resolved_path);
 
+    /* Write-only opens store decoded binary when write decoding is on */
+    if (is_fex_decode_open(resolved_path, flags)) {
+      int fd = orig_openat(dirfd, pathname, flags, mode);
+      if (fd >= 0) {
+        track_fex_writer_fd(fd, resolved_path);
+      }
+      return fd;
+    }
+
     /* For FEX files, only allow read-only operations */
     if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) {
       /* Write operation requested on FEX file - return error */
-      free(resolved_path);
       errno = EACCES; /* Permission denied */
       return -1;
     }
 
-    /* Create a temporary file to serve the FEX content */
-    int temp_fd = create_fex_temp_file(resolved_path);
+    /* Use the daemon's shared copy, or render a private one */
+    int temp_fd = open_fex_via_daemon(resolved_path, flags);
+    if (temp_fd < 0) {
+      temp_fd = create_fex_temp_file(resolved_path);
+    }
+    if (temp_fd >= 0) {
+      record_manifest_open(resolved_path);
+    }
     if (temp_fd >= 0) {
       fex_log("Created temporary FEX file: %s (fd %d)\n", resolved_path,
               temp_fd);
-      free(resolved_path);
       return temp_fd;
     } else {
       /* Fallback to original openat if temp file creation failed */
@@ -1290,7 +6231,6 @@ int openat(int dirfd, const char *pathname, int flags, ...) {
       } else {
         result = orig_openat(dirfd, pathname, flags);
       }
-      free(resolved_path);
       return result;
     }
   }
@@ -1306,18 +6246,10 @@ int openat(int dirfd, const char *pathname, int flags, ...) {
   fex_log("openat(%d, %s, %d) = %d\n", dirfd, pathname, flags, fd);
 
   /* Track directories for future openat() calls */
-  if (fd >= 0) {
-    struct stat file_stat;
-    if (orig_fstatat(dirfd, pathname, &file_stat, 0) == 0) {
-      if (S_ISDIR(file_stat.st_mode)) {
-        add_directory_fd_mapping(fd, resolved_path);
-        fex_log("Added directory mapping via openat: fd %d -> \"%s\"\n", fd,
-                resolved_path);
-      }
-    }
+  if (fd >= 0 && (flags & O_DIRECTORY) && resolved_path[0] == '/') {
+    add_directory_fd_mapping(fd, resolved_path, NULL);
   }
 
-  free(resolved_path);
   return fd;
 }
 
@@ -1325,17 +6257,21 @@ int close(int fd) {
   fex_init();
   fex_log("close(%d)\n", fd);
 
-  /* Check if this is a directory file descriptor and remove mapping */
-  directory_fd_mapping_t *dir_mapping = find_directory_fd_mapping(fd);
-  if (dir_mapping) {
-    fex_log("Closing directory fd %d\n", fd);
-    remove_directory_fd_mapping(fd);
-  }
+  /* Forget the directory path if this is a tracked directory fd */
+  remove_directory_fd_mapping(fd);
 
   /* Untrack .fex files before closing */
   untrack_fex_file_fd(fd);
 
+  /* Flush decoded .fex writes; report decode errors like a failed write */
+  int writer_result = untrack_fex_writer_fd(fd);
+  int saved_errno = errno;
+
   int result = orig_close(fd);
+  if (result == 0 && writer_result != 0) {
+    errno = saved_errno;
+    result = -1;
+  }
   fex_log("close() returned %d\n", result);
   return result;
 }
@@ -1357,6 +6293,23 @@ ssize_t read(int fd, void *buf, size_t count) {
   return result;
 }
 
+ssize_t write(int fd, const void *buf, size_t count) {
+  fex_init();
+
+  fex_writer_t *writer = acquire_fex_writer(fd);
+  if (writer) {
+    int result = feed_fex_writer(writer, buf, count, 0);
+    release_fex_writer(writer);
+    if (result != 0) {
+      fex_log("write() failed to decode C text for .fex fd %d\n", fd);
+      return -1;
+    }
+    return count;
+  }
+
+  return orig_write(fd, buf, count);
+}
+
 off_t lseek(int fd, off_t offset, int whence) {
   fex_init();
   fex_log("lseek(%d, %ld, %d)\n", fd, offset, whence);
@@ -1404,23 +6357,75 @@ off_t lseek(int fd, off_t offset, int whence) {
   off_t result = orig_lseek(fd, offset, whence);
   fex_log("lseek() returned %ld\n", result);
   return result;
-} /* ========== FILE STREAM FUNCTIONS ========== */
+} /* ========== MEMORY MAPPING FUNCTIONS ========== */
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  fex_init();
+
+  /* Map the rendered C text of a tracked .fex, not its raw bytes */
+  if (fd >= 0 && !(flags & MAP_ANONYMOUS)) {
+    fex_file_entry_t *entry = find_fex_file_by_fd(fd);
+    if (entry) {
+      int rendered_fd = get_rendered_fd(entry);
+      if (rendered_fd >= 0) {
+        entry->touched_start = 0;
+        entry->touched_end = entry->original_size;
+        fex_log("mmap() of .fex file %s served from rendered fd %d\n",
+                entry->original_filename, rendered_fd);
+        return orig_mmap(addr, length, prot, flags, rendered_fd, offset);
+      }
+    }
+  }
+
+  return orig_mmap(addr, length, prot, flags, fd, offset);
+}
+
+/* ========== FILE STREAM FUNCTIONS ========== */
 
 FILE *fopen(const char *pathname, const char *mode) {
   fex_init();
   fex_log("fopen(%s, %s)\n", pathname, mode);
 
+  /* Write-only .fex streams decode C text into binary */
+  if (write_decode && mode && (mode[0] == 'w' || mode[0] == 'a') &&
+      !strchr(mode, '+') && should_process_as_fex(pathname)) {
+    return open_fex_writer_stream(pathname, mode);
+  }
+
   FILE *result = orig_fopen(pathname, mode);
+  if (!result && (errno == ENOENT || errno == ENOTDIR)) {
+    int fd = open_fex_virtual(pathname, mode && mode[0] == 'r' &&
+                                                !strchr(mode, '+')
+                                            ? O_RDONLY
+                                            : O_RDWR);
+    if (fd < 0)
+      return NULL;
+    result = fdopen(fd, mode);
+    if (!result)
+      orig_close(fd);
+    return result;
+  }
   fex_log("fopen() returned %p\n", result);
 
   /* Track .fex files */
   if (result) {
     track_fex_file_fp(result, pathname, mode);
+    if (mode && mode[0] == 'r' && !strchr(mode, '+') &&
+        is_fex_bundle_path(pathname)) {
+      track_fex_bundle(orig_fileno(result), result, pathname);
+    }
   }
 
   return result;
 }
 
+/* The large-file variant is the same call on LP64; the linker opens its
+ * inputs through it */
+FILE *fopen64(const char *pathname, const char *mode) {
+  return fopen(pathname, mode);
+}
+
 int fclose(FILE *stream) {
   fex_init();
   fex_log("fclose(%p)\n", stream);
@@ -1765,26 +6770,34 @@ int stat(const char *pathname, struct stat *statbuf) {
   fex_log("stat(%s, %p)\n", pathname, statbuf);
 
   int result = orig_stat(pathname, statbuf);
+  if (result != 0 && (errno == ENOENT || errno == ENOTDIR)) {
+    return stat_fex_virtual(pathname, statbuf);
+  }
+
+  /* A list-file bundle has the size of its text; a directory bundle stays
+   * a directory to path-based tools */
+  if (result == 0 && S_ISREG(statbuf->st_mode) &&
+      is_fex_bundle_path(pathname)) {
+    off_t size = fex_bundle_size(pathname);
+    if (size >= 0) {
+      statbuf->st_size = size;
+      statbuf->st_blksize = block_size_base;
+      statbuf->st_blocks = (size + block_size_base - 1) / block_size_base;
+    }
+  }
 
   /* If this is a .fex file and stat succeeded, modify the size-related fields
    */
   if (result == 0 && should_process_as_fex(pathname) && statbuf) {
     /* Calculate simulated size for .fex file */
-    off_t original_size = statbuf->st_size;
-    char *header_string = NULL;
-    char *footer_string = NULL;
-    off_t simulated_size = 0;
-    off_t header_len = 0;
-    off_t data_len = 0;
-    off_t footer_start = 0;
-
-    if (generate_fex_code_data(pathname, original_size, &header_string,
-                               &footer_string, &simulated_size, &header_len,
-                               &data_len, &footer_start) == 0 &&
-        simulated_size > 0) {
+    off_t original_size = fex_source_length(pathname, statbuf);
+    off_t simulated_size =
+        fex_path_size(pathname, statbuf, original_size, default_format);
+
+    if (simulated_size > 0) {
       /* Update stat buffer with simulated values */
       statbuf->st_size = simulated_size;
-      statbuf->st_blksize = get_fex_block_size(); /* Configurable block size */
+      statbuf->st_blksize = block_size_base; /* Configurable block size */
       statbuf->st_blocks = (simulated_size + (statbuf->st_blksize - 1)) /
                            statbuf->st_blksize; /* Round up to blocks */
 
@@ -1792,9 +6805,6 @@ int stat(const char *pathname, struct stat *statbuf) {
               "simulated_size=%ld, blocks=%ld\n",
               original_size, simulated_size, statbuf->st_blocks);
     }
-
-    free(header_string);
-    free(footer_string);
   }
 
   fex_log("stat() returned %d\n", result);
@@ -1813,9 +6823,13 @@ int fstat(int fd, struct stat *statbuf) {
     if (entry) {
       /* Update stat buffer with simulated values from tracked entry */
       statbuf->st_size = entry->simulated_size;
-      statbuf->st_blksize = get_fex_block_size(); /* Configurable block size */
+      statbuf->st_blksize = block_size_base; /* Configurable block size */
       statbuf->st_blocks = (entry->simulated_size + (statbuf->st_blksize - 1)) /
                            statbuf->st_blksize; /* Round up to blocks */
+      /* An open bundle directory reads as a file */
+      if (entry->bundle) {
+        statbuf->st_mode = S_IFREG | (statbuf->st_mode & 0444);
+      }
 
       fex_log("fstat() modified tracked .fex file stats: original_size=%ld, "
               "simulated_size=%ld, blocks=%ld\n",
@@ -1831,30 +6845,25 @@ int fstatat(int dirfd, const char *pathname, struct stat *statbuf, int flags) {
   fex_init();
   fex_log("fstatat(%d, %s, %p, %d)\n", dirfd, pathname, statbuf, flags);
 
-  if (pathname && should_process_as_fex(pathname)) {
+  if (fex_path_may_match(pathname)) {
     /* Resolve the path relative to dirfd */
-    char *resolved_path = resolve_openat_path(dirfd, pathname);
-    if (resolved_path) {
+    char resolved_path[PATH_MAX];
+    if (resolve_openat_path(dirfd, pathname, resolved_path,
+                            sizeof(resolved_path)) == 0 &&
+        should_process_as_fex(resolved_path)) {
       /* Get original file stats first using resolved path */
       int result = orig_stat(resolved_path, statbuf);
       if (result == 0) {
         /* Calculate simulated size for .fex file */
-        off_t original_size = statbuf->st_size;
-        char *header_string = NULL;
-        char *footer_string = NULL;
-        off_t simulated_size = 0;
-        off_t header_len = 0;
-        off_t data_len = 0;
-        off_t footer_start = 0;
-
-        if (generate_fex_code_data(resolved_path, original_size, &header_string,
-                                   &footer_string, &simulated_size, &header_len,
-                                   &data_len, &footer_start) == 0 &&
-            simulated_size > 0) {
+        off_t original_size = fex_source_length(resolved_path, statbuf);
+        off_t simulated_size = fex_path_size(resolved_path, statbuf,
+                                             original_size, default_format);
+
+        if (simulated_size > 0) {
           /* Update stat buffer with simulated values */
           statbuf->st_size = simulated_size;
           statbuf->st_blksize =
-              get_fex_block_size(); /* Configurable block size */
+              block_size_base; /* Configurable block size */
           statbuf->st_blocks = (simulated_size + (statbuf->st_blksize - 1)) /
                                statbuf->st_blksize; /* Round up to blocks */
 
@@ -1862,16 +6871,61 @@ int fstatat(int dirfd, const char *pathname, struct stat *statbuf, int flags) {
                   "simulated_size=%ld, blocks=%ld\n",
                   original_size, simulated_size, statbuf->st_blocks);
         }
-
-        free(header_string);
-        free(footer_string);
       }
-      free(resolved_path);
       return result;
     }
   }
   int result = orig_fstatat(dirfd, pathname, statbuf, flags);
+  if (result == 0 && S_ISREG(statbuf->st_mode) &&
+      is_fex_bundle_path(pathname)) {
+    char resolved_path[PATH_MAX];
+    off_t size = resolve_openat_path(dirfd, pathname, resolved_path,
+                                     sizeof(resolved_path)) == 0
+                     ? fex_bundle_size(resolved_path)
+                     : -1;
+    if (size >= 0) {
+      statbuf->st_size = size;
+      statbuf->st_blksize = block_size_base;
+      statbuf->st_blocks = (size + block_size_base - 1) / block_size_base;
+    }
+  }
+  if (result != 0 && fex_path_may_be_virtual(pathname, errno)) {
+    int missing = errno;
+    char resolved_path[PATH_MAX];
+    if (resolve_openat_path(dirfd, pathname, resolved_path,
+                            sizeof(resolved_path)) == 0) {
+      errno = missing;
+      return stat_fex_virtual(resolved_path, statbuf);
+    }
+    errno = missing;
+  }
 
   fex_log("fstatat() returned %d\n", result);
   return result;
-}
\ No newline at end of file
+}
+
+/* ========== WORKING DIRECTORY FUNCTIONS ========== */
+
+int chdir(const char *path) {
+  fex_init();
+  fex_log("chdir(%s)\n", path);
+
+  int result = orig_chdir(path);
+  if (result == 0) {
+    invalidate_cached_cwd();
+  }
+  return result;
+}
+
+int fchdir(int fd) {
+  fex_init();
+  fex_log("fchdir(%d)\n", fd);
+
+  int result = orig_fchdir(fd);
+  if (result == 0) {
+    invalidate_cached_cwd();
+  }
+  return result;
+}
+
+#endif /* FEX_NO_INTERPOSE */
@@ -0,0 +1,301 @@
+/* fexd - shares rendered .fex files between processes
+ *
+ * Clients (libfex with FEX_DAEMON set) connect to an abstract Unix socket,
+ * send a fex_daemon_request_t with the descriptor of the file holding the
+ * bytes attached, and get back a sealed memfd holding the rendered file.
+ * Each (device, inode, mtime, range, format, name) is rendered once, so
+ * every compiler of a parallel build maps the same page-cache copy.
+ *
+ * Started on demand by the library; exits after FEX_DAEMON_IDLE seconds
+ * (default 30) without clients.
+ */
+#define _GNU_SOURCE
+#include "fex.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define FEXD_DEFAULT_IDLE 30                             /* Seconds */
+#define FEXD_DEFAULT_CACHE (1024L * 1024 * 1024)         /* Bytes */
+
+/* One rendered copy; fd is -1 while a client renders it */
+typedef struct fexd_entry {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t offset; /* Range of the file rendered */
+  off_t length;
+  uint32_t format;
+  char *name;
+  int fd;
+  off_t bytes;
+  uint64_t last_used;
+  struct fexd_entry *next;
+} fexd_entry_t;
+
+static fexd_entry_t *cache_head = NULL;
+static off_t cache_bytes = 0;
+static off_t cache_budget = FEXD_DEFAULT_CACHE;
+static uint64_t use_clock = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic int active_clients = 0;
+
+static long env_long(const char *name, long def) {
+  const char *value = getenv(name);
+  if (!value)
+    return def;
+  char *end;
+  long result = strtol(value, &end, 10);
+  return (*end == '\0' && result > 0) ? result : def;
+}
+
+/* Drop least recently used copies beyond the budget. Clients holding a
+ * descriptor keep theirs alive. Called with cache_mutex held. */
+static void evict_entries(void) {
+  while (cache_bytes > cache_budget) {
+    fexd_entry_t **victim = NULL;
+    for (fexd_entry_t **link = &cache_head; *link; link = &(*link)->next) {
+      if ((*link)->fd >= 0 &&
+          (!victim || (*link)->last_used < (*victim)->last_used)) {
+        victim = link;
+      }
+    }
+    if (!victim)
+      return;
+    fexd_entry_t *entry = *victim;
+    *victim = entry->next;
+    cache_bytes -= entry->bytes;
+    close(entry->fd);
+    free(entry->name);
+    free(entry);
+  }
+}
+
+/* Return a duplicate of the rendered copy of the requested range of
+ * src_fd, rendering it if no client has yet; -1 on failure */
+static int get_rendered_copy(int src_fd, const fex_daemon_request_t *request) {
+  struct stat st;
+  off_t offset = request->offset, length = request->length;
+  if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode) || offset < 0 ||
+      length < 0 || offset > st.st_size || length > st.st_size - offset)
+    return -1;
+
+  pthread_mutex_lock(&cache_mutex);
+  fexd_entry_t *entry;
+  for (;;) {
+    for (entry = cache_head; entry; entry = entry->next) {
+      if (entry->ino == st.st_ino && entry->dev == st.st_dev &&
+          entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+          entry->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+          entry->offset == offset && entry->length == length &&
+          entry->format == request->format &&
+          strcmp(entry->name, request->name) == 0)
+        break;
+    }
+    if (!entry || entry->fd >= 0)
+      break;
+    /* Someone else is rendering it */
+    pthread_cond_wait(&cache_cond, &cache_mutex);
+  }
+
+  if (entry) {
+    entry->last_used = ++use_clock;
+    int fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_unlock(&cache_mutex);
+    return fd;
+  }
+
+  /* Claim the key, then render without holding the lock */
+  entry = calloc(1, sizeof(*entry));
+  char *name = strdup(request->name);
+  if (!entry || !name) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(entry);
+    free(name);
+    return -1;
+  }
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->mtime = st.st_mtim;
+  entry->offset = offset;
+  entry->length = length;
+  entry->format = request->format;
+  entry->name = name;
+  entry->fd = -1;
+  entry->next = cache_head;
+  cache_head = entry;
+  pthread_mutex_unlock(&cache_mutex);
+
+  int rendered_fd = fex_render_source_range(src_fd, offset, length,
+                                            request->name, request->format);
+  struct stat rendered_st;
+  if (rendered_fd >= 0) {
+    fcntl(rendered_fd, F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    if (fstat(rendered_fd, &rendered_st) != 0) {
+      close(rendered_fd);
+      rendered_fd = -1;
+    }
+  }
+
+  pthread_mutex_lock(&cache_mutex);
+  int fd = -1;
+  if (rendered_fd >= 0) {
+    entry->fd = rendered_fd;
+    entry->bytes = rendered_st.st_size;
+    entry->last_used = ++use_clock;
+    cache_bytes += entry->bytes;
+    fd = fcntl(rendered_fd, F_DUPFD_CLOEXEC, 0);
+    evict_entries();
+  } else {
+    /* Unclaim so waiters retry (and fail) on their own */
+    fexd_entry_t **link = &cache_head;
+    while (*link != entry)
+      link = &(*link)->next;
+    *link = entry->next;
+    free(entry->name);
+    free(entry);
+  }
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_mutex);
+  return fd;
+}
+
+static void *handle_client(void *arg) {
+  int sock = (int)(intptr_t)arg;
+  int32_t status = -1;
+  int src_fd = -1;
+  int rendered_fd = -1;
+
+  /* Serve our own user only: the abstract namespace has no permissions */
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      cred.uid != getuid())
+    goto done;
+
+  fex_daemon_request_t request;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {&request, sizeof(request)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t received = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&src_fd, CMSG_DATA(cmsg), sizeof(int));
+  if (received != (ssize_t)sizeof(request) || src_fd < 0 ||
+      request.magic != FEX_DAEMON_MAGIC ||
+      request.format >= FEX_FORMAT_COUNT ||
+      !memchr(request.name, '\0', sizeof(request.name)))
+    goto done;
+
+  rendered_fd = get_rendered_copy(src_fd, &request);
+  if (rendered_fd >= 0)
+    status = 0;
+
+done:;
+  /* Reply with the status, and the copy when there is one */
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } reply_control;
+  struct iovec reply_iov = {&status, sizeof(status)};
+  struct msghdr reply = {.msg_iov = &reply_iov, .msg_iovlen = 1};
+  if (rendered_fd >= 0) {
+    reply.msg_control = reply_control.buf;
+    reply.msg_controllen = sizeof(reply_control.buf);
+    struct cmsghdr *reply_cmsg = CMSG_FIRSTHDR(&reply);
+    reply_cmsg->cmsg_level = SOL_SOCKET;
+    reply_cmsg->cmsg_type = SCM_RIGHTS;
+    reply_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(reply_cmsg), &rendered_fd, sizeof(int));
+  }
+  sendmsg(sock, &reply, MSG_NOSIGNAL);
+
+  if (rendered_fd >= 0)
+    close(rendered_fd);
+  if (src_fd >= 0)
+    close(src_fd);
+  close(sock);
+  atomic_fetch_sub(&active_clients, 1);
+  return NULL;
+}
+
+int main(void) {
+  /* Render with the engine linked in, never as a client of ourselves */
+  unsetenv("FEX_DAEMON");
+  unsetenv("FEX_MANIFEST");
+  fex_init();
+
+  long idle_seconds = env_long("FEX_DAEMON_IDLE", FEXD_DEFAULT_IDLE);
+  cache_budget = env_long("FEX_DAEMON_CACHE", FEXD_DEFAULT_CACHE);
+
+  struct sockaddr_un addr;
+  socklen_t addr_len = fex_daemon_address(&addr);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("fexd: socket");
+    return 1;
+  }
+  if (bind(listen_fd, (struct sockaddr *)&addr, addr_len) != 0) {
+    /* Another fexd won the race to start */
+    if (errno == EADDRINUSE)
+      return 0;
+    perror("fexd: bind");
+    return 1;
+  }
+  if (listen(listen_fd, SOMAXCONN) != 0) {
+    perror("fexd: listen");
+    return 1;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, idle_seconds * 1000);
+    if (ready == 0) {
+      if (atomic_load(&active_clients) == 0)
+        break;
+      continue;
+    }
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("fexd: poll");
+      break;
+    }
+
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+      continue;
+    atomic_fetch_add(&active_clients, 1);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, handle_client,
+                       (void *)(intptr_t)sock) != 0) {
+      close(sock);
+      atomic_fetch_sub(&active_clients, 1);
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+  close(listen_fd);
+  return 0;
+}
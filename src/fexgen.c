@@ -0,0 +1,434 @@
+/* fexgen - renders .fex files to real files ahead of time
+ *
+ * For builds that cannot preload libfex (static toolchains, sandboxes):
+ * every input is rendered with the same engine into an output file on
+ * disk. Inputs are files, directories (searched for .fex paths and
+ * .fexbundle directories), glob patterns, or list files given with -l.
+ *
+ * Each output is written by one worker of a thread pool, through a
+ * temporary file renamed into place, and stamped with its source's mtime:
+ * for a pointer manifest the later of its own and its target's, for an
+ * archive member the archive's. An output whose mtime (and, except for
+ * zlib, size) already matches is left alone; zlib outputs need -F after a
+ * change of FEX_ZLIB_LEVEL. Two inputs rendering to one output are an
+ * error.
+ */
+#define _GNU_SOURCE
+#include "fex.h"
+#include <errno.h>
+#include <ftw.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FEXGEN_MAX_THREADS 256
+
+/* One input and the output it renders to */
+typedef struct {
+  char *input;
+  char *output;
+} fexgen_job_t;
+
+static fexgen_job_t *jobs = NULL;
+static size_t job_count = 0;
+static size_t job_capacity = 0;
+static _Atomic(size_t) next_job = 0;
+
+static const char *output_dir = NULL; /* -o, or NULL for beside the input */
+static const char *output_suffix = NULL;
+static int output_format = FEX_FORMAT_C_ARRAY;
+static int force = 0;
+static int verbose = 0;
+static mode_t file_mode = 0644;
+
+static _Atomic(size_t) rendered_count = 0;
+static _Atomic(size_t) unchanged_count = 0;
+static _Atomic(size_t) failed_count = 0;
+
+/* Formats that render without the preload; incbin and #embed name the raw
+ * view, which only exists under it */
+static const struct {
+  const char *name;
+  int format;
+  const char *suffix;
+} formats[] = {
+    {"c", FEX_FORMAT_C_ARRAY, ".c"}, {"zlib", FEX_FORMAT_ZLIB, ".c"},
+    {"h", FEX_FORMAT_HEADER, ".h"},  {"o", FEX_FORMAT_ELF_OBJECT, ".o"},
+    {"raw", FEX_FORMAT_RAW, ".raw"},
+};
+
+/* Queue input to be rendered to output; takes ownership of output */
+static int add_job(const char *input, char *output) {
+  if (job_count == job_capacity) {
+    size_t capacity = job_capacity ? job_capacity * 2 : 256;
+    fexgen_job_t *grown = realloc(jobs, capacity * sizeof(*jobs));
+    if (!grown)
+      return -1;
+    jobs = grown;
+    job_capacity = capacity;
+  }
+  char *copy = strdup(input);
+  if (!copy || !output) {
+    free(copy);
+    free(output);
+    return -1;
+  }
+  jobs[job_count].input = copy;
+  jobs[job_count].output = output;
+  job_count++;
+  return 0;
+}
+
+/* Output path of input; rel is its path below the directory argument it
+ * was found in, or its base name */
+static char *output_path(const char *input, const char *rel) {
+  char *path;
+  int n = output_dir ? asprintf(&path, "%s/%s%s", output_dir, rel,
+                                output_suffix)
+                     : asprintf(&path, "%s%s", input, output_suffix);
+  return n < 0 ? NULL : path;
+}
+
+static int add_file(const char *input) {
+  const char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  return add_job(input, output_path(input, base));
+}
+
+/* Directory walk state; nftw() has no user argument */
+static const char *walk_root = NULL;
+static int walk_failed = 0;
+
+/* A .fexbundle directory or list */
+static int is_bundle_path(const char *path) {
+  size_t len = strlen(path);
+  return len > 10 && strcmp(path + len - 10, ".fexbundle") == 0;
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type,
+                      struct FTW *ftw) {
+  (void)st;
+  const char *rel = path + strlen(walk_root);
+  while (*rel == '/')
+    rel++;
+  if ((type == FTW_D || type == FTW_F) && ftw->level > 0 &&
+      is_bundle_path(path)) {
+    if (add_job(path, output_path(path, rel)) != 0)
+      walk_failed = 1;
+    return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+  }
+  if (type == FTW_F && should_process_as_fex(path) &&
+      add_job(path, output_path(path, rel)) != 0)
+    walk_failed = 1;
+  return walk_failed ? FTW_STOP : FTW_CONTINUE;
+}
+
+/* Queue one command-line input: a directory, a glob or a file */
+static int add_input(const char *input) {
+  struct stat st;
+  if (!is_bundle_path(input) && stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+    walk_root = input;
+    if (nftw(input, walk_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0 ||
+        walk_failed) {
+      fprintf(stderr, "fexgen: %s: cannot search directory\n", input);
+      return -1;
+    }
+    return 0;
+  }
+  if (strpbrk(input, "*?[")) {
+    glob_t matches;
+    if (glob(input, 0, NULL, &matches) != 0) {
+      fprintf(stderr, "fexgen: %s: no matches\n", input);
+      return -1;
+    }
+    int result = 0;
+    for (size_t i = 0; i < matches.gl_pathc && result == 0; i++)
+      result = add_file(matches.gl_pathv[i]);
+    globfree(&matches);
+    return result;
+  }
+  return add_file(input);
+}
+
+/* Queue every path of a list file, one per line; '#' starts a comment */
+static int add_list(const char *list) {
+  FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+  if (!fp) {
+    perror(list);
+    return -1;
+  }
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int result = 0;
+  while (result == 0 && (len = getline(&line, &size, fp)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' ' || line[len - 1] == '\t'))
+      line[--len] = '\0';
+    if (len > 0 && line[0] != '#')
+      result = add_input(line);
+  }
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+  return result;
+}
+
+/* Create the directories leading to path */
+static int make_parent_dirs(const char *path) {
+  char dir[PATH_MAX];
+  if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir))
+    return -1;
+  for (char *slash = strchr(dir + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+      return -1;
+    *slash = '/';
+  }
+  return 0;
+}
+
+/* mtime an output of input is stamped with: the later of the input's own
+ * and that of the file holding its bytes (a pointer manifest's target, a
+ * member's archive). 0 if there is none: bundles are built from many
+ * files and are always rendered. */
+static int source_mtime(const char *input, struct timespec *mtime) {
+  struct stat st, source_st;
+  if (is_bundle_path(input) || fex_source_stat(input, &source_st) != 0 ||
+      !S_ISREG(source_st.st_mode))
+    return 0;
+  *mtime = source_st.st_mtim;
+  if (stat(input, &st) == 0 &&
+      (st.st_mtim.tv_sec > mtime->tv_sec ||
+       (st.st_mtim.tv_sec == mtime->tv_sec &&
+        st.st_mtim.tv_nsec > mtime->tv_nsec)))
+    *mtime = st.st_mtim;
+  return 1;
+}
+
+/* Render one input; 0 rendered, 1 unchanged, -1 failed */
+static int render_job(const fexgen_job_t *job) {
+  /* Outputs carry their source's mtime, so a match means up to date. This
+   * is checked before fex_open(), which for zlib compresses the source to
+   * size it; other formats also compare the rendered size. */
+  struct timespec mtime;
+  struct stat out_st;
+  int stamped = source_mtime(job->input, &mtime);
+  int current = !force && stamped && stat(job->output, &out_st) == 0 &&
+                out_st.st_mtim.tv_sec == mtime.tv_sec &&
+                out_st.st_mtim.tv_nsec == mtime.tv_nsec;
+  if (current && output_format == FEX_FORMAT_ZLIB)
+    return 1;
+
+  fex_options_t opts = {output_format, job->input};
+  fex_handle_t *handle = fex_open(job->input, &opts);
+  if (!handle) {
+    fprintf(stderr, "fexgen: %s: %s\n", job->input, strerror(errno));
+    return -1;
+  }
+  if (current && out_st.st_size == fex_size(handle)) {
+    fex_close(handle);
+    return 1;
+  }
+
+  char temp[PATH_MAX];
+  int fd = -1;
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", job->output) <
+          (int)sizeof(temp) &&
+      make_parent_dirs(job->output) == 0) {
+    fd = mkstemp(temp);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "fexgen: %s: %s\n", job->output, strerror(errno));
+    fex_close(handle);
+    return -1;
+  }
+
+  struct timespec times[2] = {{0, UTIME_OMIT}, mtime};
+  int result = fex_render_all(handle, fd);
+  if (result == 0 && fchmod(fd, file_mode) != 0)
+    result = -1;
+  if (result == 0 && stamped && futimens(fd, times) != 0)
+    result = -1;
+  if (close(fd) != 0)
+    result = -1;
+  if (result == 0)
+    result = rename(temp, job->output);
+  if (result != 0) {
+    fprintf(stderr, "fexgen: %s: %s\n", job->output, strerror(errno));
+    unlink(temp);
+  }
+  fex_close(handle);
+  return result;
+}
+
+static void *render_worker(void *arg) {
+  (void)arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&next_job, 1)) < job_count) {
+    switch (render_job(&jobs[i])) {
+    case 0:
+      atomic_fetch_add(&rendered_count, 1);
+      if (verbose)
+        printf("%s -> %s\n", jobs[i].input, jobs[i].output);
+      break;
+    case 1:
+      atomic_fetch_add(&unchanged_count, 1);
+      break;
+    default:
+      atomic_fetch_add(&failed_count, 1);
+    }
+  }
+  return NULL;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+  return strcmp(((const fexgen_job_t *)a)->output,
+                ((const fexgen_job_t *)b)->output);
+}
+
+/* Whether two input paths name the same file */
+static int same_input(const char *a, const char *b) {
+  struct stat a_st, b_st;
+  if (strcmp(a, b) == 0)
+    return 1;
+  return stat(a, &a_st) == 0 && stat(b, &b_st) == 0 &&
+         a_st.st_dev == b_st.st_dev && a_st.st_ino == b_st.st_ino;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fexgen [-j threads] [-o dir] [-f c|zlib|h|o|raw] "
+          "[-s suffix] [-l list] [-F] [-v] [input...]\n"
+          "Renders .fex inputs (files, directories or globs) to files.\n"
+          "  -j  worker threads (default: online CPUs)\n"
+          "  -o  write outputs under dir instead of beside their inputs\n"
+          "  -f  output format (default c)\n"
+          "  -s  output suffix (default from the format, e.g. .c)\n"
+          "  -l  read inputs from a list file, or - for stdin\n"
+          "  -F  render even if the output is up to date\n"
+          "  -v  print each rendered output\n");
+}
+
+int main(int argc, char **argv) {
+  fex_init();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long threads = cpus > 0 ? cpus : 1;
+  const char *lists[64];
+  int list_count = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:f:s:l:Fvh")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = strtol(optarg, NULL, 10);
+      if (threads < 1 || threads > FEXGEN_MAX_THREADS) {
+        fprintf(stderr, "fexgen: -j takes 1 to %d\n", FEXGEN_MAX_THREADS);
+        return 2;
+      }
+      break;
+    case 'o':
+      output_dir = optarg;
+      break;
+    case 'f': {
+      size_t i = 0;
+      while (i < sizeof(formats) / sizeof(formats[0]) &&
+             strcmp(formats[i].name, optarg) != 0)
+        i++;
+      if (i == sizeof(formats) / sizeof(formats[0])) {
+        fprintf(stderr, "fexgen: unknown format %s\n", optarg);
+        return 2;
+      }
+      output_format = formats[i].format;
+      if (!output_suffix)
+        output_suffix = formats[i].suffix;
+      break;
+    }
+    case 's':
+      output_suffix = optarg;
+      break;
+    case 'l':
+      if (list_count == (int)(sizeof(lists) / sizeof(lists[0]))) {
+        fprintf(stderr, "fexgen: too many lists\n");
+        return 2;
+      }
+      lists[list_count++] = optarg;
+      break;
+    case 'F':
+      force = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (optind == argc && list_count == 0) {
+    usage();
+    return 2;
+  }
+  if (!output_suffix)
+    output_suffix = ".c";
+  mode_t mask = umask(0);
+  umask(mask);
+  file_mode = 0666 & ~mask;
+
+  for (int i = optind; i < argc; i++) {
+    if (add_input(argv[i]) != 0)
+      return 1;
+  }
+  for (int i = 0; i < list_count; i++) {
+    if (add_list(lists[i]) != 0)
+      return 1;
+  }
+
+  /* The same input found twice renders once; two inputs with one output
+   * would overwrite each other */
+  qsort(jobs, job_count, sizeof(*jobs), compare_jobs);
+  size_t unique = 0;
+  for (size_t i = 0; i < job_count; i++) {
+    if (unique > 0 && strcmp(jobs[unique - 1].output, jobs[i].output) == 0) {
+      if (!same_input(jobs[unique - 1].input, jobs[i].input)) {
+        fprintf(stderr, "fexgen: %s and %s both render to %s\n",
+                jobs[unique - 1].input, jobs[i].input, jobs[i].output);
+        return 1;
+      }
+      free(jobs[i].input);
+      free(jobs[i].output);
+      continue;
+    }
+    jobs[unique++] = jobs[i];
+  }
+  job_count = unique;
+
+  if ((size_t)threads > job_count)
+    threads = job_count ? (long)job_count : 1;
+  pthread_t workers[FEXGEN_MAX_THREADS];
+  long started = 1;
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, render_worker, NULL) != 0)
+      break;
+  }
+  render_worker(NULL);
+  for (long i = 1; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  size_t failed = atomic_load(&failed_count);
+  fprintf(stderr, "fexgen: %zu rendered, %zu unchanged, %zu failed\n",
+          atomic_load(&rendered_count), atomic_load(&unchanged_count), failed);
+
+  for (size_t i = 0; i < job_count; i++) {
+    free(jobs[i].input);
+    free(jobs[i].output);
+  }
+  free(jobs);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,652 @@
+/* test_api - rendering checks through the fex_open() API of libfex.a
+ *
+ * usage: test_api case
+ *
+ * Each case works in a fresh temporary directory:
+ *   layout        C array text, raw bytes and partial reads of a source
+ *   formats       C array, incbin, embed, zlib, header and ELF object output
+ *                 built with the C compiler and checked by running it
+ *   pointer       pointer manifests and their ranges
+ *   archive       stored and deflated zip members, tar members
+ *   bundle        a bundle is its members' text; colliding names fail
+ *   write_decode  C text written with write() to a stdout open on a .fex
+ *                 under the preload decodes back
+ */
+#define _GNU_SOURCE
+#include "fex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);          \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+static char dir[] = "/tmp/fex_test_XXXXXX";
+static char self_path[PATH_MAX];
+
+/* ========== HELPERS ========== */
+
+/* A path in the test directory, valid until the fourth call after */
+static const char *in_dir(const char *name) {
+  static char paths[4][PATH_MAX];
+  static int next = 0;
+  char *path = paths[next++ % 4];
+  snprintf(path, PATH_MAX, "%s/%s", dir, name);
+  return path;
+}
+
+static void fill_random(unsigned char *buf, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = seed >> 16;
+  }
+}
+
+static int write_file(const char *path, const void *data, size_t len) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  size_t n = fwrite(data, 1, len, fp);
+  return (fclose(fp) == 0 && n == len) ? 0 : -1;
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  rewind(fp);
+  unsigned char *data = malloc(size + 1);
+  if (data && fread(data, 1, size, fp) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  if (data) {
+    data[size] = '\0';
+    *len = size;
+  }
+  return data;
+}
+
+/* Render path in a format with fex_read_at(); NULL if it does not open */
+static unsigned char *render(const char *path, int format, size_t *len) {
+  fex_options_t opts = {format, NULL};
+  fex_handle_t *handle = fex_open(path, format < 0 ? NULL : &opts);
+  if (!handle)
+    return NULL;
+  off_t size = fex_size(handle);
+  unsigned char *text = malloc(size + 1);
+  off_t offset = 0;
+  while (text && offset < size) {
+    ssize_t n = fex_read_at(handle, offset, text + offset,
+                            MIN(size - offset, (off_t)4096));
+    if (n <= 0) {
+      free(text);
+      text = NULL;
+      break;
+    }
+    offset += n;
+  }
+  fex_close(handle);
+  if (text) {
+    text[size] = '\0';
+    *len = size;
+  }
+  return text;
+}
+
+/* Render path into the file out */
+static int render_to(const char *path, int format, const char *out) {
+  size_t len;
+  unsigned char *text = render(path, format, &len);
+  int result = text ? write_file(out, text, len) : -1;
+  free(text);
+  return result;
+}
+
+/* Run argv, with libfex preloaded if asked; returns its exit status */
+static int run(char *const argv[], int preload) {
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    if (preload)
+      setenv("LD_PRELOAD", FEX_TEST_LIBRARY, 1);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+/* The C array text of n bytes under a variable name */
+static char *c_array_text(const char *var, const unsigned char *src,
+                          size_t n) {
+  char *text = malloc(6 * n + 256);
+  if (!text)
+    return NULL;
+  char *p = text + sprintf(text, "unsigned char %s[] = {\n", var);
+  for (size_t i = 0; i < n; i++)
+    p += sprintf(p, i % 16 == 15 ? "0x%02x,\n" : "0x%02x, ", src[i]);
+  sprintf(p, "\n};\n\nunsigned long %s_SIZE = %zu;\n", var, n);
+  return text;
+}
+
+/* ========== CASES ========== */
+
+static int test_layout(void) {
+  unsigned char src[1000];
+  fill_random(src, sizeof(src), 1);
+  memset(src + 300, 0, 100);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/data.fex", dir);
+  CHECK(write_file(path, src, sizeof(src)) == 0);
+
+  size_t len;
+  unsigned char *text = render(path, FEX_FORMAT_C_ARRAY, &len);
+  char *expected = c_array_text("data", src, sizeof(src));
+  CHECK(text && expected);
+  CHECK(len == strlen(expected));
+  CHECK(memcmp(text, expected, len) == 0);
+
+  /* Reads at any offset agree with the whole */
+  fex_options_t opts = {FEX_FORMAT_C_ARRAY, NULL};
+  fex_handle_t *handle = fex_open(path, &opts);
+  CHECK(handle && fex_size(handle) == (off_t)len);
+  uint32_t seed = 7;
+  for (int i = 0; i < 200; i++) {
+    unsigned char buf[97];
+    seed = seed * 1103515245u + 12345u;
+    off_t offset = (seed >> 8) % len;
+    ssize_t n = fex_read_at(handle, offset, buf, sizeof(buf));
+    CHECK(n == (ssize_t)MIN(sizeof(buf), len - offset));
+    CHECK(memcmp(buf, text + offset, n) == 0);
+  }
+  CHECK(fex_read_at(handle, len, text, 1) == 0);
+
+  /* fex_render_all() writes the same text */
+  const char *out = in_dir("all.c");
+  FILE *fp = fopen(out, "wb");
+  CHECK(fp && fex_render_all(handle, fileno(fp)) == 0);
+  fclose(fp);
+  fex_close(handle);
+  size_t all_len;
+  unsigned char *all = read_file(out, &all_len);
+  CHECK(all && all_len == len && memcmp(all, text, len) == 0);
+
+  /* The raw format is the bytes themselves */
+  unsigned char *raw = render(path, FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == sizeof(src) && memcmp(raw, src, len) == 0);
+
+  free(all);
+  free(raw);
+  free(text);
+  free(expected);
+  return 0;
+}
+
+/* Checker linked with each rendered output: compares the embedded bytes
+ * with the file named on its command line */
+static const char checker[] =
+    "#include <stdio.h>\n"
+    "#include <string.h>\n"
+    "#ifdef FEX_TEST_HEADER\n"
+    "#include \"data.h\"\n"
+    "#else\n"
+    "extern unsigned char data[];\n"
+    "extern unsigned long data_SIZE;\n"
+    "#endif\n"
+    "#ifdef FEX_TEST_ZLIB\n"
+    "#include <zlib.h>\n"
+    "extern unsigned long data_ZSIZE;\n"
+    "#endif\n"
+    "static unsigned char expected[1 << 20], bytes[1 << 20];\n"
+    "int main(int argc, char **argv) {\n"
+    "  FILE *fp = fopen(argv[argc - 1], \"rb\");\n"
+    "  unsigned long n = fp ? fread(expected, 1, sizeof(expected), fp) : 0;\n"
+    "#ifdef FEX_TEST_ZLIB\n"
+    "  uLongf len = sizeof(bytes);\n"
+    "  if (uncompress(bytes, &len, data, data_ZSIZE) != Z_OK)\n"
+    "    return 2;\n"
+    "#else\n"
+    "  unsigned long len = data_SIZE;\n"
+    "  memcpy(bytes, data, len);\n"
+    "#endif\n"
+    "  return len == n && data_SIZE == n && "
+    "memcmp(bytes, expected, n) == 0 ? 0 : 1;\n"
+    "}\n";
+
+/* Build the checker against one rendered output and run it */
+static int check_output(const char *output, const char *define,
+                        int preload) {
+  char exe[PATH_MAX], include[PATH_MAX + 2];
+  snprintf(exe, sizeof(exe), "%s/check", dir);
+  snprintf(include, sizeof(include), "-I%s", dir);
+  char *cc[9];
+  int argc = 0;
+  cc[argc++] = FEX_TEST_CC;
+  cc[argc++] = "-o";
+  cc[argc++] = exe;
+  cc[argc++] = include;
+  cc[argc++] = (char *)in_dir("check.c");
+  cc[argc++] = (char *)output;
+  if (define)
+    cc[argc++] = (char *)define;
+  cc[argc++] = "-lz";
+  cc[argc] = NULL;
+  if (run(cc, preload) != 0) {
+    printf("cannot build %s\n", output);
+    return -1;
+  }
+  char *check[] = {exe, (char *)in_dir("data.fex"), NULL};
+  return run(check, 0);
+}
+
+/* Whether the compiler takes #embed */
+static int compiler_has_embed(void) {
+  const char *probe = in_dir("probe.c");
+  const char text[] = "static const unsigned char p[] = {\n"
+                      "#embed \"probe.c\"\n};\n";
+  char *cc[] = {FEX_TEST_CC, "-std=c2x", "-fsyntax-only", (char *)probe,
+                NULL};
+  return write_file(probe, text, sizeof(text) - 1) == 0 && run(cc, 0) == 0;
+}
+
+static int test_formats(void) {
+  static unsigned char src[20000];
+  fill_random(src, sizeof(src), 2);
+  memset(src + 5000, 'A', 10000); /* Something to compress */
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/data.fex", dir);
+  CHECK(write_file(path, src, sizeof(src)) == 0);
+  CHECK(write_file(in_dir("check.c"), checker, sizeof(checker) - 1) == 0);
+
+  /* C array, and the header format declaring what it defines */
+  CHECK(render_to(path, FEX_FORMAT_C_ARRAY, in_dir("data_c.c")) == 0);
+  CHECK(check_output(in_dir("data_c.c"), NULL, 0) == 0);
+  CHECK(render_to(path, FEX_FORMAT_HEADER, in_dir("data.h")) == 0);
+  CHECK(check_output(in_dir("data_c.c"), "-DFEX_TEST_HEADER", 0) == 0);
+
+  /* ELF object */
+  CHECK(render_to(path, FEX_FORMAT_ELF_OBJECT, in_dir("data.o")) == 0);
+  CHECK(check_output(in_dir("data.o"), NULL, 0) == 0);
+
+  /* zlib stream with its sizes */
+  CHECK(render_to(path, FEX_FORMAT_ZLIB, in_dir("data_z.c")) == 0);
+  CHECK(check_output(in_dir("data_z.c"), "-DFEX_TEST_ZLIB", 0) == 0);
+
+  /* incbin and embed name the raw view, which only the preload serves */
+  char raw_view[PATH_MAX + 8];
+  snprintf(raw_view, sizeof(raw_view), "%s.raw", path);
+  size_t len;
+  char *text = (char *)render(path, FEX_FORMAT_INCBIN, &len);
+  CHECK(text && strstr(text, raw_view) && strstr(text, ".incbin"));
+  free(text);
+  CHECK(render_to(path, FEX_FORMAT_INCBIN, in_dir("data_incbin.c")) == 0);
+  CHECK(check_output(in_dir("data_incbin.c"), NULL, 1) == 0);
+
+  text = (char *)render(path, FEX_FORMAT_EMBED, &len);
+  CHECK(text && strstr(text, raw_view) && strstr(text, "#embed"));
+  free(text);
+  if (compiler_has_embed()) {
+    CHECK(render_to(path, FEX_FORMAT_EMBED, in_dir("data_embed.c")) == 0);
+    CHECK(check_output(in_dir("data_embed.c"), "-std=c2x", 1) == 0);
+  } else {
+    printf("compiler has no #embed; embed output checked as text only\n");
+  }
+  return 0;
+}
+
+static int test_pointer(void) {
+  unsigned char blob[5000];
+  fill_random(blob, sizeof(blob), 3);
+  CHECK(write_file(in_dir("blob.bin"), blob, sizeof(blob)) == 0);
+
+  /* A relative path is taken from the manifest's directory */
+  const char range[] = "#!fex pointer\npath blob.bin\noffset 100\n"
+                       "length 1000\n";
+  const char *path = in_dir("range.fex");
+  CHECK(write_file(path, range, sizeof(range) - 1) == 0);
+  size_t len;
+  unsigned char *raw = render(path, FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == 1000 && memcmp(raw, blob + 100, len) == 0);
+  free(raw);
+
+  char *text = (char *)render(path, FEX_FORMAT_C_ARRAY, &len);
+  char *expected = c_array_text("range", blob + 100, 1000);
+  CHECK(text && expected && strcmp(text, expected) == 0);
+  free(text);
+  free(expected);
+
+  /* Without a length the range runs to the end; a past-the-end offset
+   * leaves nothing */
+  const char tail[] = "#!fex pointer\npath blob.bin\noffset 4000\n";
+  path = in_dir("tail.fex");
+  CHECK(write_file(path, tail, sizeof(tail) - 1) == 0);
+  raw = render(path, FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == 1000 && memcmp(raw, blob + 4000, len) == 0);
+  free(raw);
+
+  const char past[] = "#!fex pointer\npath blob.bin\noffset 9000\n";
+  path = in_dir("past.fex");
+  CHECK(write_file(path, past, sizeof(past) - 1) == 0);
+  raw = render(path, FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == 0);
+  free(raw);
+  return 0;
+}
+
+static void put_le16(unsigned char *p, unsigned v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  put_le16(p, v & 0xffff);
+  put_le16(p + 2, v >> 16);
+}
+
+typedef struct {
+  const char *name;
+  const unsigned char *data;
+  size_t size;
+  int deflate;
+} zip_entry_t;
+
+/* Write a zip of stored and deflated members */
+static int write_zip(const char *path, const zip_entry_t *entries, int count) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  unsigned char central[4096];
+  size_t central_len = 0;
+  long offset = 0;
+  for (int i = 0; i < count; i++) {
+    const zip_entry_t *e = &entries[i];
+    uLongf packed_len = compressBound(e->size);
+    unsigned char *packed = malloc(packed_len);
+    if (!packed)
+      return -1;
+    if (e->deflate) {
+      z_stream stream;
+      memset(&stream, 0, sizeof(stream));
+      deflateInit2(&stream, 9, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+      stream.next_in = (unsigned char *)e->data;
+      stream.avail_in = e->size;
+      stream.next_out = packed;
+      stream.avail_out = packed_len;
+      deflate(&stream, Z_FINISH);
+      packed_len = stream.total_out;
+      deflateEnd(&stream);
+    } else {
+      memcpy(packed, e->data, e->size);
+      packed_len = e->size;
+    }
+    uint32_t crc = crc32(0, e->data, e->size);
+    size_t name_len = strlen(e->name);
+
+    unsigned char local[30] = {0};
+    put_le32(local, 0x04034b50);
+    put_le16(local + 4, 20);
+    put_le16(local + 8, e->deflate ? 8 : 0);
+    put_le32(local + 14, crc);
+    put_le32(local + 18, packed_len);
+    put_le32(local + 22, e->size);
+    put_le16(local + 26, name_len);
+    fwrite(local, 1, sizeof(local), fp);
+    fwrite(e->name, 1, name_len, fp);
+    fwrite(packed, 1, packed_len, fp);
+    free(packed);
+
+    unsigned char *h = central + central_len;
+    memset(h, 0, 46);
+    put_le32(h, 0x02014b50);
+    put_le16(h + 4, 20);
+    put_le16(h + 6, 20);
+    put_le16(h + 10, e->deflate ? 8 : 0);
+    put_le32(h + 16, crc);
+    put_le32(h + 20, packed_len);
+    put_le32(h + 24, e->size);
+    put_le16(h + 28, name_len);
+    put_le32(h + 42, offset);
+    memcpy(h + 46, e->name, name_len);
+    central_len += 46 + name_len;
+    offset += sizeof(local) + name_len + packed_len;
+  }
+  fwrite(central, 1, central_len, fp);
+
+  unsigned char end[22] = {0};
+  put_le32(end, 0x06054b50);
+  put_le16(end + 8, count);
+  put_le16(end + 10, count);
+  put_le32(end + 12, central_len);
+  put_le32(end + 16, offset);
+  fwrite(end, 1, sizeof(end), fp);
+  return fclose(fp);
+}
+
+/* Write a ustar archive of one member */
+static int write_tar(const char *path, const char *name,
+                     const unsigned char *data, size_t size) {
+  unsigned char header[512] = {0};
+  snprintf((char *)header, 100, "%s", name);
+  memcpy(header + 100, "0000644", 8);
+  memcpy(header + 108, "0000000", 8);
+  memcpy(header + 116, "0000000", 8);
+  snprintf((char *)header + 124, 12, "%011o", (unsigned)size);
+  memcpy(header + 136, "00000000000", 12);
+  header[156] = '0';
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  memset(header + 148, ' ', 8);
+  unsigned sum = 0;
+  for (int i = 0; i < 512; i++)
+    sum += header[i];
+  snprintf((char *)header + 148, 8, "%06o", sum);
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  static const unsigned char zeros[1024];
+  fwrite(header, 1, sizeof(header), fp);
+  fwrite(data, 1, size, fp);
+  fwrite(zeros, 1, (512 - size % 512) % 512, fp);
+  fwrite(zeros, 1, sizeof(zeros), fp);
+  return fclose(fp);
+}
+
+static int test_archive(void) {
+  static unsigned char stored[700], text[30000], member[1500];
+  fill_random(stored, sizeof(stored), 4);
+  for (size_t i = 0; i < sizeof(text); i++)
+    text[i] = "embedded text\n"[i % 14];
+  fill_random(member, sizeof(member), 5);
+
+  zip_entry_t entries[] = {
+      {"dir/stored.bin", stored, sizeof(stored), 0},
+      {"dir/packed.txt", text, sizeof(text), 1},
+  };
+  CHECK(write_zip(in_dir("arch.zip.fex"), entries, 2) == 0);
+  CHECK(write_tar(in_dir("arch.tar.fex"), "a/b.bin", member,
+                  sizeof(member)) == 0);
+
+  size_t len;
+  unsigned char *raw =
+      render(in_dir("arch.zip.fex/dir/stored.bin"), FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == sizeof(stored) && memcmp(raw, stored, len) == 0);
+  free(raw);
+  raw = render(in_dir("arch.zip.fex/dir/packed.txt"), FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == sizeof(text) && memcmp(raw, text, len) == 0);
+  free(raw);
+  raw = render(in_dir("arch.tar.fex/a/b.bin"), FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == sizeof(member) && memcmp(raw, member, len) == 0);
+  free(raw);
+
+  /* A member renders under its own name */
+  char *c_text =
+      (char *)render(in_dir("arch.tar.fex/a/b.bin"), FEX_FORMAT_C_ARRAY, &len);
+  char *expected = c_array_text("b", member, sizeof(member));
+  CHECK(c_text && expected && strcmp(c_text, expected) == 0);
+  free(c_text);
+  free(expected);
+
+  CHECK(!render(in_dir("arch.zip.fex/dir/missing"), FEX_FORMAT_RAW, &len));
+
+  /* A pointer manifest can name a range of a member */
+  const char pointer[] = "#!fex pointer\npath arch.zip.fex\n"
+                         "member dir/packed.txt\noffset 10\nlength 100\n";
+  CHECK(write_file(in_dir("member.fex"), pointer, sizeof(pointer) - 1) == 0);
+  raw = render(in_dir("member.fex"), FEX_FORMAT_RAW, &len);
+  CHECK(raw && len == 100 && memcmp(raw, text + 10, len) == 0);
+  free(raw);
+  return 0;
+}
+
+static int test_bundle(void) {
+  unsigned char one[300], two[500];
+  fill_random(one, sizeof(one), 6);
+  fill_random(two, sizeof(two), 7);
+  CHECK(mkdir(in_dir("assets.fexbundle"), 0755) == 0);
+  CHECK(write_file(in_dir("assets.fexbundle/two.bin"), two, sizeof(two)) == 0);
+  CHECK(write_file(in_dir("assets.fexbundle/one.bin"), one, sizeof(one)) == 0);
+
+  /* Members in name order, each as its C array */
+  size_t len;
+  char *text = (char *)render(in_dir("assets.fexbundle"), -1, &len);
+  char *first = c_array_text("one", one, sizeof(one));
+  char *second = c_array_text("two", two, sizeof(two));
+  CHECK(text && first && second);
+  CHECK(len == strlen(first) + strlen(second));
+  CHECK(strncmp(text, first, strlen(first)) == 0);
+  CHECK(strcmp(text + strlen(first), second) == 0);
+  free(text);
+  free(first);
+  free(second);
+
+  /* A list file names members relative to itself */
+  const char list[] = "# assets\nassets.fexbundle/two.bin\n";
+  CHECK(write_file(in_dir("list.fexbundle"), list, sizeof(list) - 1) == 0);
+  text = (char *)render(in_dir("list.fexbundle"), -1, &len);
+  second = c_array_text("two", two, sizeof(two));
+  CHECK(text && second && strcmp(text, second) == 0);
+  free(text);
+  free(second);
+
+  /* Two members defining one variable cannot be one translation unit */
+  CHECK(mkdir(in_dir("x"), 0755) == 0 && mkdir(in_dir("y"), 0755) == 0);
+  CHECK(write_file(in_dir("x/logo.png"), one, sizeof(one)) == 0);
+  CHECK(write_file(in_dir("y/logo.jpg"), two, sizeof(two)) == 0);
+  const char clash[] = "x/logo.png\ny/logo.jpg\n";
+  CHECK(write_file(in_dir("clash.fexbundle"), clash, sizeof(clash) - 1) == 0);
+  CHECK(!render(in_dir("clash.fexbundle"), -1, &len));
+  return 0;
+}
+
+/* The child of write_decode: writes the C text file named on the command
+ * line to stdout with write(), in uneven pieces */
+static int write_child(const char *path) {
+  size_t len;
+  unsigned char *text = read_file(path, &len);
+  if (!text)
+    return 1;
+  for (size_t done = 0; done < len;) {
+    size_t piece = MIN(len - done, (size_t)4099);
+    ssize_t n = write(STDOUT_FILENO, text + done, piece);
+    if (n <= 0)
+      return 1;
+    done += n;
+  }
+  free(text);
+  return 0;
+}
+
+static int test_write_decode(void) {
+  static unsigned char src[50000];
+  fill_random(src, sizeof(src), 8);
+  CHECK(write_file(in_dir("data.fex"), src, sizeof(src)) == 0);
+  CHECK(render_to(in_dir("data.fex"), FEX_FORMAT_C_ARRAY,
+                  in_dir("data.c")) == 0);
+
+  /* As the shell's "child data.c > out.fex" */
+  const char *out = in_dir("out.fex");
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+      _exit(127);
+    close(fd);
+    setenv("LD_PRELOAD", FEX_TEST_LIBRARY, 1);
+    setenv("FEX_WRITE_DECODE", "1", 1);
+    execl(self_path, self_path, "write_child", in_dir("data.c"),
+          (char *)NULL);
+    _exit(127);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0);
+
+  size_t len;
+  unsigned char *decoded = read_file(out, &len);
+  CHECK(decoded && len == sizeof(src) && memcmp(decoded, src, len) == 0);
+  free(decoded);
+  return 0;
+}
+
+/* ========== MAIN ========== */
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} cases[] = {
+    {"layout", test_layout},   {"formats", test_formats},
+    {"pointer", test_pointer}, {"archive", test_archive},
+    {"bundle", test_bundle},   {"write_decode", test_write_decode},
+};
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "write_child") == 0)
+    return write_child(argv[2]);
+  if (argc != 2) {
+    fprintf(stderr, "usage: test_api case\n");
+    return 2;
+  }
+
+  ssize_t n = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+  if (n < 0 || !mkdtemp(dir)) {
+    perror("test_api");
+    return 1;
+  }
+  self_path[n] = '\0';
+
+  int result = -1;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (strcmp(cases[i].name, argv[1]) == 0) {
+      printf("Testing %s...\n", argv[1]);
+      result = cases[i].run();
+    }
+  }
+  if (result < 0)
+    fprintf(stderr, "test_api: no case %s\n", argv[1]);
+
+  char *rm[] = {"rm", "-rf", dir, NULL};
+  run(rm, 0);
+  if (result == 0)
+    printf("All tests passed!\n");
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,495 @@
+/* test_preload - read() under the preload against the fex_open() API
+ *
+ * usage: test_preload case
+ *
+ * Each case works in a fresh temporary directory. It renders its sources
+ * with fex_render_all() and runs itself with libfex preloaded to read the
+ * same paths back with read(), which must return the same text:
+ *   parallel  requests of 8 MB and more, rendered in parallel chunks, in
+ *             the medium and large tiers
+ *   chdir     a relative path resolves against the new directory after
+ *             chdir()
+ *   patterns  FEX_PATTERNS rules select what is rendered, replacing *.fex
+ *   tiers     small, medium and large sources, read in small and large
+ *             pieces with the tier thresholds lowered and at the defaults
+ *   blocks    sequential, strided and random reads that grow and shrink
+ *             the block buffer
+ *   cache     the rendered chunk cache across opens, for two ranges of one
+ *             file, with room for everything and with evictions
+ *   holes     a sparse source, whose holes render without moving the file
+ *             offset of the descriptor read
+ */
+#define _GNU_SOURCE
+#include "fex.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);          \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+static char dir[] = "/tmp/fex_test_XXXXXX";
+static char self_path[PATH_MAX];
+
+/* ========== HELPERS ========== */
+
+/* A path in the test directory, valid until the fourth call after */
+static const char *in_dir(const char *name) {
+  static char paths[4][PATH_MAX];
+  static int next = 0;
+  char *path = paths[next++ % 4];
+  snprintf(path, PATH_MAX, "%s/%s", dir, name);
+  return path;
+}
+
+static void fill_random(unsigned char *buf, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = seed >> 16;
+  }
+}
+
+static int write_file(const char *path, const void *data, size_t len) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  size_t n = fwrite(data, 1, len, fp);
+  return (fclose(fp) == 0 && n == len) ? 0 : -1;
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  rewind(fp);
+  unsigned char *data = malloc(size + 1);
+  if (data && fread(data, 1, size, fp) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  if (data) {
+    data[size] = '\0';
+    *len = size;
+  }
+  return data;
+}
+
+/* A random source of len bytes at path */
+static int write_random(const char *path, size_t len, uint32_t seed) {
+  unsigned char *data = malloc(len);
+  if (!data)
+    return -1;
+  fill_random(data, len, seed);
+  int result = write_file(path, data, len);
+  free(data);
+  return result;
+}
+
+/* Render path with fex_render_all() into the file expected */
+static int render_expected(const char *path, const char *expected) {
+  fex_handle_t *handle = fex_open(path, NULL);
+  if (!handle)
+    return -1;
+  int fd = open(expected, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int result = fd >= 0 ? fex_render_all(handle, fd) : -1;
+  if (fd >= 0 && close(fd) != 0)
+    result = -1;
+  fex_close(handle);
+  return result;
+}
+
+/* Run this program as a child under the preload, with env ("NAME=value"
+ * strings) added and the child operations in ops; returns its status */
+static int run_child(char *const env[], const char *const ops[]) {
+  char *argv[32] = {self_path, "child"};
+  size_t argc = 2;
+  for (size_t i = 0; ops[i] && argc + 1 < sizeof(argv) / sizeof(argv[0]); i++)
+    argv[argc++] = (char *)ops[i];
+  argv[argc] = NULL;
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    for (size_t i = 0; env && env[i]; i++)
+      putenv(env[i]);
+    setenv("LD_PRELOAD", FEX_TEST_LIBRARY, 1);
+    execv(self_path, argv);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+/* ========== CHILD ========== */
+
+#define READ_AT 1     /* Open with openat() on the cwd, not open() */
+#define READ_OFFSET 2 /* The descriptor's own file offset must stay at 0 */
+
+/* The kernel's file offset of fd, which the preload's lseek() hides */
+static long kernel_offset(int fd) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+  FILE *fp = fopen(path, "r");
+  long pos = -1;
+  while (fp && fgets(line, sizeof(line), fp))
+    sscanf(line, "pos: %ld", &pos);
+  if (fp)
+    fclose(fp);
+  return pos;
+}
+
+/* Open path, read it with read() in pieces of chunk bytes and compare the
+ * text with the file expected; flags are READ_* */
+static int read_back(const char *path, const char *expected, size_t chunk,
+                     int flags) {
+  size_t len;
+  unsigned char *want = read_file(expected, &len);
+  unsigned char *got = malloc(len + chunk);
+  int fd = (flags & READ_AT) ? openat(AT_FDCWD, path, O_RDONLY)
+                             : open(path, O_RDONLY);
+  CHECK(want && got && fd >= 0);
+  /* Stop once past len, so more text than expected cannot overflow got */
+  size_t done = 0;
+  ssize_t n = 0;
+  while (done <= len && (n = read(fd, got + done, chunk)) > 0)
+    done += n;
+  CHECK(n == 0 && done == len && memcmp(got, want, len) == 0);
+  if (flags & READ_OFFSET)
+    CHECK(kernel_offset(fd) == 0);
+  CHECK(close(fd) == 0);
+  free(want);
+  free(got);
+  return 0;
+}
+
+/* Read count bytes of fd at offset after lseek() and compare them with
+ * the same range of want */
+static int read_range(int fd, const unsigned char *want, size_t len,
+                      off_t offset, size_t count) {
+  unsigned char got[8192];
+  count = MIN(count, sizeof(got));
+  size_t expect = offset < (off_t)len ? MIN(count, len - offset) : 0;
+  CHECK(lseek(fd, offset, SEEK_SET) == offset);
+  CHECK(read(fd, got, count) == (ssize_t)expect);
+  CHECK(memcmp(got, want + offset, expect) == 0);
+  return 0;
+}
+
+/* Read path sequentially, then in strides and at random offsets, then
+ * sequentially again, comparing every piece with the file expected */
+static int seek_back(const char *path, const char *expected) {
+  size_t len;
+  unsigned char *want = read_file(expected, &len);
+  int fd = open(path, O_RDONLY);
+  CHECK(want && fd >= 0);
+
+  off_t offset = 0;
+  for (; offset < (off_t)len / 4; offset += 3000)
+    CHECK(read_range(fd, want, len, offset, 3000) == 0);
+  for (int i = 0; i < 64; i++, offset += 1000000)
+    CHECK(read_range(fd, want, len, offset % len, 500) == 0);
+  uint32_t seed = 1;
+  for (int i = 0; i < 256; i++) {
+    seed = seed * 1103515245u + 12345u;
+    CHECK(read_range(fd, want, len, seed % len, 777) == 0);
+  }
+  for (offset = len / 2; offset < (off_t)len + 5000; offset += 5000)
+    CHECK(read_range(fd, want, len, offset, 5000) == 0);
+
+  CHECK(close(fd) == 0);
+  free(want);
+  return 0;
+}
+
+/* The operations of a child, run in order:
+ *   read PATH EXPECTED CHUNK    read_back() through open()
+ *   readat PATH EXPECTED CHUNK  read_back() through openat()
+ *   holes PATH EXPECTED CHUNK   read_back() keeping the file offset at 0
+ *   seek PATH EXPECTED          seek_back()
+ *   cd DIR                      chdir() */
+static int child(int argc, char **argv) {
+  for (int i = 0; i < argc;) {
+    if (strcmp(argv[i], "cd") == 0 && i + 1 < argc) {
+      CHECK(chdir(argv[i + 1]) == 0);
+      i += 2;
+    } else if (strcmp(argv[i], "seek") == 0 && i + 2 < argc) {
+      CHECK(seek_back(argv[i + 1], argv[i + 2]) == 0);
+      i += 3;
+    } else if ((strcmp(argv[i], "read") == 0 ||
+                strcmp(argv[i], "readat") == 0 ||
+                strcmp(argv[i], "holes") == 0) &&
+               i + 3 < argc) {
+      size_t chunk = strtoul(argv[i + 3], NULL, 0);
+      int flags = strcmp(argv[i], "readat") == 0  ? READ_AT
+                  : strcmp(argv[i], "holes") == 0 ? READ_OFFSET
+                                                  : 0;
+      CHECK(read_back(argv[i + 1], argv[i + 2], chunk, flags) == 0);
+      i += 4;
+    } else {
+      printf("test_preload: bad child operation %s\n", argv[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* ========== CASES ========== */
+
+static int test_parallel(void) {
+  /* 2 MB renders to 12 MB of text; 9 MB reads pass the 8 MB default */
+  CHECK(write_random(in_dir("big.fex"), 2 * 1024 * 1024, 1) == 0);
+  CHECK(render_expected(in_dir("big.fex"), in_dir("big.txt")) == 0);
+
+  char threads[] = "FEX_THREADS=4";
+  char large[] = "FEX_LARGE_FILE=1048576";
+  char *medium_env[] = {threads, NULL};
+  char *large_env[] = {threads, large, NULL};
+  const char *ops[] = {"read", in_dir("big.fex"), in_dir("big.txt"),
+                       "9437184", NULL};
+  CHECK(run_child(medium_env, ops) == 0);
+  CHECK(run_child(large_env, ops) == 0);
+  return 0;
+}
+
+static int test_chdir(void) {
+  /* The same relative names in two directories, rendered from each.
+   * openat() resolves them through the path cache, and the ".raw" name is
+   * virtual: the preload finds its source itself */
+  char a[PATH_MAX], b[PATH_MAX], text[4][PATH_MAX];
+  snprintf(a, sizeof(a), "%s", in_dir("a"));
+  snprintf(b, sizeof(b), "%s", in_dir("b"));
+  CHECK(mkdir(a, 0755) == 0 && mkdir(b, 0755) == 0);
+  CHECK(write_random(in_dir("a/asset.fex"), 5000, 2) == 0);
+  CHECK(write_random(in_dir("b/asset.fex"), 7000, 3) == 0);
+  const char *renders[4][2] = {{"a/asset.fex", "a.txt"},
+                               {"a/asset.fex.raw", "a_raw.txt"},
+                               {"b/asset.fex", "b.txt"},
+                               {"b/asset.fex.raw", "b_raw.txt"}};
+  for (int i = 0; i < 4; i++) {
+    snprintf(text[i], PATH_MAX, "%s", in_dir(renders[i][1]));
+    CHECK(render_expected(in_dir(renders[i][0]), text[i]) == 0);
+  }
+
+  const char *ops[] = {
+      "cd",     a,
+      "readat", "asset.fex",     text[0], "4096",
+      "read",   "asset.fex.raw", text[1], "4096",
+      "cd",     b,
+      "readat", "asset.fex",     text[2], "4096",
+      "read",   "asset.fex.raw", text[3], "4096",
+      "cd",     a,
+      "readat", "asset.fex",     text[0], "4096",
+      NULL};
+  CHECK(run_child(NULL, ops) == 0);
+  return 0;
+}
+
+static int test_patterns(void) {
+  CHECK(mkdir(in_dir("assets"), 0755) == 0);
+  CHECK(mkdir(in_dir("other"), 0755) == 0);
+  CHECK(write_random(in_dir("logo.asset"), 3000, 4) == 0);
+  CHECK(write_random(in_dir("assets/icon.bin"), 3000, 5) == 0);
+  CHECK(render_expected(in_dir("logo.asset"), in_dir("logo.txt")) == 0);
+  CHECK(render_expected(in_dir("assets/icon.bin"), in_dir("icon.txt")) == 0);
+
+  /* Paths no rule matches read as they are, *.fex included */
+  CHECK(write_random(in_dir("other/icon.bin"), 3000, 6) == 0);
+  CHECK(write_random(in_dir("other.txt"), 3000, 6) == 0);
+  CHECK(write_random(in_dir("plain.fex"), 3000, 7) == 0);
+  CHECK(write_random(in_dir("plain.txt"), 3000, 7) == 0);
+
+  char patterns[] = "FEX_PATTERNS=*.asset:assets/*.bin";
+  char *env[] = {patterns, NULL};
+  char paths[8][PATH_MAX];
+  const char *names[8] = {"logo.asset", "logo.txt",       "assets/icon.bin",
+                          "icon.txt",   "plain.fex",      "plain.txt",
+                          "other/icon.bin", "other.txt"};
+  for (int i = 0; i < 8; i++)
+    snprintf(paths[i], PATH_MAX, "%s", in_dir(names[i]));
+  const char *ops[] = {
+      "read",   paths[0],          paths[1], "4096",
+      "read",   paths[2],          paths[3], "4096",
+      "read",   paths[4],          paths[5], "4096",
+      "read",   paths[6],          paths[7], "4096",
+      "cd",     dir,
+      "readat", "assets/icon.bin", paths[3], "4096",
+      "readat", "other/icon.bin",  paths[7], "4096",
+      NULL};
+  CHECK(run_child(env, ops) == 0);
+  return 0;
+}
+
+static int test_tiers(void) {
+  /* With the thresholds below, one source in each tier */
+  static const struct {
+    const char *source;
+    const char *text;
+    size_t size;
+  } files[] = {{"small.fex", "small.txt", 1000},
+               {"medium.fex", "medium.txt", 20000},
+               {"large.fex", "large.txt", 200000}};
+  char paths[3][2][PATH_MAX];
+  for (int i = 0; i < 3; i++) {
+    snprintf(paths[i][0], PATH_MAX, "%s", in_dir(files[i].source));
+    snprintf(paths[i][1], PATH_MAX, "%s", in_dir(files[i].text));
+    CHECK(write_random(paths[i][0], files[i].size, 8 + i) == 0);
+    CHECK(render_expected(paths[i][0], paths[i][1]) == 0);
+  }
+
+  char small[] = "FEX_SMALL_FILE=4096";
+  char large[] = "FEX_LARGE_FILE=65536";
+  char *env[] = {small, large, NULL};
+  const char *ops[] = {
+      "read", paths[0][0], paths[0][1], "4099",
+      "read", paths[0][0], paths[0][1], "100000",
+      "read", paths[1][0], paths[1][1], "4099",
+      "read", paths[1][0], paths[1][1], "100000",
+      "read", paths[2][0], paths[2][1], "4099",
+      "read", paths[2][0], paths[2][1], "100000",
+      NULL};
+  CHECK(run_child(env, ops) == 0);
+  CHECK(run_child(NULL, ops) == 0);
+  return 0;
+}
+
+static int test_blocks(void) {
+  /* 4 MB is in the medium tier, served from the block buffer; blocks of
+   * at most 64 KB keep strides and random reads missing it */
+  const char *source = in_dir("blocks.fex");
+  const char *text = in_dir("blocks.txt");
+  CHECK(write_random(source, 4 * 1024 * 1024, 11) == 0);
+  CHECK(render_expected(source, text) == 0);
+
+  char max_block[] = "FEX_MAX_BLOCK_SIZE=65536";
+  char *env[] = {max_block, NULL};
+  const char *ops[] = {"seek", source, text, NULL};
+  CHECK(run_child(env, ops) == 0);
+  return 0;
+}
+
+static int test_cache(void) {
+  /* Chunks are keyed by file and range start: the whole blob and a range
+   * of it must not share them */
+  CHECK(write_random(in_dir("blob.bin"), 1024 * 1024, 12) == 0);
+  const char whole[] = "#!fex pointer\npath blob.bin\n";
+  const char part[] = "#!fex pointer\npath blob.bin\noffset 100000\n"
+                      "length 300000\n";
+  CHECK(write_file(in_dir("whole.fex"), whole, sizeof(whole) - 1) == 0);
+  CHECK(write_file(in_dir("part.fex"), part, sizeof(part) - 1) == 0);
+  char paths[4][PATH_MAX];
+  const char *names[4] = {"whole.fex", "whole.txt", "part.fex", "part.txt"};
+  for (int i = 0; i < 4; i++)
+    snprintf(paths[i], PATH_MAX, "%s", in_dir(names[i]));
+  CHECK(render_expected(paths[0], paths[1]) == 0);
+  CHECK(render_expected(paths[2], paths[3]) == 0);
+
+  /* 16 MB holds every chunk; 256 KB evicts all the time */
+  char roomy[] = "FEX_RENDER_CACHE=16777216";
+  char tight[] = "FEX_RENDER_CACHE=262144";
+  char *roomy_env[] = {roomy, NULL};
+  char *tight_env[] = {tight, NULL};
+  const char *ops[] = {
+      "read", paths[0], paths[1], "4099",
+      "read", paths[2], paths[3], "4099",
+      "read", paths[0], paths[1], "65536",
+      "seek", paths[0], paths[1],
+      "read", paths[2], paths[3], "65536",
+      NULL};
+  CHECK(run_child(roomy_env, ops) == 0);
+  CHECK(run_child(tight_env, ops) == 0);
+  return 0;
+}
+
+static int test_holes(void) {
+  /* Data at the start and in the middle, holes between and at the end */
+  const char *source = in_dir("sparse.fex");
+  const char *text = in_dir("sparse.txt");
+  static unsigned char data[64 * 1024];
+  fill_random(data, sizeof(data), 13);
+  int fd = open(source, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0);
+  CHECK(pwrite(fd, data, sizeof(data), 0) == (ssize_t)sizeof(data));
+  CHECK(pwrite(fd, data, sizeof(data), 3 * 1024 * 1024 + 123) ==
+        (ssize_t)sizeof(data));
+  CHECK(ftruncate(fd, 6 * 1024 * 1024) == 0 && close(fd) == 0);
+  CHECK(render_expected(source, text) == 0);
+
+  /* In the medium tier, then in the large one */
+  char large[] = "FEX_LARGE_FILE=1048576";
+  char *large_env[] = {large, NULL};
+  const char *ops[] = {"holes", source, text, "65536",
+                       "holes", source, text, "1000003",
+                       "seek",  source, text, NULL};
+  CHECK(run_child(NULL, ops) == 0);
+  CHECK(run_child(large_env, ops) == 0);
+  return 0;
+}
+
+/* ========== MAIN ========== */
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} cases[] = {
+    {"parallel", test_parallel},
+    {"chdir", test_chdir},
+    {"patterns", test_patterns},
+    {"tiers", test_tiers},
+    {"blocks", test_blocks},
+    {"cache", test_cache},
+    {"holes", test_holes},
+};
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "child") == 0)
+    return child(argc - 2, argv + 2);
+  if (argc != 2) {
+    fprintf(stderr, "usage: test_preload case\n");
+    return 2;
+  }
+
+  ssize_t n = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+  if (n < 0 || !mkdtemp(dir)) {
+    perror("test_preload");
+    return 1;
+  }
+  self_path[n] = '\0';
+
+  int result = -1;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (strcmp(cases[i].name, argv[1]) == 0) {
+      printf("Testing %s...\n", argv[1]);
+      result = cases[i].run();
+    }
+  }
+  if (result < 0)
+    fprintf(stderr, "test_preload: no case %s\n", argv[1]);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("rm", "rm", "-rf", dir, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+  if (result == 0)
+    printf("All tests passed!\n");
+  return result == 0 ? 0 : 1;
+}